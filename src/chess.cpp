@@ -11,7 +11,65 @@
 //--player-side(-ps) [w/b] : set the side for the human player (default: w)
 //--position(-p) [FEN string] : set the starting position using a FEN string (default: standard chess starting position)
 /*you can use https://mutsuntsai.github.io/fen-tool/ or https://www.redhotpawn.com/chess/chess-fen-viewer.php for FEN strings*/
-//--time-control(-tc) [time in seconds] : set the time control for each player (default: unlimited)
+//--time-control(-tc) [seconds, seconds+increment or moves/seconds+increment] : set the time control for each player,
+//engines then get wtime/btime instead of a fixed depth (default: unlimited)
+//--time-margin(-tm) [milliseconds] : how long an engine may overrun its time before it loses (default: 0)
+//--ponder(-po) : engines think on the opponent's time (for engine-vs-engine mode)
+//--engine1-threads(-et1)/--engine2-threads(-et2) [threads] : Threads option of the engine (default: the engine's)
+//--engine1-hash(-eh1)/--engine2-hash(-eh2) [MB] : Hash option of the engine (default: the engine's)
+//--engine1-option(-eo1)/--engine2-option(-eo2) [name=value] : any other engine option, can be given several times
+//--pin : give every game of a match its own cores (on one NUMA node if possible) and pin its engines to them,
+//engines without --engineN-hash share half of the memory
+//--info-log(-il) [file.json/file.csv] : write the engines' search info for every move (game N of a match goes to file-N.json)
+//--games(-g) [number of games] : play a match of several games (for engine-vs-engine mode, default: 1)
+//--concurrency(-c) [number of workers] : number of games played in parallel in a match (default: 1)
+//--openings(-o) [file.epd/file.fen/file.pgn] : start every pair of games from the next opening of a suite,
+//the engines swap colors between the two games of a pair (for engine-vs-engine mode)
+//--opening-order(-oo) [sequential/random] : go through the suite in file order or sample it (default: sequential)
+//--seed(-s) [number] : seed for the random opening order (default: random, printed at the start of a match)
+//--opening-plies(-op) [plies] : most book moves taken from a PGN game (default: all)
+//--sprt [elo0,elo1 or elo0,elo1,alpha,beta] : stop the match as soon as a sequential probability ratio test
+//decides between the two Elo differences, --games is then the most games played (default: off, alpha/beta 0.05)
+//--resign [moves,centipawns] : a side loses when both engines see it that far down for that many moves in a row
+//--draw [move,moves,centipawns] : draw once both engines keep the score within that many centipawns
+//for that many moves in a row, from the given move number on
+//--tb-path(-tb) [directory] : Syzygy tablebases for the engines, positions they probe are adjudicated by the result
+//--tb-pieces(-tbp) [pieces] : most pieces for tablebase adjudication (default: 5 when --tb-path is given)
+//--archive(-a) [file] : append every finished game to a binary archive (and its index file.idx)
+//--eval-cache(-ec) [file] : keep the results of fixed depth searches in a file, a search that was done before
+//isn't sent to the engine again (also for analyse)
+//--eval-cache-size(-ecs) [MB] : size of a new eval cache file (default: 64)
+//--headless(-hl) : no board rendering or progress output, only results (for engine-vs-engine mode)
+//--log-level(-ll) [error/warn/info/debug] : most detailed log messages shown, debug adds every move (default: info)
+//--log-dir(-ld) [directory] : write the log of game N to directory/game-N.log instead of the console
+//--server(-sv) [port] : serve a page on http://127.0.0.1:port/ that shows the running games of a match live
+//(WebSocket /ws, JSON /state) and can pause, resume, abort or add games
+//--journal(-j) [file] : write the openings taken and the games finished by a match to an append-only journal,
+//the new file must not exist yet (for engine-vs-engine mode, not with --coordinator)
+//--resume(-rs) : continue the match of --journal where it stopped, only games that weren't finished are played
+//--journal-sync(-js) [milliseconds] : most time between two syncs of the journal to disk (default: 1000)
+//--coordinator(-co) [port, host:port or unix:path] : play the match on remote workers that connect there,
+//they get single games and send back the results, games of lost workers are played again (for engine-vs-engine mode)
+//a bare port only takes workers from this machine
+//--token(-tk) [secret] : workers must send it to join the --coordinator, needed when it listens on a host
+
+//========SUBCOMMANDS:========//
+//perft [--position(-p) FEN] [--depth(-d) N] [--threads(-t) N] [--divide] : count leaf nodes of the move tree
+//perft --suite [--threads(-t) N] : check the move generator against known node counts
+//pgn --input(-i) archive [--output(-o) file.pgn] [--game(-g) N] : convert a game archive to PGN, or only its Nth game (default: to stdout)
+//datagen --engine(-e) path --output(-o) file [--games(-g) N] [--positions(-P) N] [--depth(-d) N | --nodes(-n) N]
+//[--random-plies(-r) N] [--threads(-t) N] [--seed(-s) N] [--move-timeout(-mt) seconds] [--resign/--draw/--tb-path as above] :
+//self-play training positions
+//analyse --engine(-e) path [--input(-i) file.epd (default: - for stdin)] [--output(-o) file] [--engines(-E) N]
+//[--depth(-d) N | --nodes(-n) N] [--unordered] [--eval-cache(-ec) file] : search every position of a list,
+//one EPD result line each
+//bench [--stub(-s) path] [--games(-g) N] : play games against the stub engine and report the harness overhead
+//bench --fen [--positions(-P) N] [--input(-i) file.epd] : how fast FENs are read and written
+//index --input(-i) file.pgn [--input(-i) more.pgn] --output(-o) file.idx [--threads(-t) N] [--plies(-P) N]
+//[--memory(-m) MB] : index every position of PGN files with the games that reached it and the moves played there
+//query --index(-x) file.idx [--position(-p) FEN] [--games(-g) N] : games, results and next moves of a position
+//worker --connect(-C) [host:port or unix:path] [--token(-tk) secret] [--concurrency(-c) N] [--batch(-b) N] [engine paths and options,
+//--pin, --tb-path, --eval-cache, --log-level/--log-dir as above] : play games for a --coordinator with local engines
 
 
 //======= Includes =======//
@@ -20,596 +78,8030 @@
 #include <string>
 #include <vector>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cctype>
+#include <string_view>
+#include <charconv>
 #include <cmath>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <cstdarg>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <csignal>
+#include <random>
+#include <map>
+#include <deque>
+#include <queue>
+#include <new>
+#include <memory>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sched.h>
+#include <dirent.h>
+#endif
 
-/*======= Engine communication =======*/
+extern char** environ;
 
-/*This function sends a message to the chess engine
-and reads its response. It returns the main line of the response
-as a string.*/
+#ifdef CHESS_BENCH
+//Heap allocations of the whole program, the bench mode reports them per move.
+//Every form of new and delete is replaced, so they all use malloc and free.
+std::atomic<uint64_t> allocation_count{0};
 
-void send_message(std::string message,FILE* engine){
-    fputs((message+"\n").c_str(), engine);
-    fflush(engine);
+//GCC sees free() on memory from operator new once these are inlined, but here both sides are ours
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void* operator new(size_t size){
+    allocation_count.fetch_add(1,std::memory_order_relaxed);
+    if (void* memory = malloc(size ? size : 1)){
+        return memory;
+    }
+    throw std::bad_alloc();
 }
-//Reads engine response until a known terminating line is found
-std::string read_response(FILE* engine){
-    //Reads engine response until a known terminating line is found
-    char buffer[256];
-    while (fgets(buffer, sizeof(buffer), engine)) {
-        std::string line(buffer);
-        //std::cout << line;
-        //Check for known terminating lines
-        if (line.find("uciok")==0 || line.find("readyok")==0 ||
-        line.find("Unknown command")==0 || line.find("bestmove")==0 ||
-        line.find("registration")==0 || line.find("copyprotection")==0 ||
-        line.find("Nodes")==0){
-            break;
-        }
-    } 
-    std::cout << '\n';
-    std::string line(buffer);
-    return line;
+void* operator new[](size_t size){
+    return operator new(size);
 }
-
-std::string talk_with_engine(std::string message, FILE* engine){
-    send_message(message,engine);
-    return read_response(engine);
+void* operator new(size_t size, std::align_val_t alignment){
+    allocation_count.fetch_add(1,std::memory_order_relaxed);
+    size_t align = std::max(size_t(alignment),sizeof(void*));
+    void* memory = nullptr;
+    if (posix_memalign(&memory,align,size ? size : 1)==0){
+        return memory;
+    }
+    throw std::bad_alloc();
 }
+void* operator new[](size_t size, std::align_val_t alignment){
+    return operator new(size,alignment);
+}
+void operator delete(void* memory) noexcept{
+    free(memory);
+}
+void operator delete(void* memory, size_t) noexcept{
+    free(memory);
+}
+void operator delete[](void* memory) noexcept{
+    free(memory);
+}
+void operator delete[](void* memory, size_t) noexcept{
+    free(memory);
+}
+void operator delete(void* memory, std::align_val_t) noexcept{
+    free(memory);
+}
+void operator delete(void* memory, size_t, std::align_val_t) noexcept{
+    free(memory);
+}
+void operator delete[](void* memory, std::align_val_t) noexcept{
+    free(memory);
+}
+void operator delete[](void* memory, size_t, std::align_val_t) noexcept{
+    free(memory);
+}
+#pragma GCC diagnostic pop
+#endif
 
-/*======= Board class =======*/
-/*This is where all the board data is stored: 
-its state, number of moves, and so on. 
-It also contains all the main functions for interacting with it.*/
+/*======= Logging =======*/
+/*Diagnostics of the game loops don't go to the terminal directly. Every
+thread writes its messages into its own ring buffer (one producer, one
+consumer, no lock), a background thread takes them out and writes them to
+the console or to one file per game. A full buffer drops the message
+instead of waiting, so a slow terminal never holds up a game.*/
 
-class Board{
-    public: 
+enum LogLevel {LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG};
 
-    //======= Board data =======//
-    char board[8][8]; //8x8 board representation
-    char side; //Side to move
-    std::string castling; //Castling rights
-    std::string en_passant; //En passant target square
-    int half_move_counter; //Half move counter
-    int move_counter; //Full move counter
-    std::string fen; //FEN string representation
+struct LogMessage{
+    int level; //LogLevel of the message
+    int game; //Game the message belongs to (from 0), -1 for the whole run
+    int64_t time_us; //Microseconds since the logger started
+    uint16_t length; //Bytes used in text
+    char text[234]; //Message without the line break, cut if longer
+};
 
-    std::vector<std::string> move_history; //Move history
+class LogQueue{
+    public:
+    static const size_t SIZE = 1024; //Messages in the ring, a power of two
+    LogMessage messages[SIZE];
+    std::atomic<size_t> head{0}; //Messages written by the owning thread
+    std::atomic<size_t> tail{0}; //Messages taken by the writer thread
 
-    //======= Game settings =======//
-    char player_side; //Side of the human player (default: w)
-    std::string game_mode; //Game mode (default: human-vs-engine)
-    int engine1_depth; //Engine search depth (default: 1)
-    int engine2_depth; //Engine search depth (default: 1)
-    long long time_control1; //Time control in milliseconds, but write it in seconds (default: 2**64 for unlimited)
-    long long time_control2; //Time control in milliseconds, but write it in seconds (default: 2**64 for unlimited)
-    std::string engine1_path; //Path to the engine executable (default: ./stockfish)
-    std::string engine2_path; //Path to the second engine executable (for engine-vs-engine mode)
-    char engine1_side; //Side for engine 1 (for engine-vs-engine mode)
-    char engine2_side; //Side for engine 2 (for engine-vs-engine mode)
+    //Called by the owning thread only, false when the ring is full
+    bool push(const LogMessage& message){
+        size_t position = head.load(std::memory_order_relaxed);
+        if (position-tail.load(std::memory_order_acquire)==SIZE){
+            return false;
+        }
+        messages[position%SIZE] = message;
+        head.store(position+1,std::memory_order_release);
+        return true;
+    }
 
-//======= Board constructor =======//
-    Board(){
-        //Default constructor initializing standard chess starting position
-        fen="rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
-        set_position(fen,stdout);
-        player_side='w';
-        side = 'w';
-        game_mode="human-vs-human";
-        engine1_path = "Stockfish/src/stockfish";
-        engine2_path = "Stockfish/src/stockfish";
-        time_control1=10*100000;
-        time_control2=10*100000;
-        engine1_side = 'w';
-        engine2_side = 'b';
-        engine1_depth=1;
-        engine2_depth=1;
+    //Called by the writer thread only, false when the ring is empty
+    bool pop(LogMessage& message){
+        size_t position = tail.load(std::memory_order_relaxed);
+        if (position==head.load(std::memory_order_acquire)){
+            return false;
+        }
+        message = messages[position%SIZE];
+        tail.store(position+1,std::memory_order_release);
+        return true;
     }
-    
-//======= Board functions =======//
+};
 
-//Gets the current position in UCI format
-    std::string get_uci_line(){
-        std::string pos="";
-        //FEN generation
-        for (int i=0;i<8;i++){
-            int empty_count=0;
-            for (int j=0;j<8;j++){
-                //Counting empty squares
-                if (board[i][j]=='.'){
-                    empty_count++;
-                }
-                else{
-                    if (empty_count>0){
-                        pos+=std::to_string(empty_count);
-                        empty_count=0;
+class Logger{
+    public:
+    std::atomic<int> level{LOG_INFO}; //Messages above this level are thrown away right away
+    std::string game_dir; //Directory for the per-game files, empty to log games to the console
+    std::atomic<uint64_t> dropped{0}; //Messages lost to a full ring
+    std::atomic<int64_t> pending{0}; //Messages queued but not written yet
+
+    ~Logger(){
+        stop();
+    }
+
+    //Starts the writer thread. Games log to dir/game-N.log if dir isn't empty.
+    bool start(int log_level, std::string dir){
+        level = log_level;
+        game_dir = dir;
+        if (!game_dir.empty() && mkdir(game_dir.c_str(),0755)!=0 && errno!=EEXIST){
+            return false;
+        }
+        start_time = std::chrono::steady_clock::now();
+        running = true;
+        writer = std::thread(&Logger::write_loop,this);
+        return true;
+    }
+
+    //Stops the writer thread after everything queued is written
+    void stop(){
+        if (!running){
+            return;
+        }
+        running = false;
+        writer.join();
+        write_queued();
+        for (FILE* file : files){
+            if (file){
+                fclose(file);
+            }
+        }
+        files.clear();
+        if (dropped>0){
+            fprintf(stdout,"Log: %llu messages dropped\n",(unsigned long long)dropped.load());
+            dropped = 0;
+        }
+        fflush(stdout);
+    }
+
+    //Waits until everything logged so far is written, for output that must come after it
+    void flush(){
+        while (running && pending.load()>0){
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+    //Checks if a message of this level would be kept, to skip building expensive ones
+    bool enabled(int message_level){
+        return message_level<=level.load(std::memory_order_relaxed);
+    }
+
+    //Queues a printf style message. Without a writer thread it is written right away.
+    void log(int message_level, int game, const char* format, ...) __attribute__((format(printf,4,5))){
+        if (!enabled(message_level)){
+            return;
+        }
+        LogMessage message;
+        message.level = message_level;
+        message.game = game;
+        message.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now()-start_time).count();
+        va_list args;
+        va_start(args,format);
+        int length = vsnprintf(message.text,sizeof(message.text),format,args);
+        va_end(args);
+        message.length = uint16_t(std::clamp<int>(length,0,sizeof(message.text)-1));
+        if (!running){
+            write(message);
+            fflush(stdout);
+            return;
+        }
+        thread_local LogQueue* queue = nullptr;
+        if (!queue){
+            queue = new LogQueue();
+            std::lock_guard<std::mutex> lock(mutex);
+            queues.push_back(queue);
+        }
+        pending++;
+        if (!queue->push(message)){
+            pending--;
+            dropped++;
+        }
+    }
+
+    private:
+    std::mutex mutex; //Guards queues, only taken when a thread logs for the first time
+    std::vector<LogQueue*> queues; //Rings of all threads that ever logged, never freed
+    std::atomic<bool> running{false};
+    std::thread writer;
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    std::vector<FILE*> files; //Open per-game files by game number (writer thread only)
+    std::vector<bool> created; //Per-game files that were started in this run
+
+    //Writes one message to its file or the console
+    void write(const LogMessage& message){
+        if (message.game<0 || game_dir.empty()){
+            if (message.game>=0){
+                fprintf(stdout,"Game %d: ",message.game+1);
+            }
+            fwrite(message.text,1,message.length,stdout);
+            fputc('\n',stdout);
+            return;
+        }
+        size_t game = size_t(message.game);
+        if (files.size()<=game){
+            files.resize(game+1,nullptr);
+            created.resize(game+1,false);
+        }
+        if (!files[game]){
+            //Keep the number of open files bounded, a game that logs again is appended to
+            if (std::count(files.begin(),files.end(),nullptr)+64<=ptrdiff_t(files.size())){
+                for (FILE*& file : files){
+                    if (file){
+                        fclose(file);
+                        file = nullptr;
                     }
-                    pos+=board[i][j];
                 }
             }
-            if (empty_count>0){
-                pos+=std::to_string(empty_count);
-            }
-            if (i!=7){
-                pos+='/';
+            std::string path = game_dir+"/game-"+std::to_string(game+1)+".log";
+            files[game] = fopen(path.c_str(),created[game] ? "a" : "w");
+            created[game] = true;
+            if (!files[game]){
+                return;
             }
         }
-    //Other FEN data
-        pos = pos +' ' + side + ' ' + castling + ' ' + en_passant + ' ' + 
-        std::to_string(half_move_counter) + ' ' + std::to_string(move_counter);
-        return pos;
+        fprintf(files[game],"[%9.3f] ",message.time_us/1e6);
+        fwrite(message.text,1,message.length,files[game]);
+        fputc('\n',files[game]);
     }
 
-//Sets the board position from a FEN string
-    void set_position(std::string pos, FILE* engine){
-        //Send position to engine
-        int i = 0;
-        int row = 0;
-        int col = 0;
-        std::string alf_num = "0123456789";
-        //Parsing FEN string
-        while (pos[i]!=' '){
-            if (pos[i]=='/'){
-                i++;
-                row ++;
-                col = 0;
-            }
-            if (alf_num.find(pos[i])==std::string::npos){
-                board[row][col]=pos[i];
-                col++;
-                i++;
+    //Writes everything that is queued, returns the number of messages
+    size_t write_queued(){
+        std::vector<LogQueue*> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            snapshot = queues;
+        }
+        size_t count = 0;
+        LogMessage message;
+        for (LogQueue* queue : snapshot){
+            while (queue->pop(message)){
+                write(message);
+                count++;
             }
-            else{
-                for (int j=0;j<int(pos[i]-'0');j++){
-                    board[row][col]='.';
-                    col++;
+        }
+        if (count){
+            fflush(stdout);
+            for (FILE* file : files){
+                if (file){
+                    fflush(file);
                 }
-                i++;
             }
+            pending -= count;
         }
-        std::cout << "Board position set.\n";
-        i++;
-        side=pos[i];
-        i+=2;
-        castling="";
-        while (pos[i]!=' '){
-            castling+=pos[i];
-            i++;
-        }
-        i++;
-        en_passant="";
-        while (pos[i]!=' '){
-            en_passant+=pos[i];
-            i++;
+        return count;
+    }
+
+    void write_loop(){
+        while (running){
+            if (!write_queued()){
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
         }
-        i++;
-        std::string half_move_str="";
-        while (pos[i]!=' '){
-            half_move_str+=pos[i];
-            i++;
+    }
+};
+
+//The one logger of the program
+Logger logger;
+
+/*======= Engine process =======*/
+/*Engines are started with their own stdin/stdout pipes. Output is read
+in big chunks into a reusable buffer and cut into lines in place, so
+reading an "info" line costs no allocation. Lines are handed out as
+string_view and stay valid until the next read from the same engine.*/
+
+//Checks if a line starts with the given prefix
+bool starts_with(std::string_view line, std::string_view prefix){
+    return line.size()>=prefix.size() && line.compare(0,prefix.size(),prefix)==0;
+}
+
+class LineBuffer{
+    public:
+    std::vector<char> data; //Buffer memory, reused for the whole engine life
+    size_t begin=0; //First byte not handed out yet
+    size_t end=0; //End of the bytes read so far
+
+    LineBuffer(size_t size=1<<16) : data(size) {}
+
+    //Takes the next complete line out of the buffer (without the line break)
+    bool next_line(std::string_view& line){
+        const char* start = data.data()+begin;
+        const char* newline = (const char*)memchr(start,'\n',end-begin);
+        if (!newline){
+            return false;
         }
-        half_move_counter=std::stoi(half_move_str);
-        i++;
-        std::string move_str="";
-        while (i<int(pos.size())){
-            move_str+=pos[i];
-            i++;
+        size_t length = newline-start;
+        if (length>0 && start[length-1]=='\r'){
+            length--;
         }
-        move_counter=std::stoi(move_str);
+        line = std::string_view(start,length);
+        begin += newline-start+1;
+        return true;
     }
 
-//Checks if a move is legal by asking the engine (not used currently)
-    bool move_check(std::string move,FILE* engine){
-        std::string right_moves = talk_with_engine("go perft 2",engine);
-        if (right_moves.find(move)!=std::string::npos){
-                std::cout<<"Move is legal.\n";
-                return true;
+    //Makes room for the next read and returns where to write
+    char* write_ptr(){
+        if (begin==end){
+            begin=end=0;
+        }
+        if (end==data.size()){
+            if (begin>0){
+                //Move the unfinished line to the front
+                memmove(data.data(),data.data()+begin,end-begin);
+                end-=begin;
+                begin=0;
             }
             else{
-                std::cout<<"Move is not legal.\n";
-                return false;
+                //A single line longer than the whole buffer
+                data.resize(data.size()*2);
             }
+        }
+        return data.data()+end;
     }
 
-//Makes a move on the board
-    void do_move(std::string move){
-        std::string alf="abcdefgh";
-        if (/*move_check(move,engine)*/true){
-            //Доска в board лежит в прпвильном порядке 
-            //но нумерайия строк обратная
-            //Castling handling
-            if (board[int(7-move[1]+'1')][alf.find(move[0])] == 'K' && move[0]=='e' && move[1]=='1' && move[2]=='g' && move[3]=='1'){
-                //White kingside castling
-                board[7][6]='K';
-                board[7][5]='R';
-                board[7][4]='.';
-                board[7][7]='.';
-                castling.erase(castling.find('K'),2);
-                side='b';
-                move_counter++;
-                return;
+    size_t write_space(){
+        return data.size()-end;
+    }
+};
+
+class Engine{
+    public:
+    pid_t pid=-1; //Engine process id
+    int input=-1; //Pipe to engine stdin
+    int output=-1; //Pipe from engine stdout (non-blocking)
+    LineBuffer buffer; //Engine output not processed yet
+    bool eof=false; //Engine closed its output
+    std::string path; //Command the engine was started with
+    std::string options; //Options set by setup_engine, part of the eval cache key
+
+    ~Engine(){
+        stop();
+    }
+
+//Starts the engine. The path goes through the shell like it did with popen,
+//so it can contain arguments.
+    bool start(const std::string& path){
+        int to_engine[2];
+        int from_engine[2];
+        if (!make_pipe(to_engine)){
+            return false;
+        }
+        if (!make_pipe(from_engine)){
+            close(to_engine[0]);
+            close(to_engine[1]);
+            return false;
+        }
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions,to_engine[0],0);
+        posix_spawn_file_actions_adddup2(&actions,from_engine[1],1);
+        std::string command = "exec "+path;
+        char* argv[] = {(char*)"sh",(char*)"-c",(char*)command.c_str(),nullptr};
+        int error = posix_spawn(&pid,"/bin/sh",&actions,nullptr,argv,environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(to_engine[0]);
+        close(from_engine[1]);
+        if (error!=0){
+            close(to_engine[1]);
+            close(from_engine[0]);
+            pid=-1;
+            return false;
+        }
+        input=to_engine[1];
+        output=from_engine[0];
+        this->path=path;
+        fcntl(output,F_SETFL,fcntl(output,F_GETFL)|O_NONBLOCK);
+        eof=false;
+        return true;
+    }
+
+//Sends one line to the engine
+    bool send(std::string_view message){
+        if (input<0){
+            return false;
+        }
+        char newline='\n';
+        iovec parts[2] = {{(void*)message.data(),message.size()},{&newline,1}};
+        size_t left = message.size()+1;
+        int part = 0;
+        while (left>0){
+            ssize_t written = writev(input,parts+part,2-part);
+            if (written<0){
+                if (errno==EINTR){
+                    continue;
+                }
+                return false;
             }
-            if (board[int(7-move[1]+'1')][alf.find(move[0])] == 'k' && move[0]=='e' && move[1]=='8' && move[2]=='g' && move[3]=='8'){
-                //Black kingside castling
-                board[0][6]='k';
-                board[0][5]='r';
-                board[0][4]='.';
-                board[0][7]='.';
-                castling.erase(castling.find('k'),2);
-                side='w';
-                move_counter++;
-                return;
+            left-=written;
+            //Skip what was already written
+            while (part<2 && size_t(written)>=parts[part].iov_len){
+                written-=parts[part].iov_len;
+                part++;
             }
-            if (board[int(7-move[1]+'1')][alf.find(move[0])] == 'K' && move[0]=='e' && move[1]=='1' && move[2]=='c' && move[3]=='1'){
-                //White queenside castling
-                board[7][2]='K';
-                board[7][3]='R';
-                board[7][4]='.';
-                board[7][0]='.';
-                castling.erase(castling.find('K'),2);
-                side='b';
-                move_counter++;
-                return;
+            if (part<2){
+                parts[part].iov_base=(char*)parts[part].iov_base+written;
+                parts[part].iov_len-=written;
             }
-            if (board[int(7-move[1]+'1')][alf.find(move[0])] == 'k' && move[0]=='e' && move[1]=='8' && move[2]=='c' && move[3]=='8'){
-                //Black queenside castling
-                board[0][2]='k';
-                board[0][3]='r';
-                board[0][4]='.';
-                board[0][0]='.';
-                castling.erase(castling.find('k'),2);
-                side='w';
-                move_counter++;
-                return;
+        }
+        return true;
+    }
+
+//Reads whatever the engine has written so far. Returns the number of bytes,
+//0 at end of output, -1 if nothing is available right now.
+    ssize_t fill(){
+        while (true){
+            char* target = buffer.write_ptr();
+            ssize_t count = read(output,target,buffer.write_space());
+            if (count>0){
+                buffer.end+=count;
+                return count;
             }
-            
-            //Updating castling rights if king or rook moved
-            if (board[int(7-move[1]+'1')][alf.find(move[0])] == 'K' && castling.find('K')!=std::string::npos || castling.find('Q')!=std::string::npos){
-                //White king moved, remove castling rights
-                castling.erase(castling.find('K'),1);
-                castling.erase(castling.find('Q'),1);
+            if (count==0){
+                eof=true;
+                return 0;
             }
-            if (board[int(7-move[1]+'1')][alf.find(move[0])] == 'k' && castling.find('k')!=std::string::npos || castling.find('q')!=std::string::npos){
-                //White king moved, remove castling rights
-                castling.erase(castling.find('k'),1);
-                castling.erase(castling.find('q'),1);
+            if (errno!=EINTR){
+                return -1;
             }
-            if (board[int(7-move[1]+'1')][alf.find(move[0])] == 'R' && move[0]=='h' && move[1]=='1' && castling.find('Q')!=std::string::npos){
-                //White kingside rook moved, remove castling rights
-                castling.erase(castling.find('Q'),1);
+        }
+    }
+
+//Gets the next line, waiting up to timeout_ms for it (-1 waits forever).
+//Returns 1 for a line, 0 on timeout, -1 if the engine is gone.
+    int read_line(std::string_view& line, int timeout_ms=-1){
+        while (true){
+            if (buffer.next_line(line)){
+                return 1;
             }
-            if (board[int(7-move[1]+'1')][alf.find(move[0])] == 'r' && move[0]=='h' && move[1]=='8' && castling.find('q')!=std::string::npos){
-                //Black kingside rook moved, remove castling rights
-                castling.erase(castling.find('q'),1);
+            if (eof || output<0){
+                return -1;
             }
-            if (board[int(7-move[1]+'1')][alf.find(move[0])] == 'R' && move[0]=='a' && move[1]=='1' && castling.find('K')!=std::string::npos){
-                //White queenside rook moved, remove castling rights
-                castling.erase(castling.find('K'),1);
+            if (fill()>0){
+                continue;
             }
-            if (board[int(7-move[1]+'1')][alf.find(move[0])] == 'r' && move[0]=='a' && move[1]=='8' && castling.find('k')!=std::string::npos){
-                //Black queenside rook moved, remove castling rights
-                std::cout<<castling<<'\n';
-                castling.erase(castling.find('k'),1);
+            if (eof){
+                return -1;
             }
-            
-            if (board[int(7-move[3]+'1')][alf.find(move[2])]=='.'){
-                half_move_counter++;
+            pollfd waiting = {output,POLLIN,0};
+            int ready = poll(&waiting,1,timeout_ms);
+            if (ready==0){
+                return 0;
             }
-            else{
-                half_move_counter=0;
+            if (ready<0 && errno!=EINTR){
+                return -1;
             }
+        }
+    }
 
-            board[int(7-move[3]+'1')][alf.find(move[2])]=board[int(7-move[1]+'1')][alf.find(move[0])];
-            board[int(7-move[1]+'1')][alf.find(move[0])]='.';
-            if (side=='w'){
-            side='b';
-            }
-            else{
-                side='w';
-            }
-            move_counter++;
+//Checks that the engine process is still there
+    bool running(){
+        if (pid<=0 || eof){
+            return false;
         }
-        
+        if (waitpid(pid,nullptr,WNOHANG)==pid){
+            pid=-1;
+            return false;
+        }
+        return true;
     }
 
-//Prints the board to console
-    void print_board(){
-        //Print board depending on player side
-        if (side=='w'){
-            for (int i=0;i<8;i++){
-                std::cout<<8-i<<" ";
-                for (int j=0;j<8;j++){
-                    std::cout<<board[i][j]<<" ";
+//Closes the pipes and waits for the engine to exit. An engine that is
+//still there after wait_ms gets killed.
+    void stop(int wait_ms=2000){
+        if (input>=0){
+            close(input);
+            input=-1;
+        }
+        if (output>=0){
+            close(output);
+            output=-1;
+        }
+        if (pid>0){
+            auto deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(wait_ms);
+            while (waitpid(pid,nullptr,WNOHANG)==0){
+                if (std::chrono::steady_clock::now()>=deadline){
+                    kill(pid,SIGKILL);
+                    waitpid(pid,nullptr,0);
+                    break;
                 }
-                std::cout<<'\n';
+                usleep(1000);
             }
-            std::cout<<"  a b c d e f g h\n";
+            pid=-1;
         }
-        else{
-            for (int i=7;i>=0;i--){
-                std::cout<<8-i<<" ";
-                for (int j=7;j>=0;j--){
-                    std::cout<<board[i][j]<<" ";
+    }
+
+    private:
+    static bool make_pipe(int fds[2]){
+#ifdef __linux__
+        return pipe2(fds,O_CLOEXEC)==0;
+#else
+        if (pipe(fds)!=0){
+            return false;
+        }
+        fcntl(fds[0],F_SETFD,FD_CLOEXEC);
+        fcntl(fds[1],F_SETFD,FD_CLOEXEC);
+        return true;
+#endif
+    }
+};
+
+/*Waits on many engines from one thread. Uses epoll on Linux and
+plain poll everywhere else.*/
+class EnginePoller{
+    public:
+    std::vector<Engine*> engines; //Watched engines
+#ifdef __linux__
+    int epoll_fd;
+    std::vector<epoll_event> events;
+
+    EnginePoller(){
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+    ~EnginePoller(){
+        close(epoll_fd);
+    }
+#endif
+
+    void add(Engine* engine){
+        engines.push_back(engine);
+#ifdef __linux__
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = engine;
+        epoll_ctl(epoll_fd,EPOLL_CTL_ADD,engine->output,&event);
+        events.resize(engines.size());
+#endif
+    }
+
+    void remove(Engine* engine){
+        engines.erase(std::remove(engines.begin(),engines.end(),engine),engines.end());
+#ifdef __linux__
+        epoll_ctl(epoll_fd,EPOLL_CTL_DEL,engine->output,nullptr);
+#endif
+    }
+
+//Fills ready with the engines that have output waiting (or have exited).
+//Returns the number of ready engines, 0 on timeout.
+    int wait(std::vector<Engine*>& ready, int timeout_ms=-1){
+        ready.clear();
+        //Lines already buffered don't need the kernel
+        for (Engine* engine : engines){
+            if (memchr(engine->buffer.data.data()+engine->buffer.begin,'\n',
+            engine->buffer.end-engine->buffer.begin)){
+                ready.push_back(engine);
+            }
+        }
+        if (!ready.empty()){
+            return ready.size();
+        }
+#ifdef __linux__
+        int count = epoll_wait(epoll_fd,events.data(),events.size(),timeout_ms);
+        for (int i=0;i<count;i++){
+            ready.push_back((Engine*)events[i].data.ptr);
+        }
+#else
+        std::vector<pollfd> fds;
+        for (Engine* engine : engines){
+            fds.push_back({engine->output,POLLIN,0});
+        }
+        int count = poll(fds.data(),fds.size(),timeout_ms);
+        for (size_t i=0;count>0 && i<fds.size();i++){
+            if (fds[i].revents){
+                ready.push_back(engines[i]);
+            }
+        }
+#endif
+        for (Engine* engine : ready){
+            engine->fill();
+        }
+        return ready.size();
+    }
+};
+
+/*======= Engine search info =======*/
+/*"info" lines are cut into tokens in place and read into a fixed-size
+struct, so following an engine at high depth allocates nothing. The
+last few lines of every search are kept in a small ring.*/
+
+//Checks for the whitespace that separates tokens
+inline bool is_separator(char c){
+    return c==' ' || c=='\t' || c=='\r' || c=='\n';
+}
+
+//Splits the next whitespace separated token off the front of text.
+//A plain loop: find_first_of with a character set is several times slower.
+std::string_view next_token(std::string_view& text){
+    size_t start = 0;
+    while (start<text.size() && is_separator(text[start])){
+        start++;
+    }
+    size_t end = start;
+    while (end<text.size() && !is_separator(text[end])){
+        end++;
+    }
+    std::string_view token = text.substr(start,end-start);
+    text.remove_prefix(end);
+    return token;
+}
+
+//Reads a whole token as a number, leaves value alone if it isn't one
+template<typename T>
+bool parse_number(std::string_view token, T& value){
+    auto result = std::from_chars(token.data(),token.data()+token.size(),value);
+    return result.ec==std::errc() && result.ptr==token.data()+token.size();
+}
+
+//Packs a UCI move (e2e4, e7e8q) into 16 bits without needing the position:
+//from | to<<6 | promotion<<12, promotion 1-4 for n, b, r, q
+uint16_t pack_uci_move(std::string_view text){
+    if (text.size()<4 || text.size()>5 || text[0]<'a' || text[0]>'h' || text[1]<'1' || text[1]>'8' ||
+    text[2]<'a' || text[2]>'h' || text[3]<'1' || text[3]>'8'){
+        return 0;
+    }
+    int promotion = 0;
+    if (text.size()==5){
+        const char* piece = strchr("nbrq",text[4]);
+        if (!piece || !text[4]){
+            return 0;
+        }
+        promotion = int(piece-"nbrq")+1;
+    }
+    return uint16_t(((text[1]-'1')*8+text[0]-'a') | ((text[3]-'1')*8+text[2]-'a')<<6 | promotion<<12);
+}
+
+//Writes a packed move as text, returns its length
+int unpack_uci_move(uint16_t code, char* text){
+    int from = code&63;
+    int to = (code>>6)&63;
+    text[0] = char('a'+from%8);
+    text[1] = char('1'+from/8);
+    text[2] = char('a'+to%8);
+    text[3] = char('1'+to/8);
+    if (code>>12){
+        text[4] = "nbrq"[(code>>12)-1];
+        return 5;
+    }
+    return 4;
+}
+
+struct SearchInfo{
+    int depth=0;
+    int seldepth=0;
+    int multipv=1;
+    bool has_score=false;
+    bool mate=false; //score is moves to mate, not centipawns
+    int score=0; //From the engine's point of view
+    int bound=0; //0 exact, 1 lowerbound, 2 upperbound
+    uint64_t nodes=0;
+    uint64_t nps=0;
+    int time=0; //Engine's search time in ms
+    int hashfull=0;
+    uint64_t tbhits=0;
+    int pv_length=0;
+    uint16_t pv[16]; //First moves of the principal variation (pack_uci_move)
+
+    //Score in centipawns, mate scores pushed far outside normal values
+    int score_cp() const{
+        if (!mate){
+            return score;
+        }
+        return score>0 ? 100000-score : -100000-score;
+    }
+};
+
+//Reads an "info" line. Returns false for lines without search data (info string, currmove...).
+bool parse_info(std::string_view line, SearchInfo* info){
+    if (next_token(line)!="info"){
+        return false;
+    }
+    *info = SearchInfo();
+    while (!line.empty()){
+        std::string_view key = next_token(line);
+        if (key=="depth") parse_number(next_token(line),info->depth);
+        else if (key=="seldepth") parse_number(next_token(line),info->seldepth);
+        else if (key=="multipv") parse_number(next_token(line),info->multipv);
+        else if (key=="nodes") parse_number(next_token(line),info->nodes);
+        else if (key=="nps") parse_number(next_token(line),info->nps);
+        else if (key=="time") parse_number(next_token(line),info->time);
+        else if (key=="hashfull") parse_number(next_token(line),info->hashfull);
+        else if (key=="tbhits") parse_number(next_token(line),info->tbhits);
+        else if (key=="lowerbound") info->bound = 1;
+        else if (key=="upperbound") info->bound = 2;
+        else if (key=="score"){
+            std::string_view kind = next_token(line);
+            info->mate = kind=="mate";
+            info->has_score = parse_number(next_token(line),info->score) && (info->mate || kind=="cp");
+        }
+        else if (key=="pv"){
+            while (!line.empty()){
+                uint16_t move = pack_uci_move(next_token(line));
+                if (!move){
+                    break;
+                }
+                if (info->pv_length<16){
+                    info->pv[info->pv_length++] = move;
                 }
-                std::cout<<'\n';
             }
-            std::cout<<"  h g f e d c b a\n";
         }
+        else if (key=="string" || key=="currmove" || key=="currline" || key=="refutation"){
+            return false;
+        }
+    }
+    return info->depth>0 && info->has_score;
+}
+
+//Last lines of one search, oldest first
+class InfoTrace{
+    public:
+    static const int SIZE = 8;
+    SearchInfo lines[SIZE];
+    int count=0; //Lines seen in this search
+
+    void clear(){
+        count=0;
+    }
+
+    //Takes the line if it is a main line search update
+    void add(std::string_view line){
+        SearchInfo info;
+        if (parse_info(line,&info) && info.multipv==1){
+            push(info);
+        }
+    }
+
+    //Takes an already parsed update
+    void push(const SearchInfo& info){
+        lines[count%SIZE] = info;
+        count++;
+    }
+
+    const SearchInfo* last() const{
+        return count ? &lines[(count-1)%SIZE] : nullptr;
+    }
+};
+
+/*======= Engine communication =======*/
+
+/*This function sends a message to the chess engine
+and reads its response. It returns the main line of the response
+as a string.*/
+
+void send_message(std::string_view message,Engine* engine){
+    engine->send(message);
+}
+//Checks for the lines that end an engine response
+bool is_terminator(std::string_view line){
+    return starts_with(line,"uciok") || starts_with(line,"readyok") ||
+    starts_with(line,"Unknown command") || starts_with(line,"bestmove") ||
+    starts_with(line,"registration") || starts_with(line,"copyprotection") ||
+    starts_with(line,"Nodes");
+}
+
+//Reads engine response until a known terminating line is found.
+//Gives up after timeout_ms (-1 waits forever) and returns an empty string.
+//Search info lines go to trace if one is given.
+std::string read_response(Engine* engine, int timeout_ms=-1, InfoTrace* trace=nullptr){
+    //Reads engine response until a known terminating line is found
+    std::string_view line;
+    auto deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(timeout_ms);
+    int wait = timeout_ms;
+    while (engine->read_line(line,wait)==1) {
+        //std::cout << line;
+        if (trace && starts_with(line,"info ")){
+            trace->add(line);
+        }
+        //Check for known terminating lines
+        else if (is_terminator(line)){
+            return std::string(line);
+        }
+        //Info lines count against the time too, an engine that keeps talking still runs out of it
+        if (timeout_ms>=0){
+            wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline-std::chrono::steady_clock::now()).count();
+            if (wait<=0){
+                return "";
+            }
+        }
+    }
+    return "";
+}
+
+//Gets the move out of a "bestmove e2e4 ponder e7e5" line
+std::string bestmove_token(std::string line){
+    size_t end = line.find(' ',9);
+    return line.size()>9 ? line.substr(9,end==std::string::npos ? std::string::npos : end-9) : "";
+}
+
+std::string talk_with_engine(std::string message, Engine* engine){
+    send_message(message,engine);
+    return read_response(engine);
+}
+
+/*======= Bitboards =======*/
+/*Squares are numbered a1=0, b1=1 ... h8=63. Every piece kind has its own
+64-bit set of squares, attacks come from tables built once at startup.*/
+
+typedef uint64_t Bitboard;
+typedef uint16_t Move; //from (6 bits) | to (6 bits) | flag (4 bits)
+
+enum Color {WHITE, BLACK};
+enum PieceType {PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING};
+const int NO_PIECE = 12; //Pieces are color*6+type, this marks an empty square
+const int NO_SQUARE = -1;
+
+enum MoveFlag {
+    QUIET=0, DOUBLE_PUSH=1, KING_CASTLE=2, QUEEN_CASTLE=3,
+    CAPTURE=4, EN_PASSANT=5, PROMOTION=8, PROMOTION_CAPTURE=12
+};
+enum CastlingRight {WHITE_OO=1, WHITE_OOO=2, BLACK_OO=4, BLACK_OOO=8};
+
+const char piece_chars[] = "PNBRQKpnbrqk.";
+
+//Piece of a FEN letter, NO_PIECE for any other character
+inline int piece_index(char c){
+    switch (c){
+        case 'P': return 0; case 'N': return 1; case 'B': return 2; case 'R': return 3; case 'Q': return 4; case 'K': return 5;
+        case 'p': return 6; case 'n': return 7; case 'b': return 8; case 'r': return 9; case 'q': return 10; case 'k': return 11;
+    }
+    return NO_PIECE;
+}
+
+inline Move make_move_code(int from, int to, int flag){
+    return Move(from | to<<6 | flag<<12);
+}
+inline int move_from(Move move){ return move&63; }
+inline int move_to(Move move){ return (move>>6)&63; }
+inline int move_flag(Move move){ return move>>12; }
+inline bool is_capture(Move move){ return move_flag(move)&CAPTURE; }
+inline bool is_promotion(Move move){ return move_flag(move)&PROMOTION; }
+
+inline int lsb(Bitboard b){ return __builtin_ctzll(b); }
+inline int msb(Bitboard b){ return 63-__builtin_clzll(b); }
+inline int popcount(Bitboard b){ return __builtin_popcountll(b); }
+inline int pop_lsb(Bitboard& b){
+    int square = lsb(b);
+    b &= b-1;
+    return square;
+}
+inline Bitboard square_bb(int square){ return Bitboard(1)<<square; }
+
+const Bitboard RANK_1 = 0xFFULL;
+const Bitboard RANK_3 = RANK_1<<16;
+const Bitboard RANK_6 = RANK_1<<40;
+const Bitboard RANK_8 = RANK_1<<56;
+
+//Attack tables. Rays 0-3 go up the board (N, E, NE, NW), 4-7 go down (S, W, SW, SE).
+struct AttackTables{
+    Bitboard knight[64];
+    Bitboard king[64];
+    Bitboard pawn[2][64];
+    Bitboard rays[8][64];
+    uint8_t castling_mask[64]; //Castling rights kept when a piece leaves or enters a square
+
+    AttackTables(){
+        const int ray_steps[8][2] = {{0,1},{1,0},{1,1},{-1,1},{0,-1},{-1,0},{-1,-1},{1,-1}};
+        const int knight_steps[8][2] = {{1,2},{2,1},{2,-1},{1,-2},{-1,-2},{-2,-1},{-2,1},{-1,2}};
+        for (int square=0;square<64;square++){
+            int file = square%8;
+            int rank = square/8;
+            knight[square]=king[square]=pawn[WHITE][square]=pawn[BLACK][square]=0;
+            for (int i=0;i<8;i++){
+                knight[square] |= step_bb(file+knight_steps[i][0],rank+knight_steps[i][1]);
+                king[square] |= step_bb(file+ray_steps[i][0],rank+ray_steps[i][1]);
+                rays[i][square]=0;
+                int f = file+ray_steps[i][0];
+                int r = rank+ray_steps[i][1];
+                while (f>=0 && f<8 && r>=0 && r<8){
+                    rays[i][square] |= square_bb(r*8+f);
+                    f+=ray_steps[i][0];
+                    r+=ray_steps[i][1];
+                }
+            }
+            pawn[WHITE][square] = step_bb(file-1,rank+1) | step_bb(file+1,rank+1);
+            pawn[BLACK][square] = step_bb(file-1,rank-1) | step_bb(file+1,rank-1);
+            castling_mask[square] = 15;
+        }
+        castling_mask[0] = 15 & ~WHITE_OOO;
+        castling_mask[4] = 15 & ~(WHITE_OO|WHITE_OOO);
+        castling_mask[7] = 15 & ~WHITE_OO;
+        castling_mask[56] = 15 & ~BLACK_OOO;
+        castling_mask[60] = 15 & ~(BLACK_OO|BLACK_OOO);
+        castling_mask[63] = 15 & ~BLACK_OO;
+    }
+
+    static Bitboard step_bb(int file, int rank){
+        return (file>=0 && file<8 && rank>=0 && rank<8) ? square_bb(rank*8+file) : 0;
+    }
+};
+
+const AttackTables attack_tables;
+
+//Zobrist keys. They come from a fixed seed, so a position has the same key
+//in every run and keys can be kept in files.
+struct ZobristKeys{
+    uint64_t pieces[12][64];
+    uint64_t castling[16];
+    uint64_t en_passant[8];
+    uint64_t side;
+
+    ZobristKeys(){
+        uint64_t seed = 0x9E3779B97F4A7C15ULL;
+        for (int piece=0;piece<12;piece++){
+            for (int square=0;square<64;square++){
+                pieces[piece][square] = next(seed);
+            }
+        }
+        for (int i=0;i<16;i++){
+            castling[i] = next(seed);
+        }
+        for (int i=0;i<8;i++){
+            en_passant[i] = next(seed);
+        }
+        side = next(seed);
+    }
+
+    //splitmix64
+    static uint64_t next(uint64_t& state){
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z>>30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z>>27)) * 0x94D049BB133111EBULL;
+        return z ^ (z>>31);
+    }
+};
+
+const ZobristKeys zobrist;
+
+//Slider attacks along one ray, stopping at the first blocker
+inline Bitboard ray_attacks(int dir, int square, Bitboard occupied){
+    Bitboard attacks = attack_tables.rays[dir][square];
+    Bitboard blockers = attacks & occupied;
+    if (blockers){
+        int first = dir<4 ? lsb(blockers) : msb(blockers);
+        attacks ^= attack_tables.rays[dir][first];
+    }
+    return attacks;
+}
+inline Bitboard rook_attacks(int square, Bitboard occupied){
+    return ray_attacks(0,square,occupied) | ray_attacks(1,square,occupied) |
+    ray_attacks(4,square,occupied) | ray_attacks(5,square,occupied);
+}
+inline Bitboard bishop_attacks(int square, Bitboard occupied){
+    return ray_attacks(2,square,occupied) | ray_attacks(3,square,occupied) |
+    ray_attacks(6,square,occupied) | ray_attacks(7,square,occupied);
+}
+
+//Fixed size move list, no allocation during move generation
+struct MoveList{
+    Move moves[256];
+    int size=0;
+
+    void add(Move move){ moves[size++]=move; }
+    Move* begin(){ return moves; }
+    Move* end(){ return moves+size; }
+};
+
+/*======= Position class =======*/
+/*Bitboard position with make/unmake and a legal move generator.
+Board keeps one of these to validate moves and to find the end of
+the game without asking the engine.*/
+
+class Position{
+    public:
+    Bitboard pieces[2][6]; //Squares of every piece kind
+    Bitboard colors[2]; //All white / all black pieces
+    Bitboard occupied; //All pieces
+    uint8_t squares[64]; //Piece on every square (NO_PIECE for empty)
+    int side; //Side to move
+    int castling; //Castling rights (CastlingRight bits)
+    int en_passant; //En passant target square (NO_SQUARE if none)
+    int half_move_counter; //Half moves since last capture or pawn move
+    int move_counter; //Full move counter
+    uint64_t key; //Zobrist key, updated with every piece change
+
+    //Everything make_move can't recompute on unmake
+    struct Undo{
+        uint8_t captured;
+        uint8_t castling;
+        int8_t en_passant;
+        int half_move_counter;
+        uint64_t key;
+    };
+
+    Position(){
+        set_fen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+    }
+
+    void clear(){
+        for (int c=0;c<2;c++){
+            for (int t=0;t<6;t++){
+                pieces[c][t]=0;
+            }
+            colors[c]=0;
+        }
+        occupied=0;
+        for (int square=0;square<64;square++){
+            squares[square]=NO_PIECE;
+        }
+        side=WHITE;
+        castling=0;
+        en_passant=NO_SQUARE;
+        half_move_counter=0;
+        move_counter=1;
+        key=zobrist.castling[0];
+    }
+
+    template<bool update_key=true>
+    void put_piece(int piece, int square){
+        Bitboard bb = square_bb(square);
+        pieces[piece/6][piece%6] |= bb;
+        colors[piece/6] |= bb;
+        occupied |= bb;
+        squares[square] = piece;
+        if (update_key){
+            key ^= zobrist.pieces[piece][square];
+        }
+    }
+
+    template<bool update_key=true>
+    void remove_piece(int square){
+        int piece = squares[square];
+        Bitboard bb = square_bb(square);
+        pieces[piece/6][piece%6] ^= bb;
+        colors[piece/6] ^= bb;
+        occupied ^= bb;
+        squares[square] = NO_PIECE;
+        if (update_key){
+            key ^= zobrist.pieces[piece][square];
+        }
+    }
+
+    template<bool update_key=true>
+    void move_piece(int from, int to){
+        int piece = squares[from];
+        Bitboard bb = square_bb(from) | square_bb(to);
+        pieces[piece/6][piece%6] ^= bb;
+        colors[piece/6] ^= bb;
+        occupied ^= bb;
+        squares[to] = piece;
+        squares[from] = NO_PIECE;
+        if (update_key){
+            key ^= zobrist.pieces[piece][from] ^ zobrist.pieces[piece][to];
+        }
+    }
+
+//Sets the position from a FEN string, returns false if it can't be read.
+//The counters may be left out, anything after them makes the FEN invalid.
+    bool set_fen(std::string_view fen){
+        return parse_fen(fen,false);
+    }
+
+//Forgets an en passant square no pawn can take on, as do_move does, so a
+//FEN written with the square after every double step gets the key of the
+//same position reached by moves
+    void drop_unusable_en_passant(){
+        if (en_passant!=NO_SQUARE && !(attack_tables.pawn[side^1][en_passant] & pieces[side][PAWN])){
+            key ^= zobrist.en_passant[en_passant%8];
+            en_passant = NO_SQUARE;
+        }
+    }
+
+//Sets the position from an EPD line: the four FEN fields, then operations
+//that are ignored. Two numbers right after the fields are read as counters.
+    bool set_epd(std::string_view line){
+        return parse_fen(line,true);
+    }
+
+//Reads the FEN fields without allocating. Every character is checked
+//against the end of the text, and the position must be one a game can
+//reach the basics of: one king each, no pawns on the back ranks, the side
+//that just moved not in check and an en passant square behind a pawn.
+//Castling rights whose king or rook isn't at home are dropped.
+    bool parse_fen(std::string_view text, bool epd){
+        clear();
+        std::string_view fields[6];
+        int count = 0;
+        while (count<6 && !(fields[count] = next_token(text)).empty()){
+            count++;
+        }
+        if (count<4){
+            return false;
+        }
+        std::string_view placement = fields[0];
+        int rank = 7;
+        int file = 0;
+        for (char c : placement){
+            if (c=='/'){
+                if (file!=8 || rank==0){
+                    return false;
+                }
+                rank--;
+                file = 0;
+            }
+            else if (c>='1' && c<='8'){
+                file += c-'0';
+                if (file>8){
+                    return false;
+                }
+            }
+            else{
+                int piece = piece_index(c);
+                if (piece==NO_PIECE || file>7){
+                    return false;
+                }
+                put_piece(piece,rank*8+file);
+                file++;
+            }
+        }
+        if (rank!=0 || file!=8){
+            return false;
+        }
+        const Bitboard back_ranks = 0xFF000000000000FFULL;
+        if (popcount(pieces[WHITE][KING])!=1 || popcount(pieces[BLACK][KING])!=1 ||
+        ((pieces[WHITE][PAWN]|pieces[BLACK][PAWN])&back_ranks)){
+            return false;
+        }
+        if (fields[1]=="w"){
+            side = WHITE;
+        }
+        else if (fields[1]=="b"){
+            side = BLACK;
+        }
+        else{
+            return false;
+        }
+        if (is_attacked(king_square(side^1),side)){
+            return false;
+        }
+        if (fields[2]!="-"){
+            for (char c : fields[2]){
+                int right = c=='K' ? WHITE_OO : c=='Q' ? WHITE_OOO : c=='k' ? BLACK_OO : c=='q' ? BLACK_OOO : 0;
+                if (!right || (castling&right)){
+                    return false;
+                }
+                castling |= right;
+            }
+        }
+        const int rook_homes[4][2] = {{WHITE_OO,7},{WHITE_OOO,0},{BLACK_OO,63},{BLACK_OOO,56}};
+        for (auto& home : rook_homes){
+            int color = home[1]<8 ? WHITE : BLACK;
+            if ((castling&home[0]) && (squares[color==WHITE ? 4 : 60]!=color*6+KING ||
+            squares[home[1]]!=color*6+ROOK)){
+                castling &= ~home[0];
+            }
+        }
+        if (fields[3]!="-"){
+            std::string_view square = fields[3];
+            if (square.size()!=2 || square[0]<'a' || square[0]>'h' || square[1]!=(side==WHITE ? '6' : '3')){
+                return false;
+            }
+            en_passant = (square[1]-'1')*8+square[0]-'a';
+            //The pawn that just made the double step
+            int pawn = side==WHITE ? en_passant-8 : en_passant+8;
+            if (squares[pawn]!=(side^1)*6+PAWN || squares[en_passant]!=NO_PIECE){
+                return false;
+            }
+        }
+        int half_moves = 0;
+        int full_moves = 1;
+        bool counters = count>=6 && parse_number(fields[4],half_moves) && parse_number(fields[5],full_moves);
+        if (!epd){
+            if ((count>4 && !counters) || !next_token(text).empty()){
+                return false;
+            }
+        }
+        if (counters){
+            if (half_moves<0 || full_moves<0){
+                return false;
+            }
+            half_move_counter = half_moves;
+            move_counter = std::max(full_moves,1);
+        }
+        key ^= zobrist.castling[0] ^ zobrist.castling[castling];
+        if (en_passant!=NO_SQUARE){
+            key ^= zobrist.en_passant[en_passant%8];
+        }
+        if (side==BLACK){
+            key ^= zobrist.side;
+        }
+        return true;
+    }
+
+//Longest FEN write_fen can produce, with the terminating zero
+    static const size_t FEN_SIZE = 128;
+
+//Writes the position as a FEN into text (at least FEN_SIZE bytes) and
+//returns its length. Nothing is allocated, text ends with a zero.
+    size_t write_fen(char* text) const{
+        char* out = text;
+        for (int rank=7;rank>=0;rank--){
+            int empty_count=0;
+            for (int file=0;file<8;file++){
+                int piece = squares[rank*8+file];
+                if (piece==NO_PIECE){
+                    empty_count++;
+                    continue;
+                }
+                if (empty_count>0){
+                    *out++ = char('0'+empty_count);
+                    empty_count=0;
+                }
+                *out++ = piece_chars[piece];
+            }
+            if (empty_count>0){
+                *out++ = char('0'+empty_count);
+            }
+            if (rank>0){
+                *out++ = '/';
+            }
+        }
+        *out++ = ' ';
+        *out++ = side==WHITE ? 'w' : 'b';
+        *out++ = ' ';
+        if (!castling){
+            *out++ = '-';
+        }
+        const char rights[] = "KQkq";
+        for (int i=0;i<4;i++){
+            if (castling&(1<<i)){
+                *out++ = rights[i];
+            }
+        }
+        *out++ = ' ';
+        if (en_passant==NO_SQUARE){
+            *out++ = '-';
+        }
+        else{
+            *out++ = char('a'+en_passant%8);
+            *out++ = char('1'+en_passant/8);
+        }
+        *out++ = ' ';
+        out = std::to_chars(out,text+FEN_SIZE-1,half_move_counter).ptr;
+        *out++ = ' ';
+        out = std::to_chars(out,text+FEN_SIZE-1,move_counter).ptr;
+        *out = 0;
+        return out-text;
+    }
+
+//Gets the position as a FEN string
+    std::string get_fen() const{
+        char text[FEN_SIZE];
+        return std::string(text,write_fen(text));
+    }
+
+    std::string castling_string() const{
+        std::string result;
+        if (castling&WHITE_OO) result+='K';
+        if (castling&WHITE_OOO) result+='Q';
+        if (castling&BLACK_OO) result+='k';
+        if (castling&BLACK_OOO) result+='q';
+        return result.empty() ? "-" : result;
+    }
+
+    static std::string square_name(int square){
+        return {char('a'+square%8),char('1'+square/8)};
+    }
+
+    int king_square(int color) const{
+        return lsb(pieces[color][KING]);
+    }
+
+//Checks if a square is attacked by the given side
+    bool is_attacked(int square, int by) const{
+        return (attack_tables.pawn[by^1][square] & pieces[by][PAWN]) ||
+        (attack_tables.knight[square] & pieces[by][KNIGHT]) ||
+        (attack_tables.king[square] & pieces[by][KING]) ||
+        (bishop_attacks(square,occupied) & (pieces[by][BISHOP]|pieces[by][QUEEN])) ||
+        (rook_attacks(square,occupied) & (pieces[by][ROOK]|pieces[by][QUEEN]));
+    }
+
+    bool in_check() const{
+        return is_attacked(king_square(side),side^1);
+    }
+
+//Generates pseudo-legal moves (the king may be left in check)
+    void generate_moves(MoveList& list) const{
+        int us = side;
+        int them = side^1;
+        Bitboard own = colors[us];
+        Bitboard enemies = colors[them];
+        Bitboard empty = ~occupied;
+
+        //Pawns
+        Bitboard pawns = pieces[us][PAWN];
+        int up = us==WHITE ? 8 : -8;
+        Bitboard last_rank = us==WHITE ? RANK_8 : RANK_1;
+        Bitboard single = (us==WHITE ? pawns<<8 : pawns>>8) & empty;
+        Bitboard third = single & (us==WHITE ? RANK_3 : RANK_6);
+        Bitboard pushes = (us==WHITE ? third<<8 : third>>8) & empty;
+        while (single){
+            int to = pop_lsb(single);
+            add_pawn_moves(list,to-up,to,square_bb(to)&last_rank,QUIET);
+        }
+        while (pushes){
+            int to = pop_lsb(pushes);
+            list.add(make_move_code(to-2*up,to,DOUBLE_PUSH));
+        }
+        Bitboard attackers = pawns;
+        while (attackers){
+            int from = pop_lsb(attackers);
+            Bitboard targets = attack_tables.pawn[us][from] & enemies;
+            while (targets){
+                int to = pop_lsb(targets);
+                add_pawn_moves(list,from,to,square_bb(to)&last_rank,CAPTURE);
+            }
+        }
+        if (en_passant!=NO_SQUARE){
+            Bitboard takers = attack_tables.pawn[them][en_passant] & pawns;
+            while (takers){
+                list.add(make_move_code(pop_lsb(takers),en_passant,EN_PASSANT));
+            }
+        }
+
+        //Pieces
+        for (int type=KNIGHT;type<=KING;type++){
+            Bitboard movers = pieces[us][type];
+            while (movers){
+                int from = pop_lsb(movers);
+                Bitboard targets;
+                switch (type){
+                    case KNIGHT: targets = attack_tables.knight[from]; break;
+                    case BISHOP: targets = bishop_attacks(from,occupied); break;
+                    case ROOK: targets = rook_attacks(from,occupied); break;
+                    case QUEEN: targets = bishop_attacks(from,occupied)|rook_attacks(from,occupied); break;
+                    default: targets = attack_tables.king[from]; break;
+                }
+                targets &= ~own;
+                while (targets){
+                    int to = pop_lsb(targets);
+                    list.add(make_move_code(from,to,(square_bb(to)&enemies) ? CAPTURE : QUIET));
+                }
+            }
+        }
+
+        //Castling (the king can't castle out of or through check)
+        int king_start = us==WHITE ? 4 : 60;
+        int rook = us*6+ROOK;
+        if ((castling & (us==WHITE ? WHITE_OO : BLACK_OO)) && squares[king_start+3]==rook &&
+        !(occupied & (square_bb(king_start+1)|square_bb(king_start+2))) &&
+        !is_attacked(king_start,them) && !is_attacked(king_start+1,them)){
+            list.add(make_move_code(king_start,king_start+2,KING_CASTLE));
+        }
+        if ((castling & (us==WHITE ? WHITE_OOO : BLACK_OOO)) && squares[king_start-4]==rook &&
+        !(occupied & (square_bb(king_start-1)|square_bb(king_start-2)|square_bb(king_start-3))) &&
+        !is_attacked(king_start,them) && !is_attacked(king_start-1,them)){
+            list.add(make_move_code(king_start,king_start-2,QUEEN_CASTLE));
+        }
+    }
+
+//Finds own pieces that shield the king from an enemy slider
+    Bitboard pinned_pieces(int color) const{
+        int king = king_square(color);
+        int them = color^1;
+        Bitboard pinned = 0;
+        Bitboard snipers = rook_attacks(king,0) & (pieces[them][ROOK]|pieces[them][QUEEN]);
+        while (snipers){
+            int sniper = pop_lsb(snipers);
+            Bitboard between = rook_attacks(king,square_bb(sniper)) & rook_attacks(sniper,square_bb(king)) & occupied;
+            if (popcount(between)==1){
+                pinned |= between & colors[color];
+            }
+        }
+        snipers = bishop_attacks(king,0) & (pieces[them][BISHOP]|pieces[them][QUEEN]);
+        while (snipers){
+            int sniper = pop_lsb(snipers);
+            Bitboard between = bishop_attacks(king,square_bb(sniper)) & bishop_attacks(sniper,square_bb(king)) & occupied;
+            if (popcount(between)==1){
+                pinned |= between & colors[color];
+            }
+        }
+        return pinned;
+    }
+
+//Generates only legal moves. Only king moves, en passant, pinned pieces and
+//moves out of check need to be tried on the board.
+    void generate_legal(MoveList& list){
+        MoveList pseudo;
+        generate_moves(pseudo);
+        list.size=0;
+        int us = side;
+        int king = king_square(us);
+        bool check = is_attacked(king,us^1);
+        Bitboard pinned = pinned_pieces(us);
+        for (Move move : pseudo){
+            int from = move_from(move);
+            if (!check && from!=king && move_flag(move)!=EN_PASSANT && !(pinned&square_bb(from))){
+                list.add(move);
+                continue;
+            }
+            Undo undo;
+            make_move(move,undo);
+            if (!is_attacked(king_square(us),us^1)){
+                list.add(move);
+            }
+            unmake_move(move,undo);
+        }
+    }
+
+    void make_move(Move move, Undo& undo){
+        int from = move_from(move);
+        int to = move_to(move);
+        int flag = move_flag(move);
+        undo.captured = NO_PIECE;
+        undo.castling = castling;
+        undo.en_passant = en_passant;
+        undo.half_move_counter = half_move_counter;
+        undo.key = key;
+
+        half_move_counter++;
+        if (flag==EN_PASSANT){
+            int captured_square = side==WHITE ? to-8 : to+8;
+            undo.captured = squares[captured_square];
+            remove_piece(captured_square);
+        }
+        else if (flag&CAPTURE){
+            undo.captured = squares[to];
+            remove_piece(to);
+        }
+        if (undo.captured!=NO_PIECE || squares[from]%6==PAWN){
+            half_move_counter=0;
+        }
+        move_piece(from,to);
+        if (flag&PROMOTION){
+            remove_piece(to);
+            put_piece(side*6+KNIGHT+(flag&3),to);
+        }
+        else if (flag==KING_CASTLE){
+            move_piece(from+3,from+1);
+        }
+        else if (flag==QUEEN_CASTLE){
+            move_piece(from-4,from-1);
+        }
+
+        //En passant square only when a pawn can really take there
+        if (en_passant!=NO_SQUARE){
+            key ^= zobrist.en_passant[en_passant%8];
+            en_passant = NO_SQUARE;
+        }
+        if (flag==DOUBLE_PUSH){
+            int passed = (from+to)/2;
+            if (attack_tables.pawn[side][passed] & pieces[side^1][PAWN]){
+                en_passant = passed;
+                key ^= zobrist.en_passant[passed%8];
+            }
+        }
+        key ^= zobrist.castling[castling];
+        castling &= attack_tables.castling_mask[from] & attack_tables.castling_mask[to];
+        key ^= zobrist.castling[castling];
+        if (side==BLACK){
+            move_counter++;
+        }
+        side ^= 1;
+        key ^= zobrist.side;
+    }
+
+    //The key comes back from undo, so pieces are moved without touching it
+    void unmake_move(Move move, const Undo& undo){
+        int from = move_from(move);
+        int to = move_to(move);
+        int flag = move_flag(move);
+        side ^= 1;
+        if (side==BLACK){
+            move_counter--;
+        }
+        castling = undo.castling;
+        en_passant = undo.en_passant;
+        half_move_counter = undo.half_move_counter;
+
+        if (flag&PROMOTION){
+            remove_piece<false>(to);
+            put_piece<false>(side*6+PAWN,to);
+        }
+        else if (flag==KING_CASTLE){
+            move_piece<false>(from+1,from+3);
+        }
+        else if (flag==QUEEN_CASTLE){
+            move_piece<false>(from-1,from-4);
+        }
+        move_piece<false>(to,from);
+        if (undo.captured!=NO_PIECE){
+            put_piece<false>(undo.captured, flag==EN_PASSANT ? (side==WHITE ? to-8 : to+8) : to);
+        }
+        key = undo.key;
+    }
+
+//Makes a move when it never has to be taken back
+    void do_move(Move move){
+        Undo undo;
+        make_move(move,undo);
+    }
+
+//Finds the legal move written in UCI notation (e2e4, e7e8q), 0 if it is not legal
+    Move parse_uci_move(std::string_view text){
+        if (text.size()<4){
+            return 0;
+        }
+        int from = (text[1]-'1')*8 + text[0]-'a';
+        int to = (text[3]-'1')*8 + text[2]-'a';
+        char promotion = text.size()>4 ? char(tolower(text[4])) : 0;
+        MoveList list;
+        generate_legal(list);
+        for (Move move : list){
+            if (move_from(move)!=from || move_to(move)!=to){
+                continue;
+            }
+            if (is_promotion(move) ? promotion=="nbrq"[move_flag(move)&3] : promotion==0 || promotion==' '){
+                return move;
+            }
+        }
+        return 0;
+    }
+
+//Finds the legal move written in SAN (Nbd7, exd5, e8=Q+, O-O), 0 if it is not legal
+    Move parse_san(std::string_view text){
+        while (!text.empty() && strchr("+#!?",text.back())){
+            text.remove_suffix(1);
+        }
+        MoveList list;
+        generate_legal(list);
+        if (text=="O-O" || text=="0-0" || text=="O-O-O" || text=="0-0-0"){
+            int flag = text.size()==3 ? KING_CASTLE : QUEEN_CASTLE;
+            for (Move move : list){
+                if (move_flag(move)==flag){
+                    return move;
+                }
+            }
+            return 0;
+        }
+        int piece = PAWN;
+        if (!text.empty() && strchr("NBRQK",text[0])){
+            piece = int(strchr("PNBRQK",text[0])-"PNBRQK");
+            text.remove_prefix(1);
+        }
+        int promotion = -1;
+        if (text.size()>=2 && strchr("NBRQ",text.back())){
+            promotion = int(strchr("NBRQ",text.back())-"NBRQ");
+            text.remove_suffix(text[text.size()-2]=='=' ? 2 : 1);
+        }
+        if (text.size()<2){
+            return 0;
+        }
+        int to = (text[text.size()-1]-'1')*8 + text[text.size()-2]-'a';
+        int from_file = -1;
+        int from_rank = -1;
+        for (size_t i=0;i+2<text.size();i++){
+            if (text[i]>='a' && text[i]<='h'){
+                from_file = text[i]-'a';
+            }
+            else if (text[i]>='1' && text[i]<='8'){
+                from_rank = text[i]-'1';
+            }
+        }
+        Move found = 0;
+        for (Move move : list){
+            int from = move_from(move);
+            if (move_to(move)!=to || squares[from]%6!=piece ||
+            (from_file>=0 && from%8!=from_file) || (from_rank>=0 && from/8!=from_rank)){
+                continue;
+            }
+            if (is_promotion(move) ? (move_flag(move)&3)!=promotion : promotion>=0){
+                continue;
+            }
+            if (found){
+                return 0; //Ambiguous
+            }
+            found = move;
+        }
+        return found;
+    }
+
+//Writes a legal move in SAN (Nbd7, exd5, e8=Q+, O-O)
+    std::string move_to_san(Move move){
+        int from = move_from(move);
+        int to = move_to(move);
+        int flag = move_flag(move);
+        int piece = squares[from]%6;
+        std::string text;
+        if (flag==KING_CASTLE || flag==QUEEN_CASTLE){
+            text = flag==KING_CASTLE ? "O-O" : "O-O-O";
+        }
+        else{
+            MoveList list;
+            generate_legal(list);
+            if (piece!=PAWN){
+                text += "PNBRQK"[piece];
+                //Name the file, the rank or both when another piece of the kind can go there too
+                bool same_file = false, same_rank = false, other = false;
+                for (Move other_move : list){
+                    int other_from = move_from(other_move);
+                    if (move_to(other_move)==to && other_from!=from && squares[other_from]%6==piece){
+                        other = true;
+                        same_file = same_file || other_from%8==from%8;
+                        same_rank = same_rank || other_from/8==from/8;
+                    }
+                }
+                if (other && (!same_file || same_rank)){
+                    text += char('a'+from%8);
+                }
+                if (other && same_file){
+                    text += char('1'+from/8);
+                }
+            }
+            if (flag&CAPTURE){
+                if (piece==PAWN){
+                    text += char('a'+from%8);
+                }
+                text += 'x';
+            }
+            text += square_name(to);
+            if (is_promotion(move)){
+                text += '=';
+                text += "NBRQ"[flag&3];
+            }
+        }
+        Undo undo;
+        make_move(move,undo);
+        if (in_check()){
+            MoveList replies;
+            generate_legal(replies);
+            text += replies.size ? '+' : '#';
+        }
+        unmake_move(move,undo);
+        return text;
+    }
+
+    static std::string move_to_uci(Move move){
+        std::string text = square_name(move_from(move))+square_name(move_to(move));
+        if (is_promotion(move)){
+            text += "nbrq"[move_flag(move)&3];
+        }
+        return text;
+    }
+
+//Adds a pawn move, or all four promotions when it reaches the last rank
+    static void add_pawn_moves(MoveList& list, int from, int to, bool promotion, int flag){
+        if (promotion){
+            for (int piece=0;piece<4;piece++){
+                list.add(make_move_code(from,to,flag+PROMOTION+piece));
+            }
+        }
+        else{
+            list.add(make_move_code(from,to,flag));
+        }
+    }
+
+//Checks if a side still has the material to mate
+    bool can_mate(int color) const{
+        if (pieces[color][PAWN]|pieces[color][ROOK]|pieces[color][QUEEN]){
+            return true;
+        }
+        return popcount(pieces[color][KNIGHT]|pieces[color][BISHOP])>=2;
+    }
+
+//Checks that nobody can ever mate (K vs K, K+minor vs K, bishops on one color)
+    bool insufficient_material() const{
+        if (pieces[WHITE][PAWN]|pieces[BLACK][PAWN]|pieces[WHITE][ROOK]|pieces[BLACK][ROOK]|
+        pieces[WHITE][QUEEN]|pieces[BLACK][QUEEN]){
+            return false;
+        }
+        Bitboard knights = pieces[WHITE][KNIGHT]|pieces[BLACK][KNIGHT];
+        Bitboard bishops = pieces[WHITE][BISHOP]|pieces[BLACK][BISHOP];
+        if (popcount(knights|bishops)<=1){
+            return true;
+        }
+        const Bitboard DARK_SQUARES = 0xAA55AA55AA55AA55ULL;
+        return !knights && (!(bishops&DARK_SQUARES) || !(bishops&~DARK_SQUARES));
+    }
+};
+
+/*======= Clock =======*/
+/*Chess clock for both sides. Time is kept in microseconds on the
+monotonic clock, so rounding never adds up over a game. Supports
+increments (Fischer) and repeating moves-to-go periods.*/
+
+class Clock{
+    public:
+    bool enabled=false; //false means unlimited time
+    int64_t base=0; //Time for a period in microseconds
+    int64_t increment=0; //Added after every move
+    int moves_to_go=0; //Moves per period (0 = whole game)
+    int64_t margin=0; //Extra time an engine may overrun before it loses
+    int64_t remaining[2]={0,0}; //Time left for white / black
+    int moves_made[2]={0,0}; //Moves made by white / black
+    int running=-1; //Side whose clock runs (-1 if stopped)
+    int flagged=-1; //Side that ran out of time (-1 if none)
+    std::chrono::steady_clock::time_point turn_start;
+
+//Reads a time control: "seconds", "seconds+increment" or "moves/seconds+increment"
+    bool set(std::string control){
+        try{
+            size_t slash = control.find('/');
+            moves_to_go = 0;
+            if (slash!=std::string::npos){
+                moves_to_go = std::stoi(control.substr(0,slash));
+                control = control.substr(slash+1);
+            }
+            size_t plus = control.find('+');
+            base = int64_t(std::stod(control.substr(0,plus))*1e6);
+            increment = plus==std::string::npos ? 0 : int64_t(std::stod(control.substr(plus+1))*1e6);
+        }
+        catch (const std::exception&){
+            return false;
+        }
+        enabled = base>0;
+        reset();
+        return enabled;
+    }
+
+    void reset(){
+        remaining[WHITE]=remaining[BLACK]=base;
+        moves_made[WHITE]=moves_made[BLACK]=0;
+        running=-1;
+        flagged=-1;
+    }
+
+    void start(int side){
+        running=side;
+        turn_start=std::chrono::steady_clock::now();
+    }
+
+    //Time used in the current turn
+    int64_t elapsed() const{
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-turn_start).count();
+    }
+
+//Stops the running clock and charges the move. Returns false if the side ran out of time.
+    bool stop(){
+        if (running<0){
+            return true;
+        }
+        int side = running;
+        running = -1;
+        if (!enabled){
+            return true;
+        }
+        remaining[side] -= elapsed();
+        if (remaining[side] < -margin){
+            flagged = side;
+            return false;
+        }
+        remaining[side] += increment;
+        moves_made[side]++;
+        if (moves_to_go>0 && moves_made[side]%moves_to_go==0){
+            remaining[side] += base;
+        }
+        return true;
+    }
+
+    //Milliseconds an engine may think before its flag falls
+    int time_left_ms(int side) const{
+        return int((std::max<int64_t>(remaining[side],0)+margin)/1000)+1;
+    }
+
+//Builds the UCI go limits for the side to move
+    std::string limits(int side) const{
+        std::string go = "wtime "+std::to_string(std::max<int64_t>(remaining[WHITE]/1000,1))+
+        " btime "+std::to_string(std::max<int64_t>(remaining[BLACK]/1000,1));
+        if (increment>0){
+            go += " winc "+std::to_string(increment/1000)+" binc "+std::to_string(increment/1000);
+        }
+        if (moves_to_go>0){
+            go += " movestogo "+std::to_string(moves_to_go-moves_made[side]%moves_to_go);
+        }
+        return go;
+    }
+
+    static std::string format(int64_t time){
+        char text[32];
+        snprintf(text,sizeof(text),"%lld:%04.1f",(long long)(time/60000000),(time%60000000)/1e6);
+        return text;
+    }
+
+    void print() const{
+        if (enabled){
+            std::cout<<"White: "<<format(remaining[WHITE])<<"  Black: "<<format(remaining[BLACK])<<"\n";
+        }
+    }
+};
+
+//Per-engine numbers collected while a game is played
+struct EngineStats{
+    int moves=0; //Moves played
+    int64_t think_time=0; //Microseconds from the opponent's move to bestmove, summed
+    int ponder_hits=0; //Opponent played the move the engine pondered on
+    int ponder_misses=0; //Opponent played something else
+    int searches=0; //Moves with search info
+    int64_t depth=0; //Depth reached, summed
+    int64_t seldepth=0; //Selective depth, summed
+    uint64_t nodes=0; //Nodes searched
+    int64_t search_time=0; //Search time the engine reported (ms)
+
+    void add(const EngineStats& other){
+        moves += other.moves;
+        think_time += other.think_time;
+        ponder_hits += other.ponder_hits;
+        ponder_misses += other.ponder_misses;
+        searches += other.searches;
+        depth += other.depth;
+        seldepth += other.seldepth;
+        nodes += other.nodes;
+        search_time += other.search_time;
+    }
+
+    //Counts the last info line of a search
+    void add_info(const SearchInfo& info){
+        searches++;
+        depth += info.depth;
+        seldepth += info.seldepth;
+        nodes += info.nodes;
+        search_time += info.time;
+    }
+
+    void print(std::string name) const{
+        std::cout<<name<<": "<<moves<<" moves, "<<(moves ? think_time/1000.0/moves : 0)<<" ms per move";
+        if (searches>0){
+            std::cout<<", depth "<<double(depth)/searches<<"/"<<double(seldepth)/searches;
+            if (search_time>0){
+                std::cout<<", "<<nodes*1000/search_time<<" nps";
+            }
+        }
+        int pondered = ponder_hits+ponder_misses;
+        if (pondered>0){
+            std::cout<<", ponder hits "<<ponder_hits<<"/"<<pondered<<" ("<<100.0*ponder_hits/pondered<<"%)";
+        }
+        std::cout<<"\n";
+    }
+};
+
+//What an engine reported for one of its moves
+struct MoveRecord{
+    int ply; //1 for the first move of the game
+    int side;
+    uint16_t move; //pack_uci_move
+    int64_t time; //Microseconds on the clock
+    bool has_info;
+    SearchInfo info; //Last search info before bestmove
+    int root_pieces; //Pieces on the board in the searched position
+};
+
+/*======= Opening suites =======*/
+/*Opening files are mapped into memory instead of being read, so a
+suite of millions of positions opens at once and only the pages of the
+openings that are really played get loaded. A record is parsed only
+when a game needs it. Both games of a pair get the same opening, the
+engines swap colors between them.*/
+
+class MappedFile{
+    public:
+    const char* data=nullptr; //File contents (not null terminated)
+    size_t size=0; //File size in bytes
+
+    MappedFile(){}
+    MappedFile(const MappedFile&)=delete;
+    MappedFile& operator=(const MappedFile&)=delete;
+    ~MappedFile(){
+        close();
+    }
+
+//Maps the whole file read-only, advice tells the kernel how it will be read (MADV_SEQUENTIAL/MADV_RANDOM)
+    bool open(const std::string& path, int advice){
+        close();
+        int fd = ::open(path.c_str(),O_RDONLY|O_CLOEXEC);
+        if (fd<0){
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd,&info)<0){
+            ::close(fd);
+            return false;
+        }
+        size = size_t(info.st_size);
+        if (size>0){
+            void* map = mmap(nullptr,size,PROT_READ,MAP_PRIVATE,fd,0);
+            if (map==MAP_FAILED){
+                ::close(fd);
+                size = 0;
+                return false;
+            }
+            madvise(map,size,advice);
+            data = (const char*)map;
+        }
+        ::close(fd);
+        return true;
+    }
+
+    std::string_view view() const{
+        return std::string_view(data,size);
+    }
+
+    void close(){
+        if (data){
+            munmap((void*)data,size);
+        }
+        data = nullptr;
+        size = 0;
+    }
+};
+
+struct Opening{
+    std::string fen; //Start position
+    std::vector<std::string> moves; //Book moves in UCI notation, played from fen
+    size_t offset=0; //Where the record starts in the file
+    uint64_t serial=0; //Records taken from the suite up to this one, counts from 1
+    size_t next=0; //Sequential cursor once this record was taken
+};
+
+//Reads an EPD or FEN line into a full FEN. EPD has four FEN fields and
+//then operations, FEN adds the two counters.
+bool epd_to_fen(std::string_view line, std::string* fen){
+    Position position;
+    if (!position.set_epd(line)){
+        return false;
+    }
+    char text[Position::FEN_SIZE];
+    fen->assign(text,position.write_fen(text));
+    return true;
+}
+
+//======= PGN reading =======//
+//Shared by the opening suites and the position index. Everything works on
+//views into a mapped file, a game is only copied where it is kept.
+
+//Gets the line starting at offset and moves offset past it
+std::string_view read_line(std::string_view data, size_t& offset){
+    const char* start = data.data()+offset;
+    const char* newline = (const char*)memchr(start,'\n',data.size()-offset);
+    size_t length = newline ? size_t(newline-start) : data.size()-offset;
+    offset += newline ? length+1 : length;
+    std::string_view line(start,length);
+    if (!line.empty() && line.back()=='\r'){
+        line.remove_suffix(1);
+    }
+    return line;
+}
+
+//Checks if a line has nothing but spaces
+bool blank_line(std::string_view line){
+    for (char c : line){
+        if (!isspace((unsigned char)c)){
+            return false;
+        }
+    }
+    return true;
+}
+
+//Checks if the last non-blank line before offset is a PGN tag
+bool previous_is_tag(std::string_view data, size_t offset){
+    while (offset>0){
+        size_t end = offset-1;
+        size_t start = end;
+        while (start>0 && data[start-1]!='\n'){
+            start--;
+        }
+        std::string_view line = data.substr(start,end-start);
+        if (!blank_line(line)){
+            size_t first = line.find_first_not_of(" \t");
+            return first!=std::string_view::npos && line[first]=='[';
+        }
+        offset = start;
+    }
+    return false;
+}
+
+//Finds the first PGN game starting at or after offset: a tag line that
+//follows no other tag line. data.size() if there is none.
+size_t pgn_game_start(std::string_view data, size_t offset){
+    if (offset>0 && offset<data.size() && data[offset-1]!='\n'){
+        read_line(data,offset);
+    }
+    while (offset<data.size()){
+        size_t start = offset;
+        std::string_view line = read_line(data,offset);
+        if (!line.empty() && line[0]=='[' && !previous_is_tag(data,start)){
+            return start;
+        }
+    }
+    return data.size();
+}
+
+//Gets the value of a tag line like [White "name"] if it has the given name
+bool pgn_tag(std::string_view line, std::string_view name, std::string_view* value){
+    if (line.size()<name.size()+3 || line[0]!='[' || line.compare(1,name.size(),name)!=0 ||
+    line.compare(name.size()+1,2," \"")!=0){
+        return false;
+    }
+    line.remove_prefix(name.size()+3);
+    *value = line.substr(0,line.find('"'));
+    return true;
+}
+
+//A PGN game, the views point into the text it was read from
+struct PgnRecord{
+    std::string_view fen; //FEN tag, empty for the standard start position
+    std::string_view result; //Result tag
+    std::string_view white; //White tag
+    std::string_view black; //Black tag
+    std::string_view movetext; //Moves with comments, variations and move numbers
+};
+
+//Reads the tags and finds the movetext of the game at offset, returns
+//where the movetext ends (the tags of the next game)
+size_t read_pgn_record(std::string_view data, size_t offset, PgnRecord* record){
+    *record = PgnRecord();
+    size_t movetext = offset;
+    while (offset<data.size()){
+        movetext = offset;
+        std::string_view line = read_line(data,offset);
+        if (blank_line(line)){
+            continue;
+        }
+        if (line[0]!='['){
+            offset = movetext;
+            break;
+        }
+        if (!pgn_tag(line,"FEN",&record->fen) && !pgn_tag(line,"Result",&record->result) &&
+        !pgn_tag(line,"White",&record->white)){
+            pgn_tag(line,"Black",&record->black);
+        }
+        movetext = offset;
+    }
+    //Movetext runs until the tags of the next game
+    size_t text_end = movetext;
+    while (text_end<data.size()){
+        size_t start = text_end;
+        std::string_view line = read_line(data,text_end);
+        if (!line.empty() && line[0]=='['){
+            text_end = start;
+            break;
+        }
+    }
+    record->movetext = data.substr(movetext,text_end-movetext);
+    return text_end;
+}
+
+//Walks the main line of a movetext: comments, variations, NAGs and move
+//numbers are skipped, what is left are SAN moves and the result
+class PgnMoves{
+    public:
+    std::string_view text; //Movetext not read yet
+    std::string_view token; //Rest of the token being read
+    int depth=0; //Nesting of comments and variations
+
+    PgnMoves(std::string_view movetext) : text(movetext) {}
+
+//Gets the next move or result token, false at the end of the movetext
+    bool next(std::string_view* word){
+        while (true){
+            if (token.empty()){
+                token = next_token(text);
+                if (token.empty()){
+                    return false;
+                }
+            }
+            //Comments and variations may be glued to moves: "e4{best}" or "(1...c5"
+            char c = token[0];
+            if (depth>0 || c=='{' || c=='(' || c==';'){
+                if (c==';' && depth==0){
+                    size_t newline = text.find('\n');
+                    text.remove_prefix(newline==std::string_view::npos ? text.size() : newline);
+                    token = std::string_view();
+                    continue;
+                }
+                if (c=='{' || c=='('){
+                    depth++;
+                }
+                else if (c=='}' || c==')'){
+                    depth--;
+                }
+                token.remove_prefix(1);
+                continue;
+            }
+            size_t stop = token.find_first_of("{(;");
+            std::string_view found = token.substr(0,stop);
+            token = stop==std::string_view::npos ? std::string_view() : token.substr(stop);
+            //Move numbers ("12." or "12...") may be glued to the move
+            size_t skip = 0;
+            while (skip<found.size() && (isdigit((unsigned char)found[skip]) || found[skip]=='.')){
+                skip++;
+            }
+            if (skip>0 && (skip==found.size() || found[skip-1]=='.')){
+                found.remove_prefix(skip);
+            }
+            if (found.empty() || found[0]=='$'){
+                continue;
+            }
+            *word = found;
+            return true;
+        }
+    }
+
+    static bool is_result(std::string_view word){
+        return word=="1-0" || word=="0-1" || word=="1/2-1/2" || word=="*";
+    }
+};
+
+class OpeningBook{
+    public:
+    MappedFile file; //The suite, .epd/.fen (one position per line) or .pgn
+    bool pgn=false; //Records are PGN games instead of lines
+    bool random=false; //Sample records at random instead of going through the file
+    uint64_t seed=0; //Seed of the random order
+    int plies=0; //Most book moves taken from a PGN game (0: all of them)
+    std::mutex mutex; //Guards cursor and pending
+    size_t cursor=0; //Next record in sequential order
+    uint64_t taken=0; //Records taken from the suite
+    std::vector<std::pair<int,Opening>> pending; //Openings of pairs that still have a game to play
+
+    bool open(const std::string& path, bool random_order, uint64_t random_seed, int max_plies){
+        random = random_order;
+        seed = random_seed;
+        plies = max_plies;
+        pgn = path.size()>=4 && path.compare(path.size()-4,4,".pgn")==0;
+        return file.open(path,random ? MADV_RANDOM : MADV_SEQUENTIAL) && file.size>0;
+    }
+
+//Gets the opening of a game (games 2k and 2k+1 share one), false if the file has no usable record
+    bool get(int game, Opening* opening){
+        int pair = game/2;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i=0;i<pending.size();i++){
+            if (pending[i].first==pair){
+                *opening = std::move(pending[i].second);
+                pending.erase(pending.begin()+i);
+                return true;
+            }
+        }
+        size_t offset = cursor;
+        if (random){
+            uint64_t state = seed ^ (uint64_t(pair)*0xD1B54A32D192ED03ULL);
+            offset = ZobristKeys::next(state) % file.size;
+        }
+        //Broken records are skipped, but one pass over the whole file is enough
+        size_t scanned = 0;
+        while (scanned<=file.size){
+            offset = record_start(offset);
+            size_t end = offset;
+            if (offset<file.size && parse(offset,opening,&end)){
+                if (!random){
+                    cursor = end;
+                }
+                opening->serial = ++taken;
+                opening->next = cursor;
+                pending.push_back({pair,*opening});
+                return true;
+            }
+            scanned += std::max<size_t>(end-offset,1);
+            offset = end>offset ? end : offset+1;
+        }
+        return false;
+    }
+
+//Takes back the openings a resumed match had already taken: games that are
+//still to be played get theirs again, new pairs continue after the last one.
+//Workers take records in any pair order and the suite may have wrapped around,
+//so the cursor is the one of the record taken last.
+    void restore(const std::vector<std::pair<int,Opening>>& openings, const std::vector<bool>& finished){
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<int,size_t> pairs;
+        for (const auto& [game, taken_opening] : openings){
+            pairs[game/2] = taken_opening.offset;
+            if (taken_opening.serial>taken){
+                taken = taken_opening.serial;
+                if (!random){
+                    cursor = taken_opening.next;
+                }
+            }
+        }
+        for (const auto& [pair, offset] : pairs){
+            Opening opening;
+            size_t end = offset;
+            if (offset>=file.size || !parse(offset,&opening,&end)){
+                continue;
+            }
+            //Both games of a pair take the opening from pending
+            for (int game=2*pair;game<2*pair+2;game++){
+                if (size_t(game)>=finished.size() || !finished[game]){
+                    pending.push_back({pair,opening});
+                }
+            }
+        }
+    }
+
+    private:
+//Finds the first record starting at or after offset, wraps around at the end of the file
+    size_t record_start(size_t offset){
+        for (int pass=0;pass<2;pass++){
+            if (offset>0 && offset<file.size && file.data[offset-1]!='\n'){
+                read_line(file.view(),offset);
+            }
+            while (offset<file.size){
+                size_t start = offset;
+                std::string_view line = read_line(file.view(),offset);
+                if (!pgn && !blank_line(line) && line[0]!='#'){
+                    return start;
+                }
+                //A PGN game starts with a tag line that follows no other tag line
+                if (pgn && !line.empty() && line[0]=='[' && !previous_is_tag(file.view(),start)){
+                    return start;
+                }
+            }
+            offset = 0;
+        }
+        return file.size;
+    }
+
+//Parses the record at offset, end gets the offset after it
+    bool parse(size_t offset, Opening* opening, size_t* end){
+        opening->offset = offset;
+        opening->moves.clear();
+        if (!pgn){
+            std::string_view line = read_line(file.view(),offset);
+            *end = offset;
+            return parse_epd(line,opening);
+        }
+        return parse_pgn(offset,opening,end);
+    }
+
+    static bool parse_epd(std::string_view line, Opening* opening){
+        return epd_to_fen(line,&opening->fen);
+    }
+
+//Reads the tags (only FEN matters) and the main line of a PGN game
+    bool parse_pgn(size_t offset, Opening* opening, size_t* end){
+        PgnRecord record;
+        size_t text_end = read_pgn_record(file.view(),offset,&record);
+        *end = std::max(text_end,size_t(record.movetext.data()-file.data)+1);
+        opening->fen = record.fen.empty() ? "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1" :
+        std::string(record.fen);
+        Position position;
+        if (!position.set_fen(opening->fen)){
+            return false;
+        }
+        PgnMoves moves(record.movetext);
+        std::string_view word;
+        while ((plies==0 || int(opening->moves.size())<plies) && moves.next(&word)){
+            if (PgnMoves::is_result(word)){
+                return true;
+            }
+            Move move = position.parse_san(word);
+            if (!move){
+                return !opening->moves.empty();
+            }
+            opening->moves.push_back(Position::move_to_uci(move));
+            position.do_move(move);
+        }
+        return true;
+    }
+};
+
+/*======= Eval cache =======*/
+/*Search results are kept in a hash table in a memory mapped file, so
+they outlive the process. A search is found by the Zobrist key of the
+position plus a hash of the engine command and the go limits. In games
+the key also covers the positions since the last capture or pawn move,
+which the engine is given and can repeat. On a hit the engine isn't
+asked at all. Only fixed depth or node searches are cached, because a
+clocked search depends on the time left. Entries sit in buckets of
+four, and a new entry replaces the shallowest one. Threads lock a
+stripe of buckets. The file is locked, so only one process uses it at
+a time.*/
+
+struct CacheEntry{
+    uint64_t key; //Zobrist key of the position (0: empty)
+    uint64_t nodes;
+    uint32_t limits; //Hash of engine and limits
+    int32_t score;
+    uint16_t bestmove; //pack_uci_move
+    uint8_t depth;
+    uint8_t seldepth;
+    uint8_t mate;
+    uint8_t pv_length;
+    uint16_t reserved;
+    uint16_t pv[16];
+};
+static_assert(sizeof(CacheEntry)==64,"cache entries are 64 bytes");
+
+class EvalCache{
+    public:
+    static const int BUCKET = 4; //Entries per bucket
+    static const int STRIPES = 256; //Locks, each guards every 256th bucket
+    CacheEntry* entries=nullptr; //Mapped entries (after the header)
+    size_t buckets=0;
+    void* map=nullptr;
+    size_t map_size=0;
+    int fd=-1;
+    std::mutex stripes[STRIPES];
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+
+    ~EvalCache(){
+        close();
+    }
+
+//Opens the cache file, a new one gets size_mb megabytes. An existing file keeps its size.
+    bool open(const std::string& path, int size_mb){
+        fd = ::open(path.c_str(),O_RDWR|O_CREAT|O_CLOEXEC,0644);
+        if (fd<0){
+            return false;
+        }
+        if (flock(fd,LOCK_EX|LOCK_NB)<0){
+            std::cout<<"ERROR: "<<path<<" is used by another process\n";
+            close();
+            return false;
+        }
+        struct stat info;
+        fstat(fd,&info);
+        char header[64] = {0};
+        bool valid = info.st_size>64 && pread(fd,header,sizeof(header),0)==sizeof(header) && memcmp(header,"CHESSEC1",8)==0;
+        if (valid){
+            memcpy(&buckets,header+8,sizeof(buckets));
+            valid = buckets>0 && size_t(info.st_size)==64+buckets*BUCKET*sizeof(CacheEntry);
+        }
+        if (!valid){
+            buckets = std::max<size_t>(1,size_t(std::max(size_mb,1))*(1<<20)/(BUCKET*sizeof(CacheEntry)));
+            memset(header,0,sizeof(header));
+            memcpy(header,"CHESSEC1",8);
+            memcpy(header+8,&buckets,sizeof(buckets));
+            if (ftruncate(fd,0)<0 || ftruncate(fd,off_t(64+buckets*BUCKET*sizeof(CacheEntry)))<0 ||
+            pwrite(fd,header,sizeof(header),0)!=sizeof(header)){
+                close();
+                return false;
+            }
+        }
+        map_size = 64+buckets*BUCKET*sizeof(CacheEntry);
+        map = mmap(nullptr,map_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+        if (map==MAP_FAILED){
+            map = nullptr;
+            close();
+            return false;
+        }
+        madvise(map,map_size,MADV_RANDOM);
+        entries = (CacheEntry*)((char*)map+64);
+        return true;
+    }
+
+    void close(){
+        if (map){
+            munmap(map,map_size);
+        }
+        if (fd>=0){
+            ::close(fd);
+        }
+        map = nullptr;
+        entries = nullptr;
+        fd = -1;
+    }
+
+//FNV-1a of the engine command and the go limits
+    static uint32_t limits_hash(std::string_view engine, std::string_view limits){
+        uint32_t hash = 2166136261u;
+        for (std::string_view text : {engine,std::string_view("\n"),limits}){
+            for (char c : text){
+                hash = (hash^uint8_t(c))*16777619u;
+            }
+        }
+        return hash;
+    }
+
+//Finds an earlier search of the position with the same engine and limits
+    bool probe(uint64_t key, uint32_t limits, uint16_t* bestmove, SearchInfo* info){
+        size_t bucket = key%buckets;
+        std::lock_guard<std::mutex> lock(stripes[bucket%STRIPES]);
+        for (int i=0;i<BUCKET;i++){
+            const CacheEntry& entry = entries[bucket*BUCKET+i];
+            if (entry.key==key && entry.limits==limits){
+                *bestmove = entry.bestmove;
+                *info = SearchInfo();
+                info->depth = entry.depth;
+                info->seldepth = entry.seldepth;
+                info->has_score = true;
+                info->mate = entry.mate;
+                info->score = entry.score;
+                info->nodes = entry.nodes;
+                info->pv_length = std::min<int>(entry.pv_length,16);
+                memcpy(info->pv,entry.pv,sizeof(entry.pv));
+                hits++;
+                return true;
+            }
+        }
+        misses++;
+        return false;
+    }
+
+    void store(uint64_t key, uint32_t limits, uint16_t bestmove, const SearchInfo& info){
+        size_t bucket = key%buckets;
+        std::lock_guard<std::mutex> lock(stripes[bucket%STRIPES]);
+        CacheEntry* target = &entries[bucket*BUCKET];
+        for (int i=0;i<BUCKET;i++){
+            CacheEntry* entry = &entries[bucket*BUCKET+i];
+            if (entry->key==0 || (entry->key==key && entry->limits==limits)){
+                target = entry;
+                break;
+            }
+            if (entry->depth<target->depth){
+                target = entry;
+            }
+        }
+        CacheEntry entry = {};
+        entry.key = key;
+        entry.nodes = info.nodes;
+        entry.limits = limits;
+        entry.score = info.score;
+        entry.bestmove = bestmove;
+        entry.depth = uint8_t(std::min(info.depth,255));
+        entry.seldepth = uint8_t(std::min(info.seldepth,255));
+        entry.mate = info.mate;
+        entry.pv_length = uint8_t(info.pv_length);
+        memcpy(entry.pv,info.pv,sizeof(entry.pv));
+        *target = entry;
+    }
+};
+
+/*======= SPRT =======*/
+/*Sequential probability ratio test between two Elo hypotheses: engine 1
+is elo0 stronger (H0) or elo1 stronger (H1). After every game the
+log-likelihood ratio is checked against bounds from the error rates, and
+the match stops once it crosses one of them.*/
+
+struct SprtBounds{
+    bool enabled=false; //Stop the match early when the test is decided
+    double elo0=0; //Elo difference of H0
+    double elo1=5; //Elo difference of H1
+    double alpha=0.05; //Chance to accept H1 when H0 is true
+    double beta=0.05; //Chance to accept H0 when H1 is true
+
+    //Reads "elo0,elo1" or "elo0,elo1,alpha,beta"
+    bool set(std::string_view text){
+        double values[4] = {elo0,elo1,alpha,beta};
+        int count = 0;
+        while (count<4 && !text.empty()){
+            size_t comma = std::min(text.find(','),text.size());
+            std::string field(text.substr(0,comma));
+            char* end = nullptr;
+            values[count++] = strtod(field.c_str(),&end);
+            if (field.empty() || *end){
+                return false;
+            }
+            text.remove_prefix(std::min(comma+1,text.size()));
+        }
+        if ((count!=2 && count!=4) || !text.empty() || values[0]>=values[1] ||
+        values[2]<=0 || values[2]>=1 || values[3]<=0 || values[3]>=1){
+            return false;
+        }
+        elo0 = values[0];
+        elo1 = values[1];
+        alpha = values[2];
+        beta = values[3];
+        enabled = true;
+        return true;
+    }
+
+    double lower() const{ return log(beta/(1-alpha)); } //H0 is accepted below this
+    double upper() const{ return log((1-beta)/alpha); } //H1 is accepted above this
+};
+
+//Expected score of a side that is elo stronger
+inline double elo_to_score(double elo){
+    return 1/(1+pow(10,-elo/400));
+}
+
+//Elo difference that gives the expected score
+inline double score_to_elo(double score){
+    score = std::min(std::max(score,1e-6),1-1e-6);
+    return -400*log10(1/score-1);
+}
+
+/*======= Core scheduler =======*/
+/*With --pin every worker of a match gets its own set of cores and the
+engines of its games are pinned to it, so games played side by side don't
+share cores or caches. A set is taken from one NUMA node when the node has
+enough free cores, and the first hardware thread of every core is handed
+out before its siblings. Nodes and siblings are read from /sys, without
+them the machine is one node of plain cores. Only cores this process is
+allowed to run on are used.*/
+
+//Reads a /sys cpu list like "0-3,8,10-11"
+std::vector<int> read_cpu_list(const std::string& path){
+    std::vector<int> cpus;
+    std::ifstream file(path);
+    std::string text;
+    if (!std::getline(file,text)){
+        return cpus;
+    }
+    std::string_view rest = text;
+    while (!rest.empty()){
+        size_t comma = rest.find(',');
+        std::string_view range = rest.substr(0,comma);
+        rest = comma==std::string_view::npos ? std::string_view() : rest.substr(comma+1);
+        size_t dash = range.find('-');
+        int first, last;
+        if (!parse_number(range.substr(0,dash),first)){
+            continue;
+        }
+        last = first;
+        if (dash!=std::string_view::npos && !parse_number(range.substr(dash+1),last)){
+            continue;
+        }
+        for (int cpu=first;cpu<=last;cpu++){
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+class CoreScheduler{
+    public:
+    std::vector<std::vector<int>> slots; //Cores of every worker
+    std::vector<int> slot_nodes; //NUMA node of every worker, -1 if its cores span nodes
+
+    //Gives every worker its own cores_per_worker cores, false (with the reason) if there aren't enough
+    bool plan(int workers, int cores_per_worker, std::string* error){
+#ifdef __linux__
+        cpu_set_t allowed;
+        if (sched_getaffinity(0,sizeof(allowed),&allowed)!=0){
+            *error = "cant read the allowed cores";
+            return false;
+        }
+        std::vector<std::vector<int>> nodes;
+        for (int node=0;node<64;node++){
+            std::string directory = "/sys/devices/system/node/node"+std::to_string(node);
+            if (access(directory.c_str(),F_OK)!=0){
+                continue;
+            }
+            std::vector<int> cpus = read_cpu_list(directory+"/cpulist");
+            nodes.resize(node+1);
+            for (int cpu : cpus){
+                if (cpu<CPU_SETSIZE && CPU_ISSET(cpu,&allowed)){
+                    nodes[node].push_back(cpu);
+                }
+            }
+        }
+        if (nodes.empty()){
+            nodes.resize(1);
+            for (int cpu=0;cpu<CPU_SETSIZE;cpu++){
+                if (CPU_ISSET(cpu,&allowed)){
+                    nodes[0].push_back(cpu);
+                }
+            }
+        }
+        //Hardware threads sorted so the first thread of every core comes first
+        size_t total = 0;
+        for (std::vector<int>& cpus : nodes){
+            std::vector<std::pair<int,int>> ranked;
+            for (int cpu : cpus){
+                std::vector<int> siblings = read_cpu_list("/sys/devices/system/cpu/cpu"+std::to_string(cpu)+
+                "/topology/thread_siblings_list");
+                int rank = std::find(siblings.begin(),siblings.end(),cpu)-siblings.begin();
+                ranked.push_back({siblings.empty() ? 0 : rank,cpu});
+            }
+            std::sort(ranked.begin(),ranked.end());
+            cpus.clear();
+            for (auto& entry : ranked){
+                cpus.push_back(entry.second);
+            }
+            total += cpus.size();
+        }
+        if (total<size_t(workers)*cores_per_worker){
+            *error = std::to_string(workers)+" games need "+std::to_string(workers*cores_per_worker)+
+            " cores, only "+std::to_string(total)+" can be used";
+            return false;
+        }
+        slots.assign(workers,std::vector<int>());
+        slot_nodes.assign(workers,-1);
+        for (int worker=0;worker<workers;worker++){
+            std::vector<int>& slot = slots[worker];
+            for (size_t node=0;node<nodes.size();node++){
+                if (nodes[node].size()>=size_t(cores_per_worker)){
+                    slot.assign(nodes[node].begin(),nodes[node].begin()+cores_per_worker);
+                    nodes[node].erase(nodes[node].begin(),nodes[node].begin()+cores_per_worker);
+                    slot_nodes[worker] = node;
+                    break;
+                }
+            }
+            //No node has enough cores left: the set spans nodes
+            for (size_t node=0;node<nodes.size() && slot.size()<size_t(cores_per_worker);node++){
+                while (!nodes[node].empty() && slot.size()<size_t(cores_per_worker)){
+                    slot.push_back(nodes[node].front());
+                    nodes[node].erase(nodes[node].begin());
+                }
+            }
+            std::sort(slot.begin(),slot.end());
+        }
+        return true;
+#else
+        *error = "pinning engines needs Linux";
+        return false;
+#endif
+    }
+
+    //Pins every thread of the engine process to the cores of the worker
+    void pin(Engine* engine, int worker){
+#ifdef __linux__
+        if (!engine || worker<0 || size_t(worker)>=slots.size()){
+            return;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : slots[worker]){
+            CPU_SET(cpu,&set);
+        }
+        std::string tasks = "/proc/"+std::to_string(engine->pid)+"/task";
+        DIR* directory = opendir(tasks.c_str());
+        if (!directory){
+            sched_setaffinity(engine->pid,sizeof(set),&set);
+            return;
+        }
+        while (dirent* entry = readdir(directory)){
+            pid_t task;
+            if (parse_number(std::string_view(entry->d_name),task)){
+                sched_setaffinity(task,sizeof(set),&set);
+            }
+        }
+        closedir(directory);
+#endif
+    }
+
+    //Cores of a worker as a cpu list, for printing
+    std::string describe(int worker){
+        std::string text;
+        for (int cpu : slots[worker]){
+            text += (text.empty() ? "" : ",")+std::to_string(cpu);
+        }
+        return text+(slot_nodes[worker]>=0 ? " (node "+std::to_string(slot_nodes[worker])+")" : " (several nodes)");
+    }
+};
+
+//Physical memory in MB, 0 if unknown
+uint64_t physical_memory_mb(){
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    return pages>0 && page_size>0 ? uint64_t(pages)*uint64_t(page_size)/(1<<20) : 0;
+}
+
+/*======= Match journal =======*/
+/*With --journal a match writes what it has done to a file: its arguments
+and seed first, then the opening of every game it starts and every game
+it finishes with the result and the engine statistics. Records are only
+appended, each line ends with a checksum so a line torn by a crash is
+found and cut off. Workers only add lines to a buffer, a thread writes
+the buffer and calls fdatasync at most every --journal-sync ms, so one
+sync covers all games that finished in between. A crash loses at most
+the games of the last interval, --resume plays them again.*/
+
+//Keeps calling write() until everything is out
+bool write_all(int fd, const void* data, size_t length){
+    const char* bytes = (const char*)data;
+    while (length>0){
+        ssize_t written = ::write(fd,bytes,length);
+        if (written<0 && errno==EINTR){
+            continue;
+        }
+        if (written<=0){
+            return false;
+        }
+        bytes += written;
+        length -= size_t(written);
+    }
+    return true;
+}
+
+class MatchJournal{
+    public:
+    //A finished game read back from the journal
+    struct Game{
+        int game;
+        std::string result;
+        char engine1_side;
+        EngineStats stats[2];
+    };
+    uint64_t seed=0; //Seed of the opening order
+    std::vector<std::string> arguments; //Command line of the match
+    std::vector<std::pair<int,Opening>> openings; //Game number and where in the suite of every opening taken (no moves)
+    std::vector<Game> games; //Finished games
+    int syncs=0; //fdatasync calls
+
+    ~MatchJournal(){
+        close();
+    }
+
+//Starts a new journal, it must not exist yet
+    bool create(const std::string& path, uint64_t match_seed, const std::vector<std::string>& match_arguments, int sync_ms){
+        fd = ::open(path.c_str(),O_WRONLY|O_CREAT|O_EXCL|O_APPEND|O_CLOEXEC,0644);
+        if (fd<0){
+            return false;
+        }
+        seed = match_seed;
+        arguments = match_arguments;
+        std::string header = line("journal "+std::to_string(seed));
+        for (const std::string& argument : arguments){
+            header += line("arg "+argument);
+        }
+        if (!write_all(fd,header.data(),header.size()) || fdatasync(fd)!=0){
+            close();
+            return false;
+        }
+        start(sync_ms);
+        return true;
+    }
+
+//Reads an existing journal back and opens it for appending, a torn last line is cut off
+    bool resume(const std::string& path, int sync_ms){
+        MappedFile file;
+        if (!file.open(path,MADV_SEQUENTIAL)){
+            return false;
+        }
+        std::string_view data = file.view();
+        size_t offset = 0;
+        size_t valid = 0;
+        bool started = false;
+        while (offset<data.size()){
+            size_t start = offset;
+            std::string_view text = read_line(data,offset);
+            //The last line may miss its newline or its checksum
+            if (data[offset-1]!='\n' || !check(text)){
+                break;
+            }
+            std::string_view rest = text.substr(0,text.rfind(' '));
+            std::string_view kind = next_token(rest);
+            bool read = false;
+            if (kind=="journal"){
+                read = start==0 && parse_number(next_token(rest),seed);
+                started = read;
+            }
+            else if (kind=="arg" && started){
+                arguments.emplace_back(rest.substr(std::min<size_t>(1,rest.size())));
+                read = true;
+            }
+            else if (kind=="opening" && started){
+                std::pair<int,Opening> opening;
+                read = parse_number(next_token(rest),opening.first) && parse_number(next_token(rest),opening.second.offset) &&
+                parse_number(next_token(rest),opening.second.serial) && parse_number(next_token(rest),opening.second.next);
+                openings.push_back(opening);
+            }
+            else if (kind=="game" && started){
+                Game game;
+                std::string_view side;
+                read = parse_number(next_token(rest),game.game) && !(game.result = std::string(next_token(rest))).empty() &&
+                !(side = next_token(rest)).empty();
+                game.engine1_side = read ? side[0] : 'w';
+                for (EngineStats& stats : game.stats){
+                    read = read && parse_number(next_token(rest),stats.moves) && parse_number(next_token(rest),stats.think_time) &&
+                    parse_number(next_token(rest),stats.ponder_hits) && parse_number(next_token(rest),stats.ponder_misses) &&
+                    parse_number(next_token(rest),stats.searches) && parse_number(next_token(rest),stats.depth) &&
+                    parse_number(next_token(rest),stats.seldepth) && parse_number(next_token(rest),stats.nodes) &&
+                    parse_number(next_token(rest),stats.search_time);
+                }
+                games.push_back(game);
+            }
+            if (!read){
+                return false;
+            }
+            valid = offset;
+        }
+        if (!started){
+            return false;
+        }
+        fd = ::open(path.c_str(),O_WRONLY|O_APPEND|O_CLOEXEC);
+        if (fd<0 || (valid<data.size() && ftruncate(fd,valid)!=0)){
+            close();
+            return false;
+        }
+        start(sync_ms);
+        return true;
+    }
+
+//Game game starts from an opening of the suite: its offset, serial and the cursor after it
+    void add_opening(int game, const Opening& opening){
+        append(line("opening "+std::to_string(game)+" "+std::to_string(opening.offset)+" "+
+        std::to_string(opening.serial)+" "+std::to_string(opening.next)));
+    }
+
+    void add_game(int game, const std::string& result, char engine1_side, const EngineStats* stats){
+        std::string text = "game "+std::to_string(game)+" "+result+" "+engine1_side;
+        for (int which=0;which<2;which++){
+            char numbers[256];
+            snprintf(numbers,sizeof(numbers)," %d %lld %d %d %d %lld %lld %llu %lld",stats[which].moves,
+            (long long)stats[which].think_time,stats[which].ponder_hits,stats[which].ponder_misses,stats[which].searches,
+            (long long)stats[which].depth,(long long)stats[which].seldepth,(unsigned long long)stats[which].nodes,
+            (long long)stats[which].search_time);
+            text += numbers;
+        }
+        append(line(text));
+    }
+
+//Writes and syncs what is left, false if any write failed
+    bool close(){
+        if (writer.joinable()){
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+                changed.notify_all();
+            }
+            writer.join();
+        }
+        if (fd>=0){
+            ::close(fd);
+        }
+        fd = -1;
+        return !failed;
+    }
+
+    private:
+    int fd=-1; //Journal, opened for appending
+    int sync_ms=0; //Longest wait before new records are synced
+    std::mutex mutex; //Guards everything below
+    std::condition_variable changed;
+    std::string pending; //Records not written yet
+    bool stopping=false;
+    bool failed=false; //A write or sync failed, the journal is incomplete
+    std::thread writer;
+
+    //FNV-1a, enough to tell a torn line from a whole one
+    static uint32_t checksum(std::string_view text){
+        uint32_t hash = 2166136261u;
+        for (char c : text){
+            hash = (hash^uint8_t(c))*16777619u;
+        }
+        return hash;
+    }
+
+    static std::string line(const std::string& text){
+        char sum[16];
+        snprintf(sum,sizeof(sum)," %08x\n",checksum(text));
+        return text+sum;
+    }
+
+    static bool check(std::string_view text){
+        size_t space = text.rfind(' ');
+        uint32_t sum = 0;
+        if (space==std::string_view::npos || text.size()-space!=9){
+            return false;
+        }
+        auto parsed = std::from_chars(text.data()+space+1,text.data()+text.size(),sum,16);
+        return parsed.ec==std::errc() && parsed.ptr==text.data()+text.size() && sum==checksum(text.substr(0,space));
+    }
+
+    void start(int sync){
+        sync_ms = sync;
+        writer = std::thread(&MatchJournal::write_loop,this);
+    }
+
+    void append(const std::string& text){
+        std::lock_guard<std::mutex> lock(mutex);
+        pending += text;
+        changed.notify_all();
+    }
+
+    void write_loop(){
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true){
+            changed.wait(lock,[this](){return stopping || !pending.empty();});
+            if (pending.empty()){
+                return;
+            }
+            //Records that come in meanwhile share the write and the sync
+            changed.wait_for(lock,std::chrono::milliseconds(sync_ms),[this](){return stopping;});
+            std::string batch;
+            batch.swap(pending);
+            lock.unlock();
+            bool written = write_all(fd,batch.data(),batch.size()) && fdatasync(fd)==0;
+            lock.lock();
+            syncs++;
+            if (!written && !failed){
+                failed = true;
+                logger.log(LOG_ERROR,-1,"ERROR: cant write the match journal: %s",strerror(errno));
+            }
+        }
+    }
+};
+
+/*======= Live match state =======*/
+/*Running games publish their state here after every move for the match
+server. A slot belongs to one worker thread and the server only copies it
+out, so the game loop holds the slot lock for a few copies per ply.*/
+
+struct LiveGame{
+    std::mutex mutex; //Guards everything below
+    int game=-1; //Game played in this slot (from 0), -1 when idle
+    char engine1_side='w'; //Color of engine 1 in this game
+    std::string fen; //Current position
+    std::string last_move; //Last move in UCI notation
+    int ply=0; //Moves played so far
+    int64_t remaining[2]={0,0}; //Time left of white / black in microseconds, 0 if unlimited
+    bool has_info=false; //info holds the search of the last move
+    SearchInfo info; //Last search info of the last move
+};
+
+//Match wide switches of the match server, read by the workers
+class MatchControl{
+    public:
+    std::atomic<bool> paused{false}; //Workers don't start new games
+    std::atomic<bool> aborted{false}; //Running games stop at their next move and don't count
+    std::atomic<int> games{0}; //Games in the match, can grow while it runs
+    std::atomic<int> next_game{0}; //Next game number to hand out
+    std::vector<bool> finished; //Games played before a --resume, skipped (set before the workers start)
+    bool wait_for_games=false; //Idle workers wait for games to be added while games still run (set before the workers start)
+
+    void pause(){
+        paused = true;
+    }
+
+    void resume(){
+        std::lock_guard<std::mutex> lock(mutex);
+        paused = false;
+        changed.notify_all();
+    }
+
+    void abort(){
+        std::lock_guard<std::mutex> lock(mutex);
+        aborted = true;
+        changed.notify_all();
+    }
+
+    void add(int count){
+        std::lock_guard<std::mutex> lock(mutex);
+        games += count;
+        changed.notify_all();
+    }
+
+    //Waits while the match is paused, then takes the next game number.
+    //false once every game is handed out or the match was aborted or stopped.
+    //With wait_for_games it only gives up when no game runs that could still be followed by added ones.
+    bool take_game(int* game){
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true){
+            changed.wait(lock,[this](){return aborted || stopped ||
+            (!paused && (next_game<games || !wait_for_games || running==0));});
+            int next = next_game;
+            if (aborted || stopped || next>=games){
+                return false;
+            }
+            next_game = next+1;
+            if (size_t(next)>=finished.size() || !finished[next]){
+                running++;
+                *game = next;
+                return true;
+            }
+        }
+    }
+
+    //A game from take_game is over, stop ends the match (SPRT decided)
+    void finish_game(bool stop){
+        std::lock_guard<std::mutex> lock(mutex);
+        running--;
+        stopped = stopped || stop;
+        changed.notify_all();
+    }
+
+    private:
+    std::mutex mutex;
+    std::condition_variable changed;
+    int running=0; //Games taken and not finished
+    bool stopped=false;
+};
+
+/*======= Board class =======*/
+/*This is where all the board data is stored: 
+its state, number of moves, and so on. 
+It also contains all the main functions for interacting with it.*/
+
+class Board{
+    public: 
+
+    //======= Board data =======//
+    char board[8][8]; //8x8 board representation
+    char side; //Side to move
+    std::string castling; //Castling rights
+    std::string en_passant; //En passant target square
+    int half_move_counter; //Half move counter
+    int move_counter; //Full move counter
+    std::string fen; //FEN string representation
+    Position position; //Bitboard position used for move generation
+    uint64_t key; //Zobrist key of the position, also used as its identity in caches
+
+    std::vector<uint64_t> key_history; //Keys of every position of the game
+    int reversible_start; //First position in key_history after the last capture or pawn move
+    uint8_t repetition_filter[1024]; //Positions since reversible_start per low 10 key bits
+
+    std::vector<std::string> move_history; //Move history
+    std::string position_command; //"position ... moves ..." for the engines, grows with every move
+
+    //======= Game settings =======//
+    char player_side; //Side of the human player (default: w)
+    std::string game_mode; //Game mode (default: human-vs-engine)
+    int engine1_depth; //Engine search depth (default: 1)
+    int engine2_depth; //Engine search depth (default: 1)
+    Clock clock; //Game clock (default: unlimited)
+    std::string engine1_path; //Path to the engine executable (default: ./stockfish)
+    std::string engine2_path; //Path to the second engine executable (for engine-vs-engine mode)
+    char engine1_side; //Side for engine 1 (for engine-vs-engine mode)
+    char engine2_side; //Side for engine 2 (for engine-vs-engine mode)
+    bool ponder; //Engines think on the opponent's time (default: off)
+    int engine_threads[2]; //Threads option of engine 1 / engine 2 (default: 0, the engine's own)
+    int engine_hash[2]; //Hash option in MB of engine 1 / engine 2 (default: 0, the engine's own or the --pin share)
+    std::vector<std::string> engine_options[2]; //Other options of engine 1 / engine 2 as "name=value"
+    bool pin; //Pin the engines of every game to their own cores (default: off)
+    CoreScheduler* scheduler; //Cores of every worker when pinning
+    EngineStats engine_stats[2]; //Move statistics of engine 1 and engine 2 in the current game
+    std::vector<MoveRecord> move_records; //Search info of every engine move in the current game
+    std::string info_log; //Per-game search log, .json or .csv (default: none)
+    int game_number; //Number of the current game in a match (from 0)
+    int games; //Number of games in a match (default: 1)
+    int concurrency; //Number of games played in parallel (default: 1)
+    std::string openings; //Opening suite, .epd/.fen or .pgn (default: none)
+    bool random_openings; //Sample openings at random instead of in file order
+    uint64_t seed; //Seed for the random opening order (default: random)
+    int opening_plies; //Most book moves taken from a PGN game (default: all)
+    SprtBounds sprt; //Early stop of a match (default: off)
+    int resign_moves; //Moves in a row both engines must see a side lost (default: 0, off)
+    int resign_score; //Centipawns a side must be down for resign adjudication
+    int draw_move; //First full move where draw adjudication may happen (default: 0, off)
+    int draw_moves; //Moves in a row both engines must see a draw
+    int draw_score; //Centipawns the score must stay within for draw adjudication
+    std::string tb_path; //Syzygy tablebase directory, passed to the engines (default: none)
+    int tb_pieces; //Positions with this many pieces or less are adjudicated by the engine's tablebase score
+    std::string archive; //Binary archive every finished game is added to (default: none)
+    std::string termination; //Why the current game ended
+    std::string cache_path; //Persistent eval cache file (default: none)
+    int cache_size; //Size of a new eval cache in MB (default: 64)
+    std::shared_ptr<EvalCache> cache; //The open eval cache, shared by all games of a match
+    std::vector<int64_t>* ply_times; //Wall time of every engine ply in nanoseconds (bench mode only)
+    bool headless; //No board rendering or progress output, only results (default: off)
+    int log_level; //Most detailed LogLevel that is logged (default: info)
+    std::string log_dir; //Directory for one log file per game (default: none, games log to the console)
+    int server_port; //Port of the match server on localhost (default: 0, off)
+    LiveGame* live; //Slot the current game publishes its state to (match server only)
+    MatchControl* control; //Pause and abort switches of the running match (match mode only)
+    std::string coordinator; //Address remote workers connect to, the match is played by them (default: none)
+    std::string token; //Secret a worker must send to join the coordinator (default: none)
+    std::string journal_path; //Write-ahead journal of a match (default: none)
+    bool resume; //Continue the match of journal_path instead of starting a new one
+    int journal_sync; //Most milliseconds between two syncs of the journal (default: 1000)
+    std::vector<std::string> arguments; //Command line of the match, a resumed match must have the same one
+    MatchJournal* journal; //The open journal (match mode only)
+
+//======= Board constructor =======//
+    Board(){
+        //Default constructor initializing standard chess starting position
+        fen="rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+        set_position(fen,nullptr);
+        player_side='w';
+        side = 'w';
+        game_mode="human-vs-human";
+        engine1_path = "Stockfish/src/stockfish";
+        engine2_path = "Stockfish/src/stockfish";
+        engine1_side = 'w';
+        engine2_side = 'b';
+        engine1_depth=1;
+        engine2_depth=1;
+        games=1;
+        concurrency=1;
+        ponder=false;
+        game_number=0;
+        random_openings=false;
+        seed=std::random_device()();
+        opening_plies=0;
+        resign_moves=0;
+        resign_score=1000;
+        draw_move=0;
+        draw_moves=8;
+        draw_score=10;
+        tb_pieces=0;
+        cache_size=64;
+        cache=nullptr;
+        ply_times=nullptr;
+        headless=false;
+        log_level=LOG_INFO;
+        server_port=0;
+        engine_threads[0]=engine_threads[1]=0;
+        engine_hash[0]=engine_hash[1]=0;
+        pin=false;
+        scheduler=nullptr;
+        live=nullptr;
+        control=nullptr;
+        resume=false;
+        journal_sync=1000;
+        journal=nullptr;
+    }
+    
+//======= Board functions =======//
+
+//Gets the current position in UCI format
+    std::string get_uci_line(){
+        return position.get_fen();
+    }
+
+//Sets the board position from a FEN string, the confirmation goes to output (nullptr: none).
+//A FEN that can't be read leaves the board as it was and returns false.
+    bool set_position(std::string pos, FILE* output){
+        Position parsed;
+        if (!parsed.set_fen(pos)){
+            std::cout << "ERROR: cant read position " << pos << "\n";
+            return false;
+        }
+        position = parsed;
+        sync_position();
+        move_history.clear();
+        move_records.clear();
+        if (pos=="rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"){
+            position_command = "position startpos";
+        }
+        else{
+            position_command = "position fen "+pos;
+        }
+        key_history.clear();
+        reversible_start = 0;
+        memset(repetition_filter,0,sizeof(repetition_filter));
+        push_key();
+        if (output){
+            fprintf(output,"Board position set.\n");
+        }
+        return true;
+    }
+
+//Starts a game from an opening: its position and then its book moves
+    bool set_opening(const Opening& opening){
+        fen = opening.fen;
+        if (!set_position(fen,nullptr)){
+            return false;
+        }
+        for (const std::string& move : opening.moves){
+            if (!do_move(move)){
+                return false;
+            }
+        }
+        return true;
+    }
+
+//Copies the bitboard position into the printable board data
+    void sync_position(){
+        for (int i=0;i<8;i++){
+            for (int j=0;j<8;j++){
+                board[i][j]=piece_chars[position.squares[(7-i)*8+j]];
+            }
+        }
+        side = position.side==WHITE ? 'w' : 'b';
+        castling = position.castling_string();
+        en_passant = position.en_passant==NO_SQUARE ? "-" : Position::square_name(position.en_passant);
+        half_move_counter = position.half_move_counter;
+        move_counter = position.move_counter;
+        key = position.key;
+    }
+
+//Adds the current position to the key history. Positions before a capture
+//or pawn move can't repeat any more, so they leave the filter.
+    void push_key(){
+        if (half_move_counter==0){
+            for (size_t i=reversible_start;i<key_history.size();i++){
+                repetition_filter[key_history[i]&1023]--;
+            }
+            reversible_start = key_history.size();
+        }
+        key_history.push_back(key);
+        repetition_filter[key&1023]++;
+    }
+
+//Key of the search for the eval cache. The engine gets the moves since the last
+//capture or pawn move too, and knowing which positions can repeat changes its
+//bestmove and score, so they and the move counter are part of the key.
+    uint64_t cache_key(){
+        if (half_move_counter==0){
+            return key;
+        }
+        uint64_t mixed = key^uint64_t(half_move_counter);
+        for (size_t i=reversible_start;i+1<key_history.size();i++){
+            mixed = (mixed^key_history[i])*0x9E3779B97F4A7C15ull;
+        }
+        return mixed ? mixed : 1;
+    }
+
+//Checks if the current position occurred count times. The filter rules out
+//almost every position at once, only real candidates are compared.
+    bool is_repetition(int count){
+        if (repetition_filter[key&1023]<count){
+            return false;
+        }
+        int seen = 0;
+        for (int i=int(key_history.size())-1;i>=reversible_start;i-=2){
+            if (key_history[i]==key && ++seen>=count){
+                return true;
+            }
+        }
+        return false;
+    }
+
+//Checks if a move is legal in the current position
+    bool move_check(std::string move){
+        return position.parse_uci_move(move)!=0;
+    }
+
+//Makes a move on the board, returns false if the move is not legal
+    bool do_move(std::string move){
+        Move legal = position.parse_uci_move(move);
+        if (!legal){
+            std::cout<<"Move "<<move<<" is not legal.\n";
+            return false;
+        }
+        position.do_move(legal);
+        sync_position();
+        push_key();
+        move_history.push_back(Position::move_to_uci(legal));
+        position_command += move_history.size()==1 ? " moves " : " ";
+        position_command += move_history.back();
+        return true;
+    }
+
+//Result when the side to move runs out of time
+    std::string time_forfeit(std::string* reason){
+        int loser = position.side;
+        if (!position.can_mate(loser^1)){
+            *reason = "timeout vs insufficient material";
+            return "1/2-1/2";
+        }
+        *reason = loser==WHITE ? "white loses on time" : "black loses on time";
+        return loser==WHITE ? "0-1" : "1-0";
+    }
+
+//Checks if the game is over. Returns the result ("1-0", "0-1", "1/2-1/2")
+//and writes why into reason, or returns an empty string if the game goes on.
+    std::string game_result(std::string* reason){
+        MoveList moves;
+        position.generate_legal(moves);
+        if (moves.size==0){
+            if (position.in_check()){
+                *reason = "checkmate";
+                return position.side==WHITE ? "0-1" : "1-0";
+            }
+            *reason = "stalemate";
+            return "1/2-1/2";
+        }
+        if (position.half_move_counter>=100){
+            *reason = "50-move rule";
+            return "1/2-1/2";
+        }
+        if (is_repetition(3)){
+            *reason = "threefold repetition";
+            return "1/2-1/2";
+        }
+        if (position.insufficient_material()){
+            *reason = "insufficient material";
+            return "1/2-1/2";
+        }
+        return "";
+    }
+
+//Ends a decided game early from the engines' scores. Returns the result,
+//or an empty string if the game goes on. Scores are checked from white's
+//view over the last moves of both engines, so both have to agree.
+    std::string adjudicate(std::string* reason){
+        size_t count = move_records.size();
+        if (count==0 || !move_records.back().has_info){
+            return "";
+        }
+        const SearchInfo& last = move_records.back().info;
+        //The score belongs to the searched position, which has a piece more than
+        //the current one after a capture. An engine with tablebases (tbhits>0)
+        //probes the root when the root itself is in them, only then is the score exact.
+        if (tb_pieces>0 && last.tbhits>0 && move_records.back().root_pieces<=tb_pieces){
+            int score = last.score_cp();
+            if (score==0){
+                *reason = "tablebase draw";
+                return "1/2-1/2";
+            }
+            if (std::abs(score)>=10000){
+                bool white_wins = (score>0)==(move_records.back().side==WHITE);
+                *reason = "tablebase win";
+                return white_wins ? "1-0" : "0-1";
+            }
+        }
+        bool white_lost = resign_moves>0 && count>=size_t(2*resign_moves);
+        bool black_lost = white_lost;
+        for (size_t i=white_lost ? count-2*resign_moves : count;i<count;i++){
+            const MoveRecord& record = move_records[i];
+            int white_score = record.side==WHITE ? record.info.score_cp() : -record.info.score_cp();
+            white_lost = white_lost && record.has_info && white_score<=-resign_score;
+            black_lost = black_lost && record.has_info && white_score>=resign_score;
+        }
+        if (white_lost || black_lost){
+            *reason = white_lost ? "white resigns" : "black resigns";
+            return white_lost ? "0-1" : "1-0";
+        }
+        bool draw = draw_move>0 && move_counter>=draw_move && count>=size_t(2*draw_moves);
+        for (size_t i=draw ? count-2*draw_moves : count;i<count;i++){
+            const MoveRecord& record = move_records[i];
+            draw = draw && record.has_info && std::abs(record.info.score_cp())<=draw_score;
+        }
+        if (draw){
+            *reason = "draw adjudication";
+            return "1/2-1/2";
+        }
+        return "";
+    }
+
+//Prints the board to console
+    void print_board(){
+        //Print board depending on player side
+        if (side=='w'){
+            for (int i=0;i<8;i++){
+                std::cout<<8-i<<" ";
+                for (int j=0;j<8;j++){
+                    std::cout<<board[i][j]<<" ";
+                }
+                std::cout<<'\n';
+            }
+            std::cout<<"  a b c d e f g h\n";
+        }
+        else{
+            for (int i=7;i>=0;i--){
+                std::cout<<8-i<<" ";
+                for (int j=7;j>=0;j--){
+                    std::cout<<board[i][j]<<" ";
+                }
+                std::cout<<'\n';
+            }
+            std::cout<<"  h g f e d c b a\n";
+        }
+    }
+};
+
+/*======= Game archive =======*/
+/*Finished games are appended to a binary archive. The file is cut into
+fixed 64 KB blocks. A game that doesn't fit into the rest of a block
+starts the next one, the gap is padding, marked by a zero length. Games
+longer than a block run over into the blocks after it, so a block
+starts at a game only if no game runs over into it. The archive is read
+from the start; to jump to a game, use the index file next to it
+(archive.idx), with a fixed 16 byte entry per game: offset (8), length
+(4) and game number (4).
+
+A game record, numbers are LEB128 varints, signed ones zigzag coded:
+    length       bytes after this field (0: padding up to the next block)
+    game         game number in the match (from 0)
+    result       0 "1-0", 1 "0-1", 2 "1/2-1/2", 3 unfinished
+    flags        1: has a start FEN, 2: has per-move search info
+    white, black, termination, [fen]    varint length and the bytes
+    plies        number of moves
+    moves        2 bytes per move, little endian Move codes
+    [info]       per move: score (signed, centipawns), depth (0: none), time (ms)*/
+
+const char ARCHIVE_MAGIC[8] = {'C','H','E','S','S','G','A','1'};
+const size_t ARCHIVE_BLOCK = 1<<16;
+
+void put_varint(std::string& out, uint64_t value){
+    while (value>=0x80){
+        out.push_back(char(value|0x80));
+        value >>= 7;
+    }
+    out.push_back(char(value));
+}
+
+void put_signed_varint(std::string& out, int64_t value){
+    put_varint(out,(uint64_t(value)<<1) ^ uint64_t(value>>63));
+}
+
+void put_string(std::string& out, std::string_view text){
+    put_varint(out,text.size());
+    out.append(text);
+}
+
+//Reads a varint at pos, pos moves past it. False if the data ends first.
+bool get_varint(const uint8_t* data, size_t size, size_t& pos, uint64_t& value){
+    value = 0;
+    for (int shift=0;shift<64 && pos<size;shift+=7){
+        uint8_t byte = data[pos++];
+        value |= uint64_t(byte&0x7F)<<shift;
+        if (!(byte&0x80)){
+            return true;
+        }
+    }
+    return false;
+}
+
+struct ArchivedGame{
+    uint64_t game=0;
+    std::string result;
+    bool has_info=false;
+    std::string white, black, termination, fen;
+    std::vector<Move> moves;
+    std::vector<int> scores, depths, times; //Per move, only with has_info
+};
+
+class GameArchive{
+    public:
+    std::mutex mutex; //Guards the files, games come from all match workers
+    int fd=-1; //Archive, opened for appending
+    int index_fd=-1; //Index file
+    uint64_t size=0; //Archive size, where the next game goes
+
+    ~GameArchive(){
+        close();
+    }
+
+    bool open(const std::string& path){
+        fd = ::open(path.c_str(),O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,0644);
+        index_fd = ::open((path+".idx").c_str(),O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,0644);
+        struct stat info;
+        if (fd<0 || index_fd<0 || fstat(fd,&info)<0){
+            close();
+            return false;
+        }
+        size = uint64_t(info.st_size);
+        if (size==0){
+            size = write_all(fd,ARCHIVE_MAGIC,sizeof(ARCHIVE_MAGIC)) ? sizeof(ARCHIVE_MAGIC) : 0;
+        }
+        return size>0;
+    }
+
+    void close(){
+        if (fd>=0){
+            ::close(fd);
+        }
+        if (index_fd>=0){
+            ::close(index_fd);
+        }
+        fd = index_fd = -1;
+    }
+
+    //Appends a finished game with the names of the engines playing white and black
+    bool add(Board* board, std::string result, std::string white, std::string black){
+        //The record is built before taking the lock, workers only wait for the write
+        std::string body;
+        put_varint(body,board->game_number);
+        put_varint(body,result=="1-0" ? 0 : result=="0-1" ? 1 : result=="1/2-1/2" ? 2 : 3);
+        bool startpos = board->fen=="rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+        bool has_info = !board->move_records.empty();
+        put_varint(body,(startpos ? 0 : 1) | (has_info ? 2 : 0));
+        put_string(body,white);
+        put_string(body,black);
+        put_string(body,board->termination);
+        if (!startpos){
+            put_string(body,board->fen);
+        }
+        put_varint(body,board->move_history.size());
+        Position position;
+        position.set_fen(board->fen);
+        for (const std::string& text : board->move_history){
+            Move move = position.parse_uci_move(text);
+            position.do_move(move);
+            body.push_back(char(move&0xFF));
+            body.push_back(char(move>>8));
+        }
+        if (has_info){
+            size_t next = 0;
+            for (size_t ply=1;ply<=board->move_history.size();ply++){
+                while (next<board->move_records.size() && size_t(board->move_records[next].ply)<ply){
+                    next++;
+                }
+                const MoveRecord* record = next<board->move_records.size() &&
+                size_t(board->move_records[next].ply)==ply ? &board->move_records[next] : nullptr;
+                bool info = record && record->has_info;
+                put_signed_varint(body,info ? record->info.score_cp() : 0);
+                put_varint(body,info ? std::max(record->info.depth,0) : 0);
+                put_varint(body,record ? uint64_t(std::max<int64_t>(record->time,0)/1000) : 0);
+            }
+        }
+        std::string record;
+        put_varint(record,body.size());
+        record += body;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t used = size%ARCHIVE_BLOCK;
+        size_t padding = used>0 && used+record.size()>ARCHIVE_BLOCK ? size_t(ARCHIVE_BLOCK-used) : 0;
+        record.insert(0,padding,'\0');
+        uint64_t offset = size+padding;
+        if (!write_all(fd,record.data(),record.size())){
+            return false;
+        }
+        size += record.size();
+        uint8_t entry[16];
+        for (int i=0;i<8;i++){
+            entry[i] = uint8_t(offset>>(8*i));
+        }
+        for (int i=0;i<4;i++){
+            entry[8+i] = uint8_t((record.size()-padding)>>(8*i));
+            entry[12+i] = uint8_t(uint32_t(board->game_number)>>(8*i));
+        }
+        return write_all(index_fd,entry,sizeof(entry));
+    }
+
+};
+
+//Reads the games of an archive one after another, or from an index entry
+class ArchiveReader{
+    public:
+    MappedFile file;
+    size_t pos=0; //Next record
+
+    bool open(const std::string& path){
+        if (!file.open(path,MADV_SEQUENTIAL) || file.size<sizeof(ARCHIVE_MAGIC) ||
+        memcmp(file.data,ARCHIVE_MAGIC,sizeof(ARCHIVE_MAGIC))!=0){
+            return false;
+        }
+        pos = sizeof(ARCHIVE_MAGIC);
+        return true;
+    }
+
+    //Reads the next game, false at the end of the archive or at a broken record
+    bool next(ArchivedGame* game){
+        const uint8_t* data = (const uint8_t*)file.data;
+        uint64_t length = 0;
+        while (true){
+            if (pos>=file.size){
+                return false;
+            }
+            size_t start = pos;
+            if (!get_varint(data,file.size,pos,length)){
+                return false;
+            }
+            if (length>0){
+                break;
+            }
+            pos = (start/ARCHIVE_BLOCK+1)*ARCHIVE_BLOCK;
+        }
+        if (length>file.size-pos){
+            return false; //Cut off, the writer was stopped in the middle of a game
+        }
+        size_t end = pos+length;
+        bool ok = parse(data,end,game);
+        pos = end;
+        return ok;
+    }
+
+    private:
+    bool parse(const uint8_t* data, size_t end, ArchivedGame* game){
+        uint64_t result, flags, plies;
+        if (!get_varint(data,end,pos,game->game) || !get_varint(data,end,pos,result) ||
+        !get_varint(data,end,pos,flags) || result>3){
+            return false;
+        }
+        game->result = result==0 ? "1-0" : result==1 ? "0-1" : result==2 ? "1/2-1/2" : "*";
+        game->has_info = flags&2;
+        game->fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+        if (!get_string(data,end,game->white) || !get_string(data,end,game->black) ||
+        !get_string(data,end,game->termination) || ((flags&1) && !get_string(data,end,game->fen)) ||
+        !get_varint(data,end,pos,plies) || plies>(end-pos)/2){
+            return false;
+        }
+        game->moves.resize(plies);
+        for (uint64_t i=0;i<plies;i++){
+            game->moves[i] = Move(data[pos] | data[pos+1]<<8);
+            pos += 2;
+        }
+        game->scores.clear();
+        game->depths.clear();
+        game->times.clear();
+        for (uint64_t i=0;game->has_info && i<plies;i++){
+            uint64_t score, depth, time;
+            if (!get_varint(data,end,pos,score) || !get_varint(data,end,pos,depth) || !get_varint(data,end,pos,time)){
+                return false;
+            }
+            game->scores.push_back(int(int64_t(score>>1) ^ -int64_t(score&1)));
+            game->depths.push_back(int(depth));
+            game->times.push_back(int(time));
+        }
+        return true;
+    }
+
+    bool get_string(const uint8_t* data, size_t end, std::string& text){
+        uint64_t length;
+        if (!get_varint(data,end,pos,length) || length>end-pos){
+            return false;
+        }
+        text.assign((const char*)data+pos,length);
+        pos += length;
+        return true;
+    }
+};
+
+//Adds the game just played on board to the archive, engines are named after their executables
+void archive_game(GameArchive* archive, Board* board, std::string result){
+    std::string names[2] = {board->engine1_path,board->engine2_path};
+    for (std::string& name : names){
+        name = name.substr(name.rfind('/')==std::string::npos ? 0 : name.rfind('/')+1);
+    }
+    bool engine1_white = board->engine1_side=='w';
+    if (!archive->add(board,result,names[engine1_white ? 0 : 1],names[engine1_white ? 1 : 0])){
+        std::cout<<"ERROR: cant write game "<<board->game_number+1<<" to "<<board->archive<<"\n";
+    }
+}
+
+//Writes a game as PGN, with the search info as {score/depth time} comments
+void write_pgn(FILE* out, const ArchivedGame& game){
+    bool startpos = game.fen=="rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+    fprintf(out,"[Event \"Engine match\"]\n[Site \"?\"]\n[Date \"????.??.??\"]\n[Round \"%llu\"]\n[White \"%s\"]\n[Black \"%s\"]\n"
+    "[Result \"%s\"]\n",(unsigned long long)game.game+1,game.white.c_str(),game.black.c_str(),game.result.c_str());
+    if (!startpos){
+        fprintf(out,"[SetUp \"1\"]\n[FEN \"%s\"]\n",game.fen.c_str());
+    }
+    if (!game.termination.empty()){
+        fprintf(out,"[Termination \"%s\"]\n",game.termination.c_str());
+    }
+    fprintf(out,"[PlyCount \"%zu\"]\n\n",game.moves.size());
+    Position position;
+    position.set_fen(game.fen);
+    std::string line;
+    char token[64];
+    for (size_t i=0;i<game.moves.size();i++){
+        Move move = game.moves[i];
+        MoveList legal;
+        position.generate_legal(legal);
+        if (std::find(legal.begin(),legal.end(),move)==legal.end()){
+            break; //Broken record, the moves so far are still worth having
+        }
+        std::string word;
+        if (position.side==WHITE || i==0){
+            snprintf(token,sizeof(token),position.side==WHITE ? "%d. " : "%d... ",position.move_counter);
+            word = token;
+        }
+        word += position.move_to_san(move);
+        if (game.has_info && game.depths[i]>0){
+            int score = game.scores[i];
+            if (std::abs(score)>=90000){
+                snprintf(token,sizeof(token)," {%sM%d/%d %.3fs}",score>0 ? "+" : "-",
+                100000-std::abs(score),game.depths[i],game.times[i]/1000.0);
+            }
+            else{
+                snprintf(token,sizeof(token)," {%+.2f/%d %.3fs}",score/100.0,game.depths[i],game.times[i]/1000.0);
+            }
+            word += token;
+        }
+        if (!line.empty() && line.size()+1+word.size()>80){
+            fprintf(out,"%s\n",line.c_str());
+            line.clear();
+        }
+        line += line.empty() ? word : " "+word;
+        position.do_move(move);
+    }
+    if (!line.empty() && line.size()+1+game.result.size()>80){
+        fprintf(out,"%s\n",line.c_str());
+        line.clear();
+    }
+    line += line.empty() ? game.result : " "+game.result;
+    fprintf(out,"%s\n\n",line.c_str());
+}
+
+//======= Game mode functions =======//
+void HumanVSHuman(Board* board){
+    std::cout<<"Human vs Human mode selected.\n";
+    board->set_position(board->fen,stdout);
+    board->clock.reset();
+    while (true){
+        board->print_board();
+        board->clock.print();
+        std::string reason;
+        std::string result = board->game_result(&reason);
+        if (!result.empty()){
+            std::cout<<"Game over: "<<result<<" ("<<reason<<")\n";
+            return;
+        }
+        std::cout << "Enter your move in algebraic notation (or 'quit' to exit): ";
+        std::string input;
+        board->clock.start(board->position.side);
+        std::cin>>input;
+        if (!board->clock.stop()){
+            result = board->time_forfeit(&reason);
+            std::cout<<"Game over: "<<result<<" ("<<reason<<")\n";
+            return;
+        }
+        if (input=="quit"){
+            return;
+        }
+        board->do_move(input);
+    }
+}
+
+const int ENGINE_READY_MS = 30000; //Longest wait for uciok and readyok
+
+//Asks the engine to quit and waits for it
+void stop_engine(Engine* engine){
+    send_message("quit",engine);
+    delete engine;
+}
+
+//Starts an engine and waits until it is ready
+Engine* start_engine(std::string path){
+    Engine* engine = new Engine;
+    if (!engine->start(path)){
+        delete engine;
+        return nullptr;
+    }
+    //A program that never speaks UCI must not hold up the worker that starts it
+    send_message("uci",engine);
+    if (!starts_with(read_response(engine,ENGINE_READY_MS),"uciok")){
+        stop_engine(engine);
+        return nullptr;
+    }
+    send_message("isready",engine);
+    if (!starts_with(read_response(engine,ENGINE_READY_MS),"readyok")){
+        stop_engine(engine);
+        return nullptr;
+    }
+    return engine;
+}
+
+//Sends the engine options the game settings need (which: 0 engine 1, 1 engine 2)
+void setup_engine(Board* board, Engine* engine, int which){
+    std::vector<std::string> options;
+    if (board->engine_threads[which]>0){
+        options.push_back("Threads value "+std::to_string(board->engine_threads[which]));
+    }
+    if (board->engine_hash[which]>0){
+        options.push_back("Hash value "+std::to_string(board->engine_hash[which]));
+    }
+    for (const std::string& option : board->engine_options[which]){
+        size_t equals = option.find('=');
+        options.push_back(option.substr(0,equals)+(equals==std::string::npos ? "" : " value "+option.substr(equals+1)));
+    }
+    if (board->ponder){
+        options.push_back("Ponder value true");
+    }
+    if (!board->tb_path.empty()){
+        options.push_back("SyzygyPath value "+board->tb_path);
+    }
+    //Everything set here can change a search, so all of it goes into the eval cache key
+    engine->options.clear();
+    for (const std::string& option : options){
+        send_message("setoption name "+option,engine);
+        engine->options += "\n"+option;
+    }
+}
+
+//Tells the engine a new game starts, so it can drop its hash and history.
+//Returns false if the engine doesn't get ready.
+bool new_game(Engine* engine){
+    send_message("ucinewgame",engine);
+    send_message("isready",engine);
+    return starts_with(read_response(engine,ENGINE_READY_MS),"readyok");
+}
+
+//Opens the eval cache given in the settings, if any. False if it can't be opened.
+bool open_eval_cache(Board* board){
+    if (board->cache_path.empty()){
+        return true;
+    }
+    auto cache = std::make_shared<EvalCache>();
+    if (!cache->open(board->cache_path,board->cache_size)){
+        std::cout<<"ERROR: cant open eval cache "<<board->cache_path<<"\n";
+        return false;
+    }
+    board->cache = cache;
+    return true;
+}
+
+//Splits the cores and the memory between the workers for --pin, the engines
+//without a Hash option share half of the memory. False if there aren't enough cores.
+bool plan_cores(Board* board, int workers, CoreScheduler* scheduler){
+    if (!board->pin){
+        return true;
+    }
+    int threads1 = std::max(board->engine_threads[0],1);
+    int threads2 = std::max(board->engine_threads[1],1);
+    //Both engines of a game only think at once when they ponder
+    int cores = board->ponder ? threads1+threads2 : std::max(threads1,threads2);
+    std::string error;
+    if (!scheduler->plan(workers,cores,&error)){
+        std::cout<<"ERROR: cant pin engines, "<<error<<"\n";
+        return false;
+    }
+    uint64_t memory = physical_memory_mb();
+    uint64_t share = memory/2/(uint64_t(workers)*2);
+    int hash = 1;
+    while (uint64_t(hash)*2<=share && hash<1024){
+        hash *= 2;
+    }
+    for (int which=0;which<2;which++){
+        if (board->engine_hash[which]==0 && memory>0){
+            board->engine_hash[which] = hash;
+        }
+    }
+    uint64_t needed = uint64_t(workers)*(board->engine_hash[0]+board->engine_hash[1]);
+    if (memory>0 && needed>memory){
+        std::cout<<"WARNING: the hash tables need "<<needed<<" MB, the machine has "<<memory<<" MB\n";
+    }
+    if (!board->headless){
+        std::cout<<"Pinning engines: "<<cores<<" cores per game, hash "<<board->engine_hash[0]<<"/"<<
+        board->engine_hash[1]<<" MB\n";
+        for (int worker=0;worker<workers;worker++){
+            std::cout<<"Worker "<<worker+1<<": cores "<<scheduler->describe(worker)<<"\n";
+        }
+    }
+    return true;
+}
+
+//Prints how often the eval cache saved a search and lets go of it
+void close_eval_cache(Board* board){
+    if (board->cache){
+        std::cout<<"Eval cache: "<<board->cache->hits<<" hits, "<<board->cache->misses<<" misses\n";
+        board->cache = nullptr;
+    }
+}
+
+//======= Engine pool =======//
+/*Every configured engine is started once and then handed from game to
+game: between games it only gets ucinewgame/isready, so the engine
+startup (network loading, hash allocation, uci handshake) is paid once
+per process instead of once per game. An engine that crashed or stopped
+answering is replaced by a fresh one.*/
+
+class EnginePool{
+    public:
+    std::mutex mutex; //Guards idle and the counters
+    Board* settings; //Engine paths and options
+    std::vector<Engine*> idle[2]; //Started engines not in a game (engine 1, engine 2)
+    int started=0; //Engine processes started
+    int respawned=0; //Engines replaced after a crash
+
+    EnginePool(Board* board) : settings(board) {}
+
+    ~EnginePool(){
+        shutdown();
+    }
+
+//Gets a ready engine for a new game (which: 0 engine 1, 1 engine 2), nullptr if it can't start
+    Engine* acquire(int which){
+        Engine* engine = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!idle[which].empty()){
+                engine = idle[which].back();
+                idle[which].pop_back();
+            }
+        }
+        if (engine){
+            if (engine->running() && new_game(engine)){
+                return engine;
+            }
+            delete engine;
+            std::lock_guard<std::mutex> lock(mutex);
+            respawned++;
+        }
+        engine = start_engine(which==0 ? settings->engine1_path : settings->engine2_path);
+        if (!engine){
+            return nullptr;
+        }
+        setup_engine(settings,engine,which);
+        if (!new_game(engine)){
+            delete engine;
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        started++;
+        return engine;
+    }
+
+//Gives the engine back after a game
+    void release(int which, Engine* engine){
+        if (!engine){
+            return;
+        }
+        if (!engine->running()){
+            //Replaced on the next acquire
+            delete engine;
+            std::lock_guard<std::mutex> lock(mutex);
+            respawned++;
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        idle[which].push_back(engine);
+    }
+
+//Sends quit to every idle engine and waits for them (killing stragglers)
+    void shutdown(){
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& engines : idle){
+            for (Engine* engine : engines){
+                send_message("quit",engine);
+            }
+            for (Engine* engine : engines){
+                delete engine;
+            }
+            engines.clear();
+        }
+    }
+};
+
+//Engine taking part in a game, with its pondering state
+struct Player{
+    Engine* engine;
+    int depth; //Search depth when there is no clock
+    std::string name;
+    EngineStats* stats; //Where this game's numbers go
+    bool pondering=false; //Engine runs "go ponder"
+    std::string ponder_move{}; //Move it expects from the opponent
+    std::string early_bestmove{}; //bestmove sent while pondering (against the protocol, but it happens)
+    InfoTrace trace{}; //Search info of the current search
+};
+
+//Search limits for the side to move: the clock if there is one, else a fixed depth
+std::string search_limits(Board* board, int depth, int side){
+    if (board->clock.enabled){
+        return board->clock.limits(side);
+    }
+    return "depth "+std::to_string(depth);
+}
+
+//Reads the response of one engine while the other one ponders. The pondering
+//engine's output is consumed as it comes, so its pipe never fills up.
+std::string read_response_pondering(Engine* engine, Player* ponderer, int timeout_ms, InfoTrace* trace){
+    if (!ponderer || !ponderer->pondering){
+        return read_response(engine,timeout_ms,trace);
+    }
+    auto deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(timeout_ms);
+    std::string_view line;
+    while (true){
+        while (ponderer->engine->buffer.next_line(line)){
+            if (starts_with(line,"info ")){
+                ponderer->trace.add(line);
+            }
+            else if (starts_with(line,"bestmove")){
+                ponderer->early_bestmove = std::string(line);
+            }
+        }
+        while (engine->buffer.next_line(line)){
+            if (trace && starts_with(line,"info ")){
+                trace->add(line);
+            }
+            else if (is_terminator(line)){
+                return std::string(line);
+            }
+        }
+        if (engine->eof){
+            return "";
+        }
+        int wait = -1;
+        if (timeout_ms>=0){
+            wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline-std::chrono::steady_clock::now()).count();
+            if (wait<=0){
+                return "";
+            }
+        }
+        pollfd fds[2] = {{engine->output,POLLIN,0},{ponderer->engine->output,POLLIN,0}};
+        int count = ponderer->engine->eof ? 1 : 2;
+        if (poll(fds,count,wait)<0 && errno!=EINTR){
+            return "";
+        }
+        if (fds[0].revents){
+            engine->fill();
+        }
+        if (count==2 && fds[1].revents){
+            ponderer->engine->fill();
+        }
+    }
+}
+
+//Asks the engine for a move in the current position and charges its clock.
+//A pondering engine gets ponderhit if it guessed the move, otherwise it is
+//stopped and searches again. The clock runs from the opponent's move on.
+//Returns the bestmove line, or an empty string if the engine didn't answer in time.
+std::string engine_move(Board* board, Player* player, Player* opponent=nullptr){
+    Clock& clock = board->clock;
+    int side = board->position.side;
+    Engine* engine = player->engine;
+    bool hit = false;
+    if (player->pondering){
+        hit = board->move_history.back()==player->ponder_move;
+        if (hit){
+            player->stats->ponder_hits++;
+        }
+        else{
+            player->stats->ponder_misses++;
+        }
+    }
+    clock.start(side);
+    if (!hit){
+        player->trace.clear();
+    }
+    std::string move;
+    int timeout = clock.enabled ? clock.time_left_ms(side) : -1;
+    if (player->pondering && !player->early_bestmove.empty()){
+        //The ponder search already ended on its own
+        move = hit ? player->early_bestmove : "";
+    }
+    else if (hit){
+        send_message("ponderhit",engine);
+        move = read_response_pondering(engine,opponent,timeout,&player->trace);
+    }
+    else if (player->pondering){
+        send_message("stop",engine);
+        read_response_pondering(engine,opponent,timeout,nullptr);
+    }
+    player->pondering = false;
+    player->early_bestmove.clear();
+    if (!hit){
+        std::string limits = search_limits(board,player->depth,side);
+        //Clocked searches depend on the time left, they are never cached
+        bool cached = board->cache && !clock.enabled;
+        uint32_t limits_hash = cached ? EvalCache::limits_hash(engine->path+engine->options,limits) : 0;
+        uint16_t cached_move;
+        SearchInfo cached_info;
+        uint64_t cache_key = cached ? board->cache_key() : 0;
+        if (cached && board->cache->probe(cache_key,limits_hash,&cached_move,&cached_info)){
+            char text[6] = {0};
+            unpack_uci_move(cached_move,text);
+            move = std::string("bestmove ")+text;
+            player->trace.push(cached_info);
+        }
+        else{
+            send_message(board->position_command,engine);
+            send_message("go "+limits,engine);
+            move = read_response_pondering(engine,opponent,timeout,&player->trace);
+            if (cached && starts_with(move,"bestmove") && player->trace.last()){
+                uint16_t bestmove = pack_uci_move(bestmove_token(move));
+                if (bestmove){
+                    board->cache->store(cache_key,limits_hash,bestmove,*player->trace.last());
+                }
+            }
+        }
+    }
+    int64_t used = clock.elapsed();
+    if (!clock.stop()){
+        if (move.empty()){
+            //Still thinking: stop it so it is ready for the next game
+            send_message("stop",engine);
+            read_response(engine,1000);
+        }
+        return "";
+    }
+    player->stats->moves++;
+    player->stats->think_time += used;
+    const SearchInfo* info = player->trace.last();
+    if (info){
+        player->stats->add_info(*info);
+    }
+    MoveRecord record;
+    record.ply = board->move_history.size()+1;
+    record.side = side;
+    record.move = pack_uci_move(bestmove_token(move));
+    record.time = used;
+    record.root_pieces = popcount(board->position.occupied);
+    record.has_info = info!=nullptr;
+    if (info){
+        record.info = *info;
+    }
+    board->move_records.push_back(record);
+    return move;
+}
+
+//Lets the engine think on the opponent's time about the move it expects
+void start_pondering(Board* board, Player* player, std::string bestmove){
+    size_t at = bestmove.find(" ponder ");
+    if (!board->ponder || at==std::string::npos){
+        return;
+    }
+    std::string expected = bestmove.substr(at+8);
+    expected = expected.substr(0,expected.find(' '));
+    if (!board->move_check(expected)){
+        return;
+    }
+    int side = board->position.side^1;
+    send_message(board->position_command+" "+expected,player->engine);
+    send_message("go ponder "+search_limits(board,player->depth,side),player->engine);
+    player->pondering = true;
+    player->ponder_move = expected;
+    player->trace.clear();
+}
+
+//Ends a ponder search that is still running when the game is over
+void stop_pondering(Player* player){
+    if (player->pondering){
+        if (player->early_bestmove.empty()){
+            send_message("stop",player->engine);
+            read_response(player->engine,1000);
+        }
+        player->pondering = false;
+        player->early_bestmove.clear();
+    }
+}
+
+void HumanVSEngine(Board* board){
+    if (!open_eval_cache(board)){
+        return;
+    }
+    Engine* engine = start_engine(board->engine1_path);
+        if (!engine){
+            std::cout<<"ERROR: cant start chess engine";
+            close_eval_cache(board);
+            return;
+        }
+        setup_engine(board,engine,0);
+        board->set_position(board->fen,stdout);
+        board->clock.reset();
+        new_game(engine);
+        Player player = {engine,board->engine1_depth,"Engine 1",&board->engine_stats[0]};
+        if (board->player_side==board->engine1_side){
+            board->player_side='w';
+            board->engine1_side='b';
+        }
+        while (true){
+            board->print_board();
+            board->clock.print();
+            std::string reason;
+            std::string result = board->game_result(&reason);
+            if (!result.empty()){
+                std::cout<<"Game over: "<<result<<" ("<<reason<<")\n";
+                break;
+            }
+            if (board->player_side == board->side){
+                std::cout << "Enter your move in algebraic notation (or 'quit' to exit): ";
+                std::string input;
+                board->clock.start(board->position.side);
+                std::cin>>input;
+                if (!board->clock.stop()){
+                    result = board->time_forfeit(&reason);
+                    std::cout<<"Game over: "<<result<<" ("<<reason<<")\n";
+                    break;
+                }
+                if (input=="quit"){
+                    break;
+                }
+                board->do_move(input);
+            }
+            else if (board->engine1_side == board->side){
+                std::string move = engine_move(board,&player);
+                if (board->clock.flagged>=0){
+                    result = board->time_forfeit(&reason);
+                    std::cout<<"Game over: "<<result<<" ("<<reason<<")\n";
+                    break;
+                }
+                if (move == "bestmove (none)" || move.empty()){
+                    std::cout<<"Engine 1 has no legal moves. Game over.\n";
+                    break;
+                }                
+                std::cout<<"Engine 1 plays: "+move+"\n";
+                if (!board->do_move(bestmove_token(move))){
+                    std::cout<<"Engine 1 played an illegal move. Game over.\n";
+                    break;
+                }
+                std::cout << board->get_uci_line() << "\n";
+            }
+        }
+    stop_engine(engine);
+    close_eval_cache(board);
+}
+
+//Gets the log file of a game: "log.json" becomes "log-3.json" for game 3 of a match
+std::string game_file_name(std::string path, Board* board){
+    if (board->games<=1){
+        return path;
+    }
+    size_t dot = path.rfind('.');
+    size_t slash = path.rfind('/');
+    if (dot==std::string::npos || (slash!=std::string::npos && dot<slash)){
+        dot = path.size();
+    }
+    return path.substr(0,dot)+"-"+std::to_string(board->game_number+1)+path.substr(dot);
+}
+
+//Writes the search info of every engine move of the game, as JSON or CSV by file extension
+void write_info_log(Board* board, std::string result){
+    std::string path = game_file_name(board->info_log,board);
+    FILE* file = fopen(path.c_str(),"w");
+    if (!file){
+        std::cout<<"ERROR: cant write "<<path<<"\n";
+        return;
+    }
+    bool csv = path.size()>=4 && path.compare(path.size()-4,4,".csv")==0;
+    if (csv){
+        fprintf(file,"ply,side,move,time_us,depth,seldepth,score,mate,nodes,nps,hashfull,tbhits,pv\n");
+    }
+    else{
+        fprintf(file,"{\"game\":%d,\"result\":\"%s\",\"start\":\"%s\",\"moves\":[",
+        board->game_number+1,result.c_str(),board->fen.c_str());
+    }
+    for (size_t i=0;i<board->move_records.size();i++){
+        const MoveRecord& record = board->move_records[i];
+        const SearchInfo& info = record.info;
+        char move[6] = {0};
+        unpack_uci_move(record.move,move);
+        char pv[16*6+1] = {0};
+        int length = 0;
+        for (int j=0;record.has_info && j<info.pv_length;j++){
+            length += unpack_uci_move(info.pv[j],pv+length);
+            pv[length++] = ' ';
+        }
+        pv[length ? length-1 : 0] = 0;
+        if (csv){
+            fprintf(file,"%d,%c,%s,%lld,%d,%d,%d,%d,%llu,%llu,%d,%llu,%s\n",
+            record.ply,record.side==WHITE ? 'w' : 'b',move,(long long)record.time,info.depth,info.seldepth,
+            info.score,int(info.mate),(unsigned long long)info.nodes,(unsigned long long)info.nps,
+            info.hashfull,(unsigned long long)info.tbhits,pv);
+        }
+        else{
+            fprintf(file,"%s{\"ply\":%d,\"side\":\"%c\",\"move\":\"%s\",\"time_us\":%lld",
+            i ? "," : "",record.ply,record.side==WHITE ? 'w' : 'b',move,(long long)record.time);
+            if (record.has_info){
+                fprintf(file,",\"depth\":%d,\"seldepth\":%d,\"score\":%d,\"mate\":%s,\"nodes\":%llu,"
+                "\"nps\":%llu,\"hashfull\":%d,\"tbhits\":%llu,\"pv\":\"%s\"",
+                info.depth,info.seldepth,info.score,info.mate ? "true" : "false",(unsigned long long)info.nodes,
+                (unsigned long long)info.nps,info.hashfull,(unsigned long long)info.tbhits,pv);
+            }
+            fprintf(file,"}");
+        }
+    }
+    if (!csv){
+        fprintf(file,"]}\n");
+    }
+    fclose(file);
+}
+
+//Copies the state of the current game to its live slot for the match server
+void publish_live(Board* board){
+    char fen[Position::FEN_SIZE];
+    size_t length = board->position.write_fen(fen);
+    std::lock_guard<std::mutex> lock(board->live->mutex);
+    LiveGame& live = *board->live;
+    live.game = board->game_number;
+    live.engine1_side = board->engine1_side;
+    live.fen.assign(fen,length);
+    live.ply = board->move_history.size();
+    live.last_move = live.ply ? board->move_history.back() : "";
+    live.remaining[0] = board->clock.enabled ? board->clock.remaining[0] : 0;
+    live.remaining[1] = board->clock.enabled ? board->clock.remaining[1] : 0;
+    live.has_info = !board->move_records.empty() && board->move_records.back().has_info;
+    if (live.has_info){
+        live.info = board->move_records.back().info;
+    }
+}
+
+//Plays one engine-vs-engine game on the given board and returns the result
+//("1-0", "0-1" or "1/2-1/2", "*" if the match was aborted). Board printing is only
+//done when verbose is set, otherwise the moves and the end of the game go to the logger.
+std::string play_engine_game(Board* board, Engine* engine1, Engine* engine2, bool verbose){
+    int game = board->game_number;
+    board->engine_stats[0] = EngineStats();
+    board->engine_stats[1] = EngineStats();
+    Player players[2] = {{engine1,board->engine1_depth,"Engine 1",&board->engine_stats[0]},
+    {engine2,board->engine2_depth,"Engine 2",&board->engine_stats[1]}};
+    std::string result;
+    std::string reason;
+    while (true){
+        auto ply_start = std::chrono::steady_clock::now();
+        if (verbose){
+            board->print_board();
+        }
+        if (board->live){
+            publish_live(board);
+        }
+        if (board->control && board->control->aborted){
+            result = "*";
+            reason = "match aborted";
+            logger.log(LOG_INFO,game,"Game aborted");
+            break;
+        }
+        result = board->game_result(&reason);
+        if (result.empty()){
+            result = board->adjudicate(&reason);
+        }
+        if (!result.empty()){
+            if (verbose){
+                std::cout<<"Game over: "<<result<<" ("<<reason<<")\n";
+            }
+            else{
+                logger.log(LOG_INFO,game,"Game over: %s (%s)",result.c_str(),reason.c_str());
+            }
+            break;
+        }
+        bool first = board->side==board->engine1_side;
+        Player* player = &players[first ? 0 : 1];
+        Player* opponent = &players[first ? 1 : 0];
+        std::string move = engine_move(board,player,opponent);
+        if (board->clock.flagged>=0){
+            result = board->time_forfeit(&reason);
+            if (verbose){
+                std::cout<<player->name<<" ran out of time. Game over: "<<result<<"\n";
+            }
+            else{
+                logger.log(LOG_INFO,game,"%s ran out of time. Game over: %s",player->name.c_str(),result.c_str());
+            }
+            break;
+        }
+        if (!starts_with(move,"bestmove") || move == "bestmove (none)"){
+            //The game isn't over, so the engine gave up or died: it loses
+            if (verbose){
+                std::cout<<player->name<<" has no legal moves. Game over.\n";
+            }
+            else{
+                logger.log(LOG_WARN,game,"%s gave no move (%s). Game over.",player->name.c_str(),
+                move.empty() ? "no response" : move.c_str());
+            }
+            result = board->side=='w' ? "0-1" : "1-0";
+            reason = player->name+" gave no move";
+            break;
+        }
+        if (verbose){
+            std::cout<<player->name<<" plays: "+move+"\n";
+        }
+        else{
+            logger.log(LOG_DEBUG,game,"%s plays: %s",player->name.c_str(),move.c_str());
+        }
+        if (!board->do_move(bestmove_token(move))){
+            if (verbose){
+                std::cout<<player->name<<" played an illegal move. Game over.\n";
+            }
+            else{
+                logger.log(LOG_WARN,game,"%s played an illegal move (%s). Game over.",player->name.c_str(),move.c_str());
+            }
+            result = board->side=='w' ? "0-1" : "1-0";
+            reason = player->name+" played an illegal move";
+            break;
+        }
+        start_pondering(board,player,move);
+        if (verbose){
+            std::cout << board->get_uci_line() << "\n";
+        }
+        else if (logger.enabled(LOG_DEBUG)){
+            char fen[Position::FEN_SIZE];
+            board->position.write_fen(fen);
+            logger.log(LOG_DEBUG,game,"%s",fen);
+        }
+        if (board->ply_times){
+            board->ply_times->push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now()-ply_start).count());
+        }
+    }
+    stop_pondering(&players[0]);
+    stop_pondering(&players[1]);
+    board->termination = reason;
+    if (!board->info_log.empty()){
+        write_info_log(board,result);
+    }
+    if (verbose){
+        board->engine_stats[0].print("Engine 1");
+        board->engine_stats[1].print("Engine 2");
+    }
+    return result;
+}
+
+void EngineVSEngine(Board* board){
+    CoreScheduler scheduler;
+    if (!plan_cores(board,1,&scheduler)){
+        return;
+    }
+    EnginePool pool(board);
+    Engine* engine1 = pool.acquire(0);
+    if (!engine1){
+        std::cout<<"ERROR: cant start chess engine";
+        return;
+    }
+    Engine* engine2 = pool.acquire(1);
+    if (!engine2){
+        std::cout<<"ERROR: cant start chess engine";
+        pool.release(0,engine1);
+        return;
+    }
+    if (board->pin){
+        scheduler.pin(engine1,0);
+        scheduler.pin(engine2,0);
+    }
+    if (!board->set_position(board->fen,board->headless ? nullptr : stdout)){
+        pool.release(0,engine1);
+        pool.release(1,engine2);
+        return;
+    }
+    if (!board->openings.empty()){
+        OpeningBook book;
+        Opening opening;
+        if (!book.open(board->openings,board->random_openings,board->seed,board->opening_plies) ||
+        !book.get(0,&opening) || !board->set_opening(opening)){
+            std::cout<<"ERROR: cant read an opening from "<<board->openings<<"\n";
+            pool.release(0,engine1);
+            pool.release(1,engine2);
+            return;
+        }
+    }
+    if (!open_eval_cache(board)){
+        pool.release(0,engine1);
+        pool.release(1,engine2);
+        return;
+    }
+    board->clock.reset();
+    std::string result = play_engine_game(board,engine1,engine2,!board->headless);
+    logger.flush();
+    std::cout<<"Result: "<<result<<"\n";
+    GameArchive archive;
+    if (!board->archive.empty()){
+        if (archive.open(board->archive)){
+            archive_game(&archive,board,result);
+        }
+        else{
+            std::cout<<"ERROR: cant open "<<board->archive<<"\n";
+        }
+    }
+    pool.release(0,engine1);
+    pool.release(1,engine2);
+    close_eval_cache(board);
+}
+
+//======= Match mode =======//
+/*A match is a series of engine-vs-engine games played by several
+worker threads at once. Every game has its own copy of the board and
+its own engine processes taken from the pool, only the pool and the
+score table are shared.*/
+
+class ScoreTable{
+    public:
+    std::mutex mutex; //Guards everything below
+    int engine1_wins=0; //Games won by engine 1
+    int engine1_losses=0; //Games lost by engine 1
+    int draws=0; //Drawn games
+    int games_played=0; //Finished games
+    int restored_games=0; //Finished games read back from a journal
+    int pairs[5]={0}; //Finished pairs by engine 1 half points: 0 (LL), 1 (LD), 2 (WL/DD), 3 (WD), 4 (WW)
+    std::vector<int8_t> first_game; //Half points of the first finished game of every pair, -1 if none yet
+    EngineStats engine_stats[2]; //Move statistics of engine 1 and engine 2 over all games
+    SprtBounds sprt; //Bounds of the test, if enabled
+    std::atomic<bool> stopped{false}; //The test is decided, no more games should start
+
+    //Adds a finished game to the table, restored games (from a journal) aren't logged again
+    void add_result(int game, std::string result, char engine1_side, const EngineStats* stats, bool restored=false){
+        std::lock_guard<std::mutex> lock(mutex);
+        engine_stats[0].add(stats[0]);
+        engine_stats[1].add(stats[1]);
+        int half_points = 1;
+        if (result=="1/2-1/2"){
+            draws++;
+        }
+        else if ((result=="1-0")==(engine1_side=='w')){
+            engine1_wins++;
+            half_points = 2;
+        }
+        else{
+            engine1_losses++;
+            half_points = 0;
+        }
+        games_played++;
+        if (restored){
+            restored_games++;
+        }
+        //Both games of a pair start from the same opening, so together they cancel out its bias
+        size_t pair = size_t(game/2);
+        if (first_game.size()<=pair){
+            first_game.resize(pair+1,-1);
+        }
+        if (first_game[pair]<0){
+            first_game[pair] = int8_t(half_points);
+        }
+        else{
+            pairs[first_game[pair]+half_points]++;
+        }
+        char llr_text[64] = "";
+        bool decided = false;
+        double llr = 0;
+        if (sprt.enabled){
+            llr = log_likelihood_ratio();
+            snprintf(llr_text,sizeof(llr_text),", LLR %g (%g, %g)",llr,sprt.lower(),sprt.upper());
+            decided = !stopped && (llr<=sprt.lower() || llr>=sprt.upper());
+        }
+        if (!restored){
+            logger.log(LOG_INFO,-1,"Game %d finished: %s (engine 1 played %s), score %d - %d - %d%s",game+1,
+            result.c_str(),engine1_side=='w' ? "white" : "black",engine1_wins,engine1_losses,draws,llr_text);
+        }
+        if (decided){
+            stopped = true;
+            logger.log(LOG_INFO,-1,"SPRT: %s accepted, stopping the match",llr>=sprt.upper() ? "H1" : "H0");
+        }
+    }
+
+    //Mean score of engine 1 per sample, the variance of one sample and the number of samples.
+    //Finished pairs are the samples once there are any, otherwise single games.
+    void score_stats(double* mean, double* variance, int* samples){
+        int pair_count = pairs[0]+pairs[1]+pairs[2]+pairs[3]+pairs[4];
+        double sum = 0;
+        double squares = 0;
+        if (pair_count>0){
+            for (int i=0;i<5;i++){
+                sum += pairs[i]*(i/4.0);
+                squares += pairs[i]*(i/4.0)*(i/4.0);
+            }
+            *samples = pair_count;
+        }
+        else{
+            sum = engine1_wins + draws*0.5;
+            squares = engine1_wins + draws*0.25;
+            *samples = games_played;
+        }
+        *mean = *samples ? sum / *samples : 0.5;
+        *variance = *samples ? squares / *samples - *mean * *mean : 0;
+    }
+
+    //Log-likelihood ratio of H1 against H0, with the normal approximation of the score
+    double log_likelihood_ratio(){
+        double mean, variance;
+        int samples;
+        score_stats(&mean,&variance,&samples);
+        if (variance<=0){
+            return 0;
+        }
+        double score0 = elo_to_score(sprt.elo0);
+        double score1 = elo_to_score(sprt.elo1);
+        return samples*(score1-score0)*(2*mean-score0-score1)/(2*variance);
+    }
+
+    //Prints the final score of engine 1
+    void print(double seconds){
+        std::lock_guard<std::mutex> lock(mutex);
+        double points = engine1_wins + draws*0.5;
+        std::cout<<"Score of engine 1 vs engine 2: "<<engine1_wins<<" - "<<engine1_losses<<" - "<<draws;
+        if (games_played>0){
+            std::cout<<" ["<<points/games_played<<"]";
+        }
+        std::cout<<" "<<games_played<<" games";
+        if (restored_games>0){
+            std::cout<<" ("<<restored_games<<" from the journal)";
+        }
+        std::cout<<" in "<<seconds<<" s ("<<(games_played-restored_games)/seconds<<" games/s)\n";
+        double mean, variance;
+        int samples;
+        score_stats(&mean,&variance,&samples);
+        if (samples>0){
+            //95% confidence interval of the score, turned into Elo
+            double margin = 1.959964*sqrt(variance/samples);
+            double elo = score_to_elo(mean);
+            std::cout<<"Elo difference: "<<elo<<" +/- "<<
+            (score_to_elo(std::min(mean+margin,1.0))-score_to_elo(std::max(mean-margin,0.0)))/2<<
+            " (95%), pentanomial [LL LD WL/DD WD WW]: ["<<pairs[0]<<" "<<pairs[1]<<" "<<pairs[2]<<" "<<
+            pairs[3]<<" "<<pairs[4]<<"]\n";
+        }
+        if (sprt.enabled){
+            double llr = log_likelihood_ratio();
+            std::cout<<"SPRT: elo0 "<<sprt.elo0<<", elo1 "<<sprt.elo1<<", alpha "<<sprt.alpha<<", beta "<<sprt.beta<<
+            ", LLR "<<llr<<" ("<<sprt.lower()<<", "<<sprt.upper()<<") - "<<
+            (llr>=sprt.upper() ? "H1 accepted" : llr<=sprt.lower() ? "H0 accepted" : "inconclusive")<<"\n";
+        }
+        engine_stats[0].print("Engine 1");
+        engine_stats[1].print("Engine 2");
+    }
+};
+
+/*======= Match server =======*/
+/*A small HTTP server on localhost to watch and steer a match. It runs
+on its own thread with non-blocking sockets and poll(), the game loops
+only fill their live slots. A few times a second the slots are turned
+into one JSON snapshot; its WebSocket frame is built once and shared by
+all viewers, and a slow viewer only keeps the newest frame it hasn't
+started to receive.
+GET /          page that shows the running games
+GET /state     the snapshot as JSON
+GET /ws        WebSocket that sends every new snapshot and takes commands
+POST /pause, /resume, /abort, /add?games=N   the commands over plain HTTP*/
+
+//SHA-1 of a short message, only used for the WebSocket handshake
+std::string sha1(const std::string& message){
+    uint32_t h[5] = {0x67452301,0xEFCDAB89,0x98BADCFE,0x10325476,0xC3D2E1F0};
+    std::string data = message;
+    data += char(0x80);
+    while (data.size()%64!=56){
+        data += char(0);
+    }
+    uint64_t bits = uint64_t(message.size())*8;
+    for (int i=7;i>=0;i--){
+        data += char(bits>>(8*i));
+    }
+    auto rotate = [](uint32_t value, int count){return (value<<count)|(value>>(32-count));};
+    for (size_t chunk=0;chunk<data.size();chunk+=64){
+        uint32_t w[80];
+        for (int i=0;i<16;i++){
+            w[i] = uint32_t(uint8_t(data[chunk+4*i]))<<24 | uint32_t(uint8_t(data[chunk+4*i+1]))<<16 |
+            uint32_t(uint8_t(data[chunk+4*i+2]))<<8 | uint32_t(uint8_t(data[chunk+4*i+3]));
+        }
+        for (int i=16;i<80;i++){
+            w[i] = rotate(w[i-3]^w[i-8]^w[i-14]^w[i-16],1);
+        }
+        uint32_t a=h[0], b=h[1], c=h[2], d=h[3], e=h[4];
+        for (int i=0;i<80;i++){
+            uint32_t f, k;
+            if (i<20){
+                f = (b&c)|(~b&d);
+                k = 0x5A827999;
+            }
+            else if (i<40){
+                f = b^c^d;
+                k = 0x6ED9EBA1;
+            }
+            else if (i<60){
+                f = (b&c)|(b&d)|(c&d);
+                k = 0x8F1BBCDC;
+            }
+            else{
+                f = b^c^d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t temp = rotate(a,5)+f+e+k+w[i];
+            e = d;
+            d = c;
+            c = rotate(b,30);
+            b = a;
+            a = temp;
+        }
+        h[0]+=a; h[1]+=b; h[2]+=c; h[3]+=d; h[4]+=e;
+    }
+    std::string digest;
+    for (uint32_t value : h){
+        for (int i=3;i>=0;i--){
+            digest += char(value>>(8*i));
+        }
+    }
+    return digest;
+}
+
+std::string base64(const std::string& data){
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string text;
+    for (size_t i=0;i<data.size();i+=3){
+        uint32_t value = uint32_t(uint8_t(data[i]))<<16;
+        if (i+1<data.size()){
+            value |= uint32_t(uint8_t(data[i+1]))<<8;
+        }
+        if (i+2<data.size()){
+            value |= uint8_t(data[i+2]);
+        }
+        text += table[value>>18&63];
+        text += table[value>>12&63];
+        text += i+1<data.size() ? table[value>>6&63] : '=';
+        text += i+2<data.size() ? table[value&63] : '=';
+    }
+    return text;
+}
+
+//Server side WebSocket frame (never masked) with the given opcode
+std::string websocket_frame(int opcode, const std::string& payload){
+    std::string frame(1,char(0x80|opcode));
+    if (payload.size()<126){
+        frame += char(payload.size());
+    }
+    else if (payload.size()<65536){
+        frame += char(126);
+        frame += char(payload.size()>>8);
+        frame += char(payload.size());
+    }
+    else{
+        frame += char(127);
+        for (int i=7;i>=0;i--){
+            frame += char(uint64_t(payload.size())>>(8*i));
+        }
+    }
+    return frame+payload;
+}
+
+const char* SERVER_PAGE = R"PAGE(<!DOCTYPE html>
+<html><head><meta charset="utf-8"><title>Match</title>
+<style>body{font-family:monospace}pre{border:1px solid #ccc;padding:4px}</style></head>
+<body><div id="score"></div>
+<button onclick="ws.send('pause')">Pause</button> <button onclick="ws.send('resume')">Resume</button>
+<button onclick="ws.send('abort')">Abort</button> <button onclick="ws.send('add 2')">Add 2 games</button>
+<div id="games"></div>
+<script>
+const ws = new WebSocket("ws://"+location.host+"/ws");
+ws.onmessage = (event) => {
+  const state = JSON.parse(event.data);
+  document.getElementById("score").textContent = "Games "+state.played+"/"+state.games+
+    ", engine 1: +"+state.score[0]+" -"+state.score[1]+" ="+state.score[2]+
+    (state.paused ? " [paused]" : "")+(state.aborted ? " [aborted]" : "")+(state.stopped ? " [SPRT decided]" : "");
+  document.getElementById("games").innerHTML = state.running.map(g =>
+    "<pre>Game "+(g.game+1)+" (engine 1 "+g.engine1+") ply "+g.ply+" "+g.move+"\n"+g.fen+
+    "\nwhite "+g.wtime+" ms, black "+g.btime+" ms"+
+    (g.depth!==undefined ? "\ndepth "+g.depth+" score "+g.score+(g.mate ? " (mate)" : "")+" nodes "+g.nodes : "")+
+    "</pre>").join("");
+};
+</script></body></html>
+)PAGE";
+
+class MatchServer{
+    public:
+    ScoreTable* table=nullptr;
+    MatchControl* control=nullptr;
+    std::vector<LiveGame>* slots=nullptr; //One slot per worker
+
+    ~MatchServer(){
+        stop();
+    }
+
+    //Listens on 127.0.0.1:port and starts the server thread
+    bool start(int port, ScoreTable* score_table, MatchControl* match_control, std::vector<LiveGame>* live_games){
+        table = score_table;
+        control = match_control;
+        slots = live_games;
+        listen_port = port;
+        listen_fd = socket(AF_INET,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+        if (listen_fd<0){
+            return false;
+        }
+        int yes = 1;
+        setsockopt(listen_fd,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(yes));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(uint16_t(port));
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listen_fd,(sockaddr*)&address,sizeof(address))!=0 || listen(listen_fd,16)!=0){
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+        running = true;
+        thread = std::thread(&MatchServer::loop,this);
+        return true;
+    }
+
+    void stop(){
+        if (!running){
+            return;
+        }
+        running = false;
+        thread.join();
+        for (Client& client : clients){
+            close(client.fd);
+        }
+        clients.clear();
+        close(listen_fd);
+        listen_fd = -1;
+    }
+
+    private:
+    struct Client{
+        int fd;
+        std::string input; //Bytes received and not handled yet
+        std::deque<std::shared_ptr<const std::string>> output; //Queued responses and frames
+        size_t sent=0; //Bytes of output.front() already sent
+        bool websocket=false; //Upgraded, gets every snapshot
+        bool closing=false; //Close once the output is sent
+    };
+
+    int listen_fd=-1;
+    int listen_port=0;
+    std::atomic<bool> running{false};
+    std::thread thread;
+    std::vector<Client> clients;
+    std::string state; //Last snapshot
+    std::shared_ptr<const std::string> state_frame; //The same snapshot as a WebSocket frame
+
+    //Builds the JSON snapshot of the match and of all running games
+    std::string snapshot(){
+        std::string json;
+        char text[512];
+        {
+            std::lock_guard<std::mutex> lock(table->mutex);
+            snprintf(text,sizeof(text),"{\"games\":%d,\"played\":%d,\"score\":[%d,%d,%d],\"paused\":%s,"
+            "\"aborted\":%s,\"stopped\":%s",control->games.load(),table->games_played,table->engine1_wins,
+            table->engine1_losses,table->draws,control->paused ? "true" : "false",control->aborted ? "true" : "false",
+            table->stopped ? "true" : "false");
+            json += text;
+            if (table->sprt.enabled){
+                snprintf(text,sizeof(text),",\"llr\":%g,\"llr_bounds\":[%g,%g]",table->log_likelihood_ratio(),
+                table->sprt.lower(),table->sprt.upper());
+                json += text;
+            }
+        }
+        json += ",\"running\":[";
+        bool first = true;
+        for (LiveGame& slot : *slots){
+            std::lock_guard<std::mutex> lock(slot.mutex);
+            if (slot.game<0){
+                continue;
+            }
+            snprintf(text,sizeof(text),"%s{\"game\":%d,\"engine1\":\"%s\",\"ply\":%d,\"move\":\"%s\",\"fen\":\"%s\","
+            "\"wtime\":%lld,\"btime\":%lld",first ? "" : ",",slot.game,slot.engine1_side=='w' ? "white" : "black",
+            slot.ply,slot.last_move.c_str(),slot.fen.c_str(),(long long)(slot.remaining[0]/1000),
+            (long long)(slot.remaining[1]/1000));
+            json += text;
+            if (slot.has_info){
+                snprintf(text,sizeof(text),",\"depth\":%d,\"score\":%d,\"mate\":%s,\"nodes\":%llu",slot.info.depth,
+                slot.info.score,slot.info.mate ? "true" : "false",(unsigned long long)slot.info.nodes);
+                json += text;
+            }
+            json += "}";
+            first = false;
+        }
+        json += "]}";
+        return json;
+    }
+
+    //Runs a command from a viewer: pause, resume, abort or add N
+    bool command(std::string_view text){
+        std::string_view name = next_token(text);
+        if (name=="pause"){
+            control->pause();
+        }
+        else if (name=="resume"){
+            control->resume();
+        }
+        else if (name=="abort"){
+            control->abort();
+        }
+        else if (name=="add"){
+            int count = 0;
+            if (!parse_number(next_token(text),count) || count<=0){
+                return false;
+            }
+            control->add(count);
+        }
+        else{
+            return false;
+        }
+        logger.log(LOG_INFO,-1,"Match server: %.*s",int(name.size()),name.data());
+        return true;
+    }
+
+    void send(Client& client, std::string data){
+        client.output.push_back(std::make_shared<const std::string>(std::move(data)));
+    }
+
+    void respond(Client& client, const char* status, const char* type, const std::string& body){
+        send(client,std::string("HTTP/1.1 ")+status+"\r\nContent-Type: "+type+"\r\nContent-Length: "+
+        std::to_string(body.size())+"\r\nConnection: close\r\n\r\n"+body);
+        client.closing = true;
+    }
+
+    //Value of a header in a request head, names are case insensitive
+    static std::string_view header(std::string_view head, std::string_view name){
+        size_t line_start = head.find("\r\n");
+        while (line_start!=std::string_view::npos){
+            line_start += 2;
+            size_t line_end = head.find("\r\n",line_start);
+            std::string_view line = head.substr(line_start,line_end==std::string_view::npos ? line_end : line_end-line_start);
+            if (line.size()>name.size() && line[name.size()]==':' && std::equal(name.begin(),name.end(),line.begin(),
+            [](char a, char b){ return tolower((unsigned char)a)==tolower((unsigned char)b); })){
+                std::string_view value = line.substr(name.size()+1);
+                return next_token(value);
+            }
+            line_start = line_end;
+        }
+        return {};
+    }
+
+    //A browser sends the page's origin and the host it connected to. Pages from other sites, or from a
+    //name that was made to resolve to 127.0.0.1, must not control the match.
+    bool own_host(std::string_view host){
+        std::string port = ":"+std::to_string(listen_port);
+        return host=="127.0.0.1"+port || host=="localhost"+port;
+    }
+
+    //Handles a complete HTTP request head
+    void handle_request(Client& client, const std::string& head){
+        std::string_view rest = head;
+        std::string_view method = next_token(rest);
+        std::string_view target = next_token(rest);
+        std::string_view path = target.substr(0,target.find('?'));
+        std::string_view query = target.size()>path.size() ? target.substr(path.size()+1) : std::string_view();
+        std::string_view origin = header(head,"Origin");
+        if (!own_host(header(head,"Host")) || (!origin.empty() && (!starts_with(origin,"http://") ||
+        !own_host(origin.substr(7))))){
+            respond(client,"403 Forbidden","text/plain","Forbidden\n");
+            return;
+        }
+        if (method=="GET" && path=="/ws"){
+            //The key is echoed back hashed with the protocol's fixed GUID
+            std::string key(header(head,"Sec-WebSocket-Key"));
+            if (key.empty()){
+                respond(client,"400 Bad Request","text/plain","WebSocket key missing\n");
+                return;
+            }
+            send(client,"HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: "+base64(sha1(key+"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"))+"\r\n\r\n");
+            client.websocket = true;
+            if (state_frame){
+                client.output.push_back(state_frame);
+            }
+        }
+        else if (method=="GET" && path=="/"){
+            respond(client,"200 OK","text/html",SERVER_PAGE);
+        }
+        else if (method=="GET" && path=="/state"){
+            respond(client,"200 OK","application/json",state.empty() ? snapshot() : state);
+        }
+        else if (method=="POST" && (path=="/pause" || path=="/resume" || path=="/abort" || path=="/add")){
+            //A custom header can't be sent cross site without a preflight, which is never answered
+            if (header(head,"X-Match-Control").empty()){
+                respond(client,"403 Forbidden","text/plain","X-Match-Control header missing\n");
+                return;
+            }
+            std::string text(path.substr(1));
+            if (path=="/add"){
+                text += " "+std::string(starts_with(query,"games=") ? query.substr(6) : "1");
+            }
+            if (command(text)){
+                respond(client,"200 OK","text/plain","OK\n");
+            }
+            else{
+                respond(client,"400 Bad Request","text/plain","ERROR: cant read "+text+"\n");
+            }
+        }
+        else{
+            respond(client,"404 Not Found","text/plain","Not found\n");
+        }
+    }
+
+    //Handles the complete WebSocket frames from a viewer, false on a broken frame
+    bool handle_frames(Client& client){
+        while (client.input.size()>=2){
+            const uint8_t* data = (const uint8_t*)client.input.data();
+            int opcode = data[0]&15;
+            bool masked = data[1]&128;
+            uint64_t length = data[1]&127;
+            size_t offset = 2;
+            if (length==126){
+                if (client.input.size()<4){
+                    return true;
+                }
+                length = uint64_t(data[2])<<8 | data[3];
+                offset = 4;
+            }
+            else if (length==127){
+                return false; //Commands are short
+            }
+            if (!masked || length>4096){
+                return false;
+            }
+            if (client.input.size()<offset+4+length){
+                return true;
+            }
+            const uint8_t* mask = data+offset;
+            std::string payload(length,'\0');
+            for (size_t i=0;i<length;i++){
+                payload[i] = char(data[offset+4+i]^mask[i%4]);
+            }
+            client.input.erase(0,offset+4+length);
+            if (opcode==1){
+                command(payload);
+            }
+            else if (opcode==8){
+                send(client,websocket_frame(8,""));
+                client.closing = true;
+                return true;
+            }
+            else if (opcode==9){
+                send(client,websocket_frame(10,payload));
+            }
+        }
+        return true;
+    }
+
+    //Reads what a client sent, false when the connection is gone
+    bool receive(Client& client){
+        char buffer[4096];
+        ssize_t count;
+        while ((count = recv(client.fd,buffer,sizeof(buffer),0))>0){
+            client.input.append(buffer,count);
+        }
+        if (count==0 || (count<0 && errno!=EAGAIN && errno!=EWOULDBLOCK)){
+            return false;
+        }
+        if (client.websocket){
+            return handle_frames(client);
+        }
+        size_t end = client.input.find("\r\n\r\n");
+        if (end!=std::string::npos){
+            std::string head = client.input.substr(0,end);
+            client.input.erase(0,end+4);
+            handle_request(client,head);
+        }
+        return client.input.size()<65536;
+    }
+
+    //Sends as much queued output as the socket takes, false when the connection is done
+    bool transmit(Client& client){
+        while (!client.output.empty()){
+            const std::string& data = *client.output.front();
+            ssize_t count = ::send(client.fd,data.data()+client.sent,data.size()-client.sent,MSG_NOSIGNAL);
+            if (count<0){
+                return errno==EAGAIN || errno==EWOULDBLOCK;
+            }
+            client.sent += count;
+            if (client.sent<data.size()){
+                return true;
+            }
+            client.output.pop_front();
+            client.sent = 0;
+        }
+        return !client.closing;
+    }
+
+    //Sends a changed snapshot to all viewers
+    void broadcast(){
+        std::string json = snapshot();
+        if (json==state){
+            return;
+        }
+        state.swap(json);
+        std::shared_ptr<const std::string> previous = state_frame;
+        state_frame = std::make_shared<const std::string>(websocket_frame(1,state));
+        for (Client& client : clients){
+            if (!client.websocket || client.closing){
+                continue;
+            }
+            //The older snapshot is replaced by the new one if it didn't start going out
+            if (client.output.size()>(client.sent ? 1 : 0) && client.output.back()==previous){
+                client.output.pop_back();
+            }
+            client.output.push_back(state_frame);
+        }
+    }
+
+    void loop(){
+        auto last_snapshot = std::chrono::steady_clock::now();
+        std::vector<pollfd> fds;
+        while (running){
+            fds.assign(1,{listen_fd,POLLIN,0});
+            for (Client& client : clients){
+                fds.push_back({client.fd,short(POLLIN|(client.output.empty() ? 0 : POLLOUT)),0});
+            }
+            poll(fds.data(),fds.size(),50);
+            std::vector<bool> done(clients.size(),false);
+            for (size_t i=0;i<clients.size();i++){
+                short events = fds[i+1].revents;
+                if ((events&(POLLIN|POLLHUP|POLLERR)) && !receive(clients[i])){
+                    done[i] = true;
+                }
+            }
+            if (std::chrono::steady_clock::now()-last_snapshot>=std::chrono::milliseconds(100)){
+                broadcast();
+                last_snapshot = std::chrono::steady_clock::now();
+            }
+            for (size_t i=0;i<clients.size();i++){
+                if (!done[i] && !transmit(clients[i])){
+                    done[i] = true;
+                }
+            }
+            for (size_t i=clients.size();i-->0;){
+                if (done[i]){
+                    close(clients[i].fd);
+                    clients.erase(clients.begin()+i);
+                }
+            }
+            if (fds[0].revents&POLLIN){
+                int fd;
+                while ((fd = accept4(listen_fd,nullptr,nullptr,SOCK_NONBLOCK|SOCK_CLOEXEC))>=0){
+                    clients.push_back(Client());
+                    clients.back().fd = fd;
+                }
+            }
+        }
+    }
+};
+
+//Worker loop: takes game numbers until the match is over. Engines come
+//from the pool for every game and go back to it afterwards.
+//Games publish their state to live if the match server runs, with --pin
+//the engines are pinned to the cores of the worker.
+void match_worker(Board* settings, EnginePool* pool, OpeningBook* book, GameArchive* archive, ScoreTable* table,
+MatchControl* control, LiveGame* live, int worker){
+    int game;
+    while (!table->stopped && control->take_game(&game)){
+        Engine* engine1 = pool->acquire(0);
+        Engine* engine2 = pool->acquire(1);
+        if (!engine1 || !engine2){
+            pool->release(0,engine1);
+            pool->release(1,engine2);
+            logger.log(LOG_ERROR,-1,"ERROR: cant start chess engine");
+            control->finish_game(false);
+            return;
+        }
+        if (settings->scheduler){
+            settings->scheduler->pin(engine1,worker);
+            settings->scheduler->pin(engine2,worker);
+        }
+        Board board = *settings;
+        board.game_number = game;
+        board.live = live;
+        Opening opening;
+        if (book && (!book->get(game,&opening) || !board.set_opening(opening))){
+            pool->release(0,engine1);
+            pool->release(1,engine2);
+            logger.log(LOG_ERROR,-1,"ERROR: cant read an opening from %s",settings->openings.c_str());
+            control->finish_game(false);
+            return;
+        }
+        if (book && settings->journal){
+            settings->journal->add_opening(game,opening);
+        }
+        //Engines swap colors every game
+        if (game%2==1){
+            std::swap(board.engine1_side,board.engine2_side);
+        }
+        std::string result = play_engine_game(&board,engine1,engine2,false);
+        pool->release(0,engine1);
+        pool->release(1,engine2);
+        if (live){
+            std::lock_guard<std::mutex> lock(live->mutex);
+            live->game = -1;
+        }
+        if (result!="*"){
+            if (archive){
+                archive_game(archive,&board,result);
+            }
+            table->add_result(game,result,board.engine1_side,board.engine_stats);
+            if (settings->journal){
+                settings->journal->add_game(game,result,board.engine1_side,board.engine_stats);
+            }
+        }
+        control->finish_game(table->stopped);
+    }
+}
+
+//Starts the journal of a match or reads it back for --resume, which
+//also brings back the seed. False if it can't be used.
+bool open_journal(Board* board, MatchJournal* journal){
+    if (board->journal_path.empty()){
+        return true;
+    }
+    if (!board->resume){
+        if (!journal->create(board->journal_path,board->seed,board->arguments,board->journal_sync)){
+            std::cout<<"ERROR: cant create journal "<<board->journal_path<<" (to continue a match add --resume)\n";
+            return false;
+        }
+        return true;
+    }
+    if (!journal->resume(board->journal_path,board->journal_sync)){
+        std::cout<<"ERROR: cant read journal "<<board->journal_path<<"\n";
+        return false;
+    }
+    if (journal->arguments!=board->arguments){
+        journal->close();
+        std::cout<<"ERROR: journal "<<board->journal_path<<" is from a match with other arguments\n";
+        return false;
+    }
+    board->seed = journal->seed;
+    std::cout<<"Resuming the match of "<<board->journal_path<<", "<<journal->games.size()<<" games played\n";
+    return true;
+}
+
+void Match(Board* board){
+    std::cout<<"Match of "<<board->games<<" games, "<<board->concurrency<<" at a time.\n";
+    if (!board->set_position(board->fen,board->headless ? nullptr : stdout)){
+        return;
+    }
+    MatchJournal journal;
+    if (!open_journal(board,&journal)){
+        return;
+    }
+    OpeningBook book;
+    if (!board->openings.empty()){
+        if (!book.open(board->openings,board->random_openings,board->seed,board->opening_plies)){
+            std::cout<<"ERROR: cant open "<<board->openings<<"\n";
+            return;
+        }
+        std::cout<<"Openings from "<<board->openings<<(board->random_openings ?
+        ", random order, seed "+std::to_string(board->seed) : ", file order")<<"\n";
+    }
+    GameArchive archive;
+    if (!board->archive.empty() && !archive.open(board->archive)){
+        std::cout<<"ERROR: cant open "<<board->archive<<"\n";
+        return;
+    }
+    if (!open_eval_cache(board)){
+        return;
+    }
+    ScoreTable table;
+    table.sprt = board->sprt;
+    //Games may be added through the server, so it gets all workers from the start
+    int worker_count = board->server_port ? board->concurrency : std::min(board->concurrency,board->games);
+    CoreScheduler scheduler;
+    if (!plan_cores(board,worker_count,&scheduler)){
+        close_eval_cache(board);
+        return;
+    }
+    board->scheduler = board->pin ? &scheduler : nullptr;
+    EnginePool pool(board);
+    MatchControl control;
+    control.games = board->games;
+    control.wait_for_games = board->server_port!=0;
+    //Games in the journal count as played, their openings are taken again for the games still to play
+    for (const MatchJournal::Game& game : journal.games){
+        if (control.finished.size()<=size_t(game.game)){
+            control.finished.resize(game.game+1,false);
+        }
+        if (!control.finished[game.game]){
+            control.finished[game.game] = true;
+            table.add_result(game.game,game.result,game.engine1_side,game.stats,true);
+        }
+    }
+    if (!board->openings.empty()){
+        book.restore(journal.openings,control.finished);
+    }
+    board->control = &control;
+    board->journal = board->journal_path.empty() ? nullptr : &journal;
+    std::vector<LiveGame> live(board->server_port ? worker_count : 0);
+    MatchServer server;
+    if (board->server_port){
+        if (!server.start(board->server_port,&table,&control,&live)){
+            std::cout<<"ERROR: cant listen on port "<<board->server_port<<"\n";
+            board->control = nullptr;
+            board->journal = nullptr;
+            board->scheduler = nullptr;
+            close_eval_cache(board);
+            return;
+        }
+        std::cout<<"Match server on http://127.0.0.1:"<<board->server_port<<"/\n";
+    }
+    auto start_time = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int i=0;i<worker_count;i++){
+        workers.emplace_back(match_worker,board,&pool,board->openings.empty() ? nullptr : &book,
+        board->archive.empty() ? nullptr : &archive,&table,&control,live.empty() ? nullptr : &live[i],i);
+    }
+    for (auto& worker : workers){
+        worker.join();
+    }
+    auto end_time = std::chrono::steady_clock::now();
+    server.stop();
+    logger.flush();
+    if (control.aborted){
+        std::cout<<"Match aborted, running games are not counted.\n";
+    }
+    table.print(std::chrono::duration<double>(end_time - start_time).count());
+    std::cout<<"Engines started: "<<pool.started<<", replaced after a crash: "<<pool.respawned<<"\n";
+    pool.shutdown();
+    if (board->journal){
+        board->journal = nullptr;
+        if (!journal.close()){
+            std::cout<<"ERROR: the journal "<<board->journal_path<<" is incomplete\n";
+        }
+        else{
+            std::cout<<"Journal: "<<journal.syncs<<" syncs\n";
+        }
+    }
+    board->control = nullptr;
+    board->scheduler = nullptr;
+    close_eval_cache(board);
+}
+
+//======= Argument parsing functions =======//
+bool parse_game_mode(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--game-mode" || arg == "-gm") && i+1<argc){
+            board->game_mode=argv[i+1];
+        }
+    }
+    return 0;
+}
+
+bool parse_engine1_path(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--engine1-path" || arg == "-ep1") && i+1<argc){
+            board->engine1_path=argv[i+1];
+        }
+    }
+    return 0;
+}
+
+bool parse_engine2_path(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--engine2-path" || arg == "-ep2") && i+1<argc){
+            board->engine2_path=argv[i+1];
+        }
+    }
+    return 0;
+}
+
+bool parse_engine1_depth(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--engine1-depth" || arg == "-ed1") && i+1<argc){
+            board->engine1_depth=std::stoi(argv[i+1]);
+            return 1;
+        }
+        else{
+            board->engine1_depth=1;
+        }
+
+    }
+    return 0;
+}
+
+bool parse_engine2_depth(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--engine2-depth" || arg == "-ed2") && i+1<argc){
+            board->engine2_depth=std::stoi(argv[i+1]);
+            return 1;
+        }
+        else{
+            board->engine2_depth=1;
+        }
+    }
+    return 0;
+}
+
+bool parse_sides(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--player-side" || arg=="-ps") && i+1<argc){
+            if (argv[i+1][0]=='w'){
+                board->player_side='w';
+                board->engine1_side='b';
+            }
+            else{
+                board->player_side='b';
+                board->engine1_side='w';
+            }
+            return 1;
+        }
+        else if((arg=="--engine1-side" || arg=="-es1") && i+1<argc){
+            if (argv[i+1][0]=='w'){
+                board->engine1_side='w';
+                board->engine2_side='b';
+            }
+            else{
+                board->engine1_side='b';
+                board->engine2_side='w';
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+bool parse_position(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg = argv[i];
+        if ((arg=="--position" || arg=="-p") && i+1<argc){
+            board->fen = argv[i+1];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//False only if the time control can't be read, no time control means no clock
+bool parse_time_control(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--time-control" || arg=="-tc") && i+1<argc){
+            if (!board->clock.set(argv[i+1])){
+                std::cout<<"ERROR: cant read time control "<<argv[i+1]<<"\n";
+                return 0;
+            }
+            return 1;
+        }
+    }
+    return 1;
+}
+
+bool parse_time_margin(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--time-margin" || arg=="-tm") && i+1<argc){
+            board->clock.margin=std::stoll(argv[i+1])*1000;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+bool parse_ponder(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if (arg=="--ponder" || arg=="-po"){
+            board->ponder=true;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+bool parse_info_log(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--info-log" || arg=="-il") && i+1<argc){
+            board->info_log=argv[i+1];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+bool parse_games(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--games" || arg=="-g") && i+1<argc){
+            board->games=std::stoi(argv[i+1]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+bool parse_concurrency(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--concurrency" || arg=="-c") && i+1<argc){
+            board->concurrency=std::max(1,std::stoi(argv[i+1]));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+bool parse_openings(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--openings" || arg=="-o") && i+1<argc){
+            board->openings=argv[i+1];
+        }
+        else if ((arg=="--opening-order" || arg=="-oo") && i+1<argc){
+            board->random_openings = std::string(argv[i+1])=="random";
+        }
+        else if ((arg=="--seed" || arg=="-s") && i+1<argc){
+            board->seed=std::stoull(argv[i+1]);
+        }
+        else if ((arg=="--opening-plies" || arg=="-op") && i+1<argc){
+            board->opening_plies=std::max(0,std::stoi(argv[i+1]));
+        }
+    }
+    return !board->openings.empty();
+}
+
+//False only if the bounds can't be read, no --sprt means no test
+bool parse_sprt(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if (arg=="--sprt" && i+1<argc){
+            if (!board->sprt.set(argv[i+1])){
+                std::cout<<"ERROR: cant read SPRT bounds "<<argv[i+1]<<"\n";
+                return 0;
+            }
+            //Without a game count the test runs until it is decided
+            if (std::none_of(argv,argv+argc,[](const char* a){ return !strcmp(a,"--games") || !strcmp(a,"-g"); })){
+                board->games=1000000;
+            }
+            return 1;
+        }
+    }
+    return 1;
+}
+
+//Reads comma separated numbers ("3,1000"), false unless there are exactly count of them
+bool parse_int_list(std::string_view text, int* values, int count){
+    for (int i=0;i<count;i++){
+        size_t comma = std::min(text.find(','),text.size());
+        if (!parse_number(text.substr(0,comma),values[i]) || (i+1<count)!=(comma<text.size())){
+            return false;
+        }
+        text.remove_prefix(std::min(comma+1,text.size()));
+    }
+    return true;
+}
+
+//False if a rule can't be read, a match shouldn't run without the adjudication asked for
+bool parse_adjudication(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if (arg=="--resign" && i+1<argc){
+            int values[2];
+            if (!parse_int_list(argv[i+1],values,2)){
+                std::cout<<"ERROR: cant read resign adjudication "<<argv[i+1]<<"\n";
+                return 0;
+            }
+            board->resign_moves=values[0];
+            board->resign_score=values[1];
+        }
+        else if (arg=="--draw" && i+1<argc){
+            int values[3];
+            if (!parse_int_list(argv[i+1],values,3)){
+                std::cout<<"ERROR: cant read draw adjudication "<<argv[i+1]<<"\n";
+                return 0;
+            }
+            board->draw_move=values[0];
+            board->draw_moves=values[1];
+            board->draw_score=values[2];
+        }
+        else if ((arg=="--tb-path" || arg=="-tb") && i+1<argc){
+            board->tb_path=argv[i+1];
+        }
+        else if ((arg=="--tb-pieces" || arg=="-tbp") && i+1<argc){
+            //Syzygy tables go up to 7 pieces, and there are always two kings
+            if (!parse_number(std::string_view(argv[i+1]),board->tb_pieces) || board->tb_pieces<3 || board->tb_pieces>7){
+                std::cout<<"ERROR: cant read tablebase pieces "<<argv[i+1]<<" (3 to 7)\n";
+                return 0;
+            }
+        }
+    }
+    //Tablebase adjudication is on for the usual 5-piece set once a path is given
+    if (!board->tb_path.empty() && board->tb_pieces==0){
+        board->tb_pieces=5;
+    }
+    return 1;
+}
+
+bool parse_archive(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--archive" || arg=="-a") && i+1<argc){
+            board->archive=argv[i+1];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+bool parse_eval_cache(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--eval-cache" || arg=="-ec") && i+1<argc){
+            board->cache_path=argv[i+1];
+        }
+        else if ((arg=="--eval-cache-size" || arg=="-ecs") && i+1<argc){
+            board->cache_size=std::stoi(argv[i+1]);
+        }
+    }
+    return !board->cache_path.empty();
+}
+
+bool parse_engine_options(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if (i+1>=argc){
+            break;
+        }
+        if (arg=="--engine1-threads" || arg=="-et1"){
+            board->engine_threads[0]=std::stoi(argv[i+1]);
+        }
+        else if (arg=="--engine2-threads" || arg=="-et2"){
+            board->engine_threads[1]=std::stoi(argv[i+1]);
+        }
+        else if (arg=="--engine1-hash" || arg=="-eh1"){
+            board->engine_hash[0]=std::stoi(argv[i+1]);
+        }
+        else if (arg=="--engine2-hash" || arg=="-eh2"){
+            board->engine_hash[1]=std::stoi(argv[i+1]);
+        }
+        else if (arg=="--engine1-option" || arg=="-eo1"){
+            board->engine_options[0].push_back(argv[i+1]);
+        }
+        else if (arg=="--engine2-option" || arg=="-eo2"){
+            board->engine_options[1].push_back(argv[i+1]);
+        }
+    }
+    return 1;
+}
+
+bool parse_pin(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if (arg=="--pin"){
+            board->pin=true;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+bool parse_server(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--server" || arg=="-sv") && i+1<argc){
+            board->server_port=std::stoi(argv[i+1]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+bool parse_logging(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if (arg=="--headless" || arg=="-hl"){
+            board->headless=true;
+        }
+        else if ((arg=="--log-level" || arg=="-ll") && i+1<argc){
+            std::string level=argv[i+1];
+            const char* names[] = {"error","warn","info","debug"};
+            auto found = std::find(std::begin(names),std::end(names),level);
+            if (found==std::end(names)){
+                std::cout<<"ERROR: cant read log level "<<level<<"\n";
+                return 0;
+            }
+            board->log_level = int(found-std::begin(names));
+        }
+        else if ((arg=="--log-dir" || arg=="-ld") && i+1<argc){
+            board->log_dir=argv[i+1];
+        }
+    }
+    return 1;
+}
+
+bool parse_coordinator(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--coordinator" || arg=="-co") && i+1<argc){
+            board->coordinator=argv[i+1];
+        }
+        else if ((arg=="--token" || arg=="-tk") && i+1<argc){
+            board->token=argv[i+1];
+        }
+    }
+    return 0;
+}
+
+bool parse_journal(int argc, char* argv[],Board* board){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg=="--journal" || arg=="-j") && i+1<argc){
+            board->journal_path=argv[i+1];
+        }
+        else if (arg=="--resume" || arg=="-rs"){
+            board->resume=true;
+        }
+        else if ((arg=="--journal-sync" || arg=="-js") && i+1<argc){
+            board->journal_sync=std::max(0,std::stoi(argv[i+1]));
+        }
+        //The journal keeps the arguments so a resumed match can be checked against them
+        if (i>0 && arg!="--resume" && arg!="-rs"){
+            board->arguments.push_back(arg);
+        }
+    }
+    if (board->resume && board->journal_path.empty()){
+        std::cout<<"ERROR: --resume needs --journal\n";
+        return 0;
+    }
+    if (!board->journal_path.empty() && !board->coordinator.empty()){
+        std::cout<<"ERROR: --journal cant be used with --coordinator\n";
+        return 0;
+    }
+    return 1;
+}
+
+bool arg_to_board(int argc, char* argv[],Board* board){
+    parse_game_mode(argc,argv,board);
+    parse_engine1_path(argc,argv,board);
+    parse_engine2_path(argc,argv,board);
+    parse_engine1_depth(argc,argv,board);
+    parse_engine2_depth(argc,argv,board);
+    parse_sides(argc,argv,board);
+    parse_position(argc,argv,board);
+    if (!parse_time_control(argc,argv,board)){
+        return 0;
+    }
+    parse_time_margin(argc,argv,board);
+    parse_ponder(argc,argv,board);
+    parse_info_log(argc,argv,board);
+    parse_games(argc,argv,board);
+    parse_concurrency(argc,argv,board);
+    parse_openings(argc,argv,board);
+    if (!parse_sprt(argc,argv,board)){
+        return 0;
+    }
+    if (!parse_adjudication(argc,argv,board)){
+        return 0;
+    }
+    parse_archive(argc,argv,board);
+    parse_eval_cache(argc,argv,board);
+    parse_server(argc,argv,board);
+    parse_engine_options(argc,argv,board);
+    parse_pin(argc,argv,board);
+    parse_coordinator(argc,argv,board);
+    if (!parse_logging(argc,argv,board) || !parse_journal(argc,argv,board)){
+        return 0;
+    }
+    //The start position is checked here, so no game starts from a broken one
+    if (!board->set_position(board->fen,nullptr)){
+        return 0;
+    }
+    return 1;
+}
+
+//======= Subcommand arguments =======//
+//Gets the value after --name (or -short_name), or default_value if it is missing
+std::string get_arg(int argc, char* argv[], std::string name, std::string short_name, std::string default_value){
+    for (int i=0;i<argc;i++){
+        std::string arg=argv[i];
+        if ((arg==name || arg==short_name) && i+1<argc){
+            return argv[i+1];
+        }
+    }
+    return default_value;
+}
+
+//Checks if a flag without a value is given
+bool has_flag(int argc, char* argv[], std::string name){
+    for (int i=0;i<argc;i++){
+        if (name==argv[i]){
+            return true;
+        }
+    }
+    return false;
+}
+
+//======= Perft mode =======//
+/*Counts the leaf nodes of the move tree. The last ply is only counted,
+never played (bulk counting). With several threads the root moves
+are shared out between them.*/
+
+uint64_t perft(Position& position, int depth){
+    MoveList moves;
+    position.generate_legal(moves);
+    if (depth<=1){
+        return depth==1 ? moves.size : 1;
+    }
+    uint64_t nodes = 0;
+    for (Move move : moves){
+        Position::Undo undo;
+        position.make_move(move,undo);
+        nodes += perft(position,depth-1);
+        position.unmake_move(move,undo);
+    }
+    return nodes;
+}
+
+//Counts nodes under every root move, root moves are taken by threads one at a time
+uint64_t perft_divide(Position& position, int depth, int threads, std::vector<uint64_t>* divide){
+    MoveList moves;
+    position.generate_legal(moves);
+    if (depth<=1){
+        divide->assign(moves.size,depth==1 ? 1 : 0);
+        return depth==1 ? moves.size : 1;
+    }
+    divide->assign(moves.size,0);
+    std::atomic<int> next_move(0);
+    auto worker = [&](){
+        Position local = position;
+        int i;
+        while ((i = next_move.fetch_add(1)) < moves.size){
+            Position::Undo undo;
+            local.make_move(moves.moves[i],undo);
+            (*divide)[i] = perft(local,depth-1);
+            local.unmake_move(moves.moves[i],undo);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int i=1;i<threads;i++){
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers){
+        thread.join();
+    }
+    uint64_t nodes = 0;
+    for (uint64_t count : *divide){
+        nodes += count;
+    }
+    return nodes;
+}
+
+//Standard positions with known node counts
+struct PerftCase{
+    const char* name;
+    const char* fen;
+    int depth;
+    uint64_t nodes;
+};
+
+const PerftCase perft_suite[] = {
+    {"startpos","rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",5,4865609},
+    {"kiwipete","r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",4,4085603},
+    {"position 3","8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",5,674624},
+    {"position 4","r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",4,422333},
+    {"position 5","rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",4,2103487},
+    {"position 6","r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",4,3894594},
+    {"illegal ep 1","3k4/3p4/8/K1P4r/8/8/8/8 b - - 0 1",6,1134888},
+    {"illegal ep 2","8/8/4k3/8/2p5/8/B2P2K1/8 w - - 0 1",6,1015133},
+    {"ep gives check","8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1",6,1440467},
+    {"short castle check","5k2/8/8/8/8/8/8/4K2R w K - 0 1",6,661072},
+    {"long castle check","3k4/8/8/8/8/8/8/R3K3 w Q - 0 1",6,803711},
+    {"castle rights","r3k2r/1b4bq/8/8/8/8/7B/R3K2R w KQkq - 0 1",4,1274206},
+    {"castle prevented","r3k2r/8/3Q4/8/8/5q2/8/R3K2R b KQkq - 0 1",4,1720476},
+    {"promote out of check","2K2r2/4P3/8/8/8/8/8/3k4 w - - 0 1",6,3821001},
+    {"discovered check","8/8/1P2K3/8/2n5/1q6/8/5k2 b - - 0 1",5,1004658},
+    {"promote to check","4k3/1P6/8/8/8/8/K7/8 w - - 0 1",6,217342},
+    {"underpromote to check","8/P1k5/K7/8/8/8/8/8 w - - 0 1",6,92683},
+    {"self stalemate","K1k5/8/P7/8/8/8/8/8 w - - 0 1",6,2217},
+    {"stalemate and mate 1","8/k1P5/8/1K6/8/8/8/8 w - - 0 1",7,567584},
+    {"stalemate and mate 2","8/8/2k5/5q2/5n2/8/5K2/8 b - - 0 1",4,23527},
+};
+
+//Runs the whole suite, returns the number of failed positions
+int run_perft_suite(int threads){
+    int failed = 0;
+    uint64_t total_nodes = 0;
+    auto start_time = std::chrono::steady_clock::now();
+    for (const PerftCase& test : perft_suite){
+        Position position;
+        position.set_fen(test.fen);
+        std::vector<uint64_t> divide;
+        auto case_start = std::chrono::steady_clock::now();
+        uint64_t nodes = perft_divide(position,test.depth,threads,&divide);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-case_start).count();
+        total_nodes += nodes;
+        bool ok = nodes==test.nodes;
+        if (!ok){
+            failed++;
+        }
+        std::cout<<(ok ? "OK   " : "FAIL ")<<test.name<<" depth "<<test.depth<<": "<<nodes;
+        if (!ok){
+            std::cout<<" (expected "<<test.nodes<<")";
+        }
+        std::cout<<", "<<uint64_t(nodes/std::max(seconds,1e-9))<<" nps\n";
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start_time).count();
+    std::cout<<(failed ? "Perft suite failed: " : "Perft suite passed: ")<<failed<<" failures, "<<
+    total_nodes<<" nodes in "<<seconds<<" s ("<<uint64_t(total_nodes/std::max(seconds,1e-9))<<" nps)\n";
+    return failed;
+}
+
+//perft [--position FEN] [--depth N] [--threads N] [--divide] [--suite]
+int Perft(int argc, char* argv[]){
+    int threads = std::max(1,std::stoi(get_arg(argc,argv,"--threads","-t","1")));
+    if (has_flag(argc,argv,"--suite")){
+        return run_perft_suite(threads) ? 1 : 0;
+    }
+    std::string fen = get_arg(argc,argv,"--position","-p","rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+    int depth = std::stoi(get_arg(argc,argv,"--depth","-d","5"));
+    Position position;
+    if (!position.set_fen(fen)){
+        std::cout<<"ERROR: cant read position "<<fen<<"\n";
+        return 1;
+    }
+    MoveList moves;
+    position.generate_legal(moves);
+    std::vector<uint64_t> divide;
+    auto start_time = std::chrono::steady_clock::now();
+    uint64_t nodes = perft_divide(position,depth,threads,&divide);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start_time).count();
+    if (has_flag(argc,argv,"--divide")){
+        for (int i=0;i<moves.size;i++){
+            std::cout<<Position::move_to_uci(moves.moves[i])<<": "<<divide[i]<<"\n";
+        }
+        std::cout<<"\n";
+    }
+    std::cout<<"Nodes searched: "<<nodes<<"\n";
+    std::cout<<"Time: "<<seconds*1000<<" ms, "<<uint64_t(nodes/std::max(seconds,1e-9))<<" nps\n";
+    return 0;
+}
+
+//======= PGN export =======//
+/*Streams an archive out as PGN. The archive is mapped and read front to
+back, games are written through a large stdio buffer, so converting
+doesn't need memory for more than one game.*/
+
+//pgn --input archive [--output file.pgn] [--game N]
+int ExportPgn(int argc, char* argv[]){
+    std::string input = get_arg(argc,argv,"--input","-i","");
+    std::string output = get_arg(argc,argv,"--output","-o","");
+    long long only_game = std::stoll(get_arg(argc,argv,"--game","-g","0"));
+    ArchiveReader reader;
+    if (input.empty() || !reader.open(input)){
+        std::cout<<"ERROR: cant read archive "<<input<<"\n";
+        return 1;
+    }
+    FILE* out = output.empty() ? stdout : fopen(output.c_str(),"w");
+    if (!out){
+        std::cout<<"ERROR: cant write "<<output<<"\n";
+        return 1;
+    }
+    static char buffer[1<<20];
+    setvbuf(out,buffer,_IOFBF,sizeof(buffer));
+    if (only_game>0){
+        //N counts the games in the archive, not the game numbers of a match, which start again for
+        //every match appended. The index has one entry per game in the same order, so the N-th entry
+        //says where the game is, no need to go through the archive.
+        MappedFile index;
+        bool found = false;
+        uint64_t entry = uint64_t(only_game-1)*16;
+        if (index.open(input+".idx",MADV_RANDOM) && entry+16<=index.size){
+            const uint8_t* bytes = (const uint8_t*)index.data+entry;
+            uint64_t offset = 0;
+            for (int i=0;i<8;i++){
+                offset |= uint64_t(bytes[i])<<(8*i);
+            }
+            if (offset<reader.file.size){
+                reader.pos = offset;
+                found = true;
+            }
+        }
+        ArchivedGame game;
+        if (!found || !reader.next(&game)){
+            std::cout<<"ERROR: no game "<<only_game<<" in "<<input<<"\n";
+            return 1;
+        }
+        write_pgn(out,game);
+    }
+    else{
+        ArchivedGame game;
+        while (reader.next(&game)){
+            write_pgn(out,game);
+        }
+    }
+    fflush(out);
+    if (out!=stdout){
+        fclose(out);
+    }
+    return 0;
+}
+
+//======= Position index =======//
+/*index builds a table from every position of a set of PGN files to the
+games that reached it, query looks a position up in it. The files are
+mapped and cut into chunks at game boundaries, the threads take chunks
+and replay their games with the SAN parser of Position. Every thread
+sorts what it found into runs of bounded size on disk, the runs are
+merged into the index at the end, so memory stays the same however large
+the archive is. query maps the index and binary searches it: a lookup
+touches a few pages and never reads the games themselves, except the
+headers of the games it lists.
+
+Index file (native byte order): IndexHeader, the PGN file names one per
+line, the position table (IndexedGame sorted by key and game, one entry
+per game that reached a position) and the move table (IndexedMove sorted
+by key and move, the results of every move played from a position).*/
+
+const char INDEX_MAGIC[8] = {'C','H','E','S','S','I','D','X'};
+
+struct IndexHeader{
+    char magic[8]; //INDEX_MAGIC
+    uint64_t games; //Games indexed
+    uint64_t files; //PGN files indexed
+    uint64_t names_offset; //File names, one per line
+    uint64_t positions; //Entries of the position table
+    uint64_t positions_offset;
+    uint64_t moves; //Entries of the move table
+    uint64_t moves_offset;
+};
+
+//A game that reached a position
+struct IndexedGame{
+    uint64_t key; //Zobrist key of the position
+    uint64_t game; //File number<<48 | byte offset of the game in the file
+};
+
+//What came of a move from a position, over all games
+struct IndexedMove{
+    uint64_t key; //Zobrist key of the position
+    uint32_t games; //Games that played the move
+    uint32_t results[3]; //Of those: white wins, draws, black wins
+    uint16_t move; //Move played (0: the game ended in the position)
+    uint16_t reserved[3];
+};
+static_assert(sizeof(IndexedGame)==16 && sizeof(IndexedMove)==32,"index entries are 16 and 32 bytes");
+
+bool index_order(const IndexedGame& a, const IndexedGame& b){
+    return a.key<b.key || (a.key==b.key && a.game<b.game);
+}
+
+bool index_order(const IndexedMove& a, const IndexedMove& b){
+    return a.key<b.key || (a.key==b.key && a.move<b.move);
+}
+
+//Folds b into a if both are about the same game / move, false if they aren't
+bool index_merge(IndexedGame& a, const IndexedGame& b){
+    return a.key==b.key && a.game==b.game;
+}
+
+bool index_merge(IndexedMove& a, const IndexedMove& b){
+    if (a.key!=b.key || a.move!=b.move){
+        return false;
+    }
+    a.games += b.games;
+    for (int i=0;i<3;i++){
+        a.results[i] += b.results[i];
+    }
+    return true;
+}
+
+//Sorts entries and folds the equal ones together
+template<typename Entry>
+void sort_index_entries(std::vector<Entry>& entries){
+    std::sort(entries.begin(),entries.end(),[](const Entry& a, const Entry& b){return index_order(a,b);});
+    size_t kept = 0;
+    for (size_t i=0;i<entries.size();i++){
+        if (kept==0 || !index_merge(entries[kept-1],entries[i])){
+            entries[kept++] = entries[i];
+        }
+    }
+    entries.resize(kept);
+}
+
+//Merges sorted runs into out, equal entries are folded together. Returns the entries written.
+template<typename Entry>
+uint64_t merge_index_runs(const std::vector<std::string>& runs, FILE* out){
+    std::deque<MappedFile> files;
+    std::vector<const Entry*> next;
+    std::vector<const Entry*> ends;
+    for (const std::string& run : runs){
+        files.emplace_back();
+        if (!files.back().open(run,MADV_SEQUENTIAL) || files.back().size==0){
+            continue;
+        }
+        next.push_back((const Entry*)files.back().data);
+        ends.push_back(next.back()+files.back().size/sizeof(Entry));
+    }
+    auto later = [&next](size_t a, size_t b){return index_order(*next[b],*next[a]);};
+    std::priority_queue<size_t,std::vector<size_t>,decltype(later)> heap(later);
+    for (size_t i=0;i<next.size();i++){
+        heap.push(i);
+    }
+    uint64_t written = 0;
+    Entry pending;
+    bool has_pending = false;
+    while (!heap.empty()){
+        size_t run = heap.top();
+        heap.pop();
+        const Entry& entry = *next[run]++;
+        if (next[run]<ends[run]){
+            heap.push(run);
+        }
+        if (has_pending && index_merge(pending,entry)){
+            continue;
+        }
+        if (has_pending){
+            fwrite(&pending,sizeof(Entry),1,out);
+            written++;
+        }
+        pending = entry;
+        has_pending = true;
+    }
+    if (has_pending){
+        fwrite(&pending,sizeof(Entry),1,out);
+        written++;
+    }
+    return written;
+}
+
+class IndexBuilder{
+    public:
+    std::string output; //Index file, the runs are written next to it
+    std::deque<MappedFile> files; //PGN files being indexed
+    size_t run_bytes=0; //Entries a thread collects before it writes a run
+    int max_plies=0; //Plies indexed per game (0: all)
+    std::atomic<size_t> next_chunk{0}; //Next chunk to hand to a thread
+    std::mutex mutex; //Guards everything below
+    std::vector<std::string> position_runs; //Sorted run files of the position table
+    std::vector<std::string> move_runs; //Sorted run files of the move table
+    uint64_t games=0; //Games indexed
+    uint64_t skipped=0; //Games whose start position couldn't be read
+    bool failed=false; //A run couldn't be written
+
+    struct Chunk{
+        size_t file;
+        size_t begin; //Games starting in [begin,end) belong to the chunk
+        size_t end;
+    };
+    std::vector<Chunk> chunks;
+
+//Cuts the files into chunks of about chunk_size bytes
+    void plan(size_t chunk_size){
+        for (size_t file=0;file<files.size();file++){
+            for (size_t begin=0;begin<files[file].size;begin+=chunk_size){
+                chunks.push_back({file,begin,std::min(begin+chunk_size,files[file].size)});
+            }
+        }
+    }
+
+//Thread loop: indexes chunks until there are none left
+    void work(){
+        std::vector<IndexedGame> positions;
+        std::vector<IndexedMove> moves;
+        std::vector<std::pair<uint64_t,Move>> seen; //Positions of the current game with the move played there
+        uint64_t indexed = 0;
+        uint64_t broken = 0;
+        size_t index;
+        while ((index = next_chunk++)<chunks.size()){
+            const Chunk& chunk = chunks[index];
+            std::string_view data = files[chunk.file].view();
+            size_t offset = pgn_game_start(data,chunk.begin);
+            while (offset<chunk.end){
+                PgnRecord record;
+                size_t end = read_pgn_record(data,offset,&record);
+                if (add_game(record,(uint64_t(chunk.file)<<48)|offset,seen,positions,moves)){
+                    indexed++;
+                }
+                else{
+                    broken++;
+                }
+                if (positions.size()*sizeof(IndexedGame)+moves.size()*sizeof(IndexedMove)>=run_bytes){
+                    write_runs(positions,moves);
+                }
+                offset = end>offset ? end : pgn_game_start(data,offset+1);
+            }
+        }
+        write_runs(positions,moves);
+        std::lock_guard<std::mutex> lock(mutex);
+        games += indexed;
+        skipped += broken;
+    }
+
+    private:
+//Replays a game and adds every position it reached, once per game
+    bool add_game(const PgnRecord& record, uint64_t game, std::vector<std::pair<uint64_t,Move>>& seen,
+    std::vector<IndexedGame>& positions, std::vector<IndexedMove>& moves){
+        int result = record.result=="1-0" ? 0 : record.result=="1/2-1/2" ? 1 : record.result=="0-1" ? 2 : -1;
+        Position position;
+        if (!position.set_fen(record.fen.empty() ? "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1" :
+        record.fen)){
+            return false;
+        }
+        position.drop_unusable_en_passant();
+        seen.clear();
+        PgnMoves reader(record.movetext);
+        std::string_view word;
+        //The last position counts as the end of the game unless the moves stop at a broken one
+        bool ended = true;
+        while (reader.next(&word)){
+            if (PgnMoves::is_result(word)){
+                if (result<0){
+                    result = word=="1-0" ? 0 : word=="1/2-1/2" ? 1 : word=="0-1" ? 2 : -1;
+                }
+                break;
+            }
+            if (max_plies>0 && int(seen.size())>=max_plies){
+                ended = false;
+                break;
+            }
+            Move move = position.parse_san(word);
+            if (!move){
+                ended = false;
+                break;
+            }
+            seen.push_back({position.key,move});
+            position.do_move(move);
+        }
+        if (ended){
+            seen.push_back({position.key,Move(0)});
+        }
+        std::sort(seen.begin(),seen.end());
+        seen.erase(std::unique(seen.begin(),seen.end()),seen.end());
+        for (size_t i=0;i<seen.size();i++){
+            if (i==0 || seen[i].first!=seen[i-1].first){
+                positions.push_back({seen[i].first,game});
+            }
+            IndexedMove entry = {};
+            entry.key = seen[i].first;
+            entry.move = seen[i].second;
+            entry.games = 1;
+            if (result>=0){
+                entry.results[result] = 1;
+            }
+            moves.push_back(entry);
+        }
+        return true;
+    }
+
+//Sorts what a thread collected and writes it to new run files
+    void write_runs(std::vector<IndexedGame>& positions, std::vector<IndexedMove>& moves){
+        if (positions.empty() && moves.empty()){
+            return;
+        }
+        sort_index_entries(positions);
+        sort_index_entries(moves);
+        std::string names[2];
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            size_t run = position_runs.size();
+            names[0] = output+".run"+std::to_string(run)+".positions";
+            names[1] = output+".run"+std::to_string(run)+".moves";
+            position_runs.push_back(names[0]);
+            move_runs.push_back(names[1]);
+        }
+        bool written = write_run(names[0],positions.data(),positions.size()*sizeof(IndexedGame)) &&
+        write_run(names[1],moves.data(),moves.size()*sizeof(IndexedMove));
+        positions.clear();
+        moves.clear();
+        if (!written){
+            std::lock_guard<std::mutex> lock(mutex);
+            failed = true;
+        }
+    }
+
+    static bool write_run(const std::string& path, const void* data, size_t size){
+        FILE* run = fopen(path.c_str(),"wb");
+        if (!run){
+            return false;
+        }
+        bool written = fwrite(data,1,size,run)==size;
+        return fclose(run)==0 && written;
+    }
+};
+
+//index --input file.pgn [--input more.pgn] --output file.idx [--threads N] [--plies N] [--memory MB]
+int BuildIndex(int argc, char* argv[]){
+    IndexBuilder builder;
+    builder.output = get_arg(argc,argv,"--output","-o","");
+    int threads = std::max(1,std::stoi(get_arg(argc,argv,"--threads","-t",std::to_string(std::max(1u,std::thread::hardware_concurrency())))));
+    builder.max_plies = std::max(0,std::stoi(get_arg(argc,argv,"--plies","-P","0")));
+    size_t memory = std::max(16,std::stoi(get_arg(argc,argv,"--memory","-m","1024")));
+    builder.run_bytes = (memory<<20)/threads/2;
+    std::vector<std::string> inputs;
+    for (int i=0;i+1<argc;i++){
+        std::string arg=argv[i];
+        if (arg=="--input" || arg=="-i"){
+            inputs.push_back(argv[i+1]);
+        }
+    }
+    if (inputs.empty() || builder.output.empty()){
+        std::cout<<"ERROR: index needs --input file.pgn and --output file.idx\n";
+        return 1;
+    }
+    size_t total = 0;
+    for (const std::string& input : inputs){
+        builder.files.emplace_back();
+        if (!builder.files.back().open(input,MADV_SEQUENTIAL)){
+            std::cout<<"ERROR: cant read "<<input<<"\n";
+            return 1;
+        }
+        total += builder.files.back().size;
+    }
+    auto start_time = std::chrono::steady_clock::now();
+    //A few chunks per thread so the threads finish together
+    builder.plan(std::clamp<size_t>(total/(size_t(threads)*4)+1,1<<20,256<<20));
+    std::vector<std::thread> workers;
+    for (int i=0;i<threads;i++){
+        workers.emplace_back(&IndexBuilder::work,&builder);
+    }
+    for (std::thread& worker : workers){
+        worker.join();
+    }
+    auto replay_time = std::chrono::steady_clock::now();
+    FILE* out = builder.failed ? nullptr : fopen(builder.output.c_str(),"wb");
+    bool written = false;
+    if (out){
+        static char buffer[1<<20];
+        setvbuf(out,buffer,_IOFBF,sizeof(buffer));
+        IndexHeader header = {};
+        memcpy(header.magic,INDEX_MAGIC,sizeof(header.magic));
+        header.games = builder.games;
+        header.files = inputs.size();
+        header.names_offset = sizeof(header);
+        fwrite(&header,sizeof(header),1,out);
+        std::string names;
+        for (const std::string& input : inputs){
+            names += input+"\n";
+        }
+        names.resize((names.size()+7)/8*8,'\n');
+        fwrite(names.data(),1,names.size(),out);
+        header.positions_offset = header.names_offset+names.size();
+        header.positions = merge_index_runs<IndexedGame>(builder.position_runs,out);
+        header.moves_offset = header.positions_offset+header.positions*sizeof(IndexedGame);
+        header.moves = merge_index_runs<IndexedMove>(builder.move_runs,out);
+        fseek(out,0,SEEK_SET);
+        fwrite(&header,sizeof(header),1,out);
+        written = !ferror(out);
+        written = fclose(out)==0 && written;
+        if (written){
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start_time).count();
+            std::cout<<"Indexed "<<header.games<<" games ("<<builder.skipped<<" skipped), "<<header.positions<<
+            " game positions, "<<header.moves<<" moves in "<<seconds<<" s (replay "<<
+            std::chrono::duration<double>(replay_time-start_time).count()<<" s, "<<
+            total/1048576.0/seconds<<" MB/s)\n";
+        }
+    }
+    for (size_t run=0;run<builder.position_runs.size();run++){
+        unlink(builder.position_runs[run].c_str());
+        unlink(builder.move_runs[run].c_str());
+    }
+    if (!written){
+        std::cout<<"ERROR: cant write "<<builder.output<<"\n";
+        unlink(builder.output.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+//query --index file.idx --position FEN [--games N]
+int QueryIndex(int argc, char* argv[]){
+    std::string path = get_arg(argc,argv,"--index","-x","");
+    std::string fen = get_arg(argc,argv,"--position","-p","rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+    long long listed = std::max(0LL,std::stoll(get_arg(argc,argv,"--games","-g","10")));
+    auto start_time = std::chrono::steady_clock::now();
+    MappedFile index;
+    const IndexHeader* header = nullptr;
+    if (path.empty() || !index.open(path,MADV_RANDOM) || index.size<sizeof(IndexHeader) ||
+    memcmp((header = (const IndexHeader*)index.data)->magic,INDEX_MAGIC,sizeof(INDEX_MAGIC))!=0 ||
+    header->positions_offset+header->positions*sizeof(IndexedGame)>index.size ||
+    header->moves_offset+header->moves*sizeof(IndexedMove)>index.size){
+        std::cout<<"ERROR: cant read index "<<path<<"\n";
+        return 1;
+    }
+    Position position;
+    if (!position.set_fen(fen)){
+        std::cout<<"ERROR: cant read position "<<fen<<"\n";
+        return 1;
+    }
+    position.drop_unusable_en_passant();
+    uint64_t key = position.key;
+    const IndexedGame* games = (const IndexedGame*)(index.data+header->positions_offset);
+    const IndexedMove* moves = (const IndexedMove*)(index.data+header->moves_offset);
+    auto games_found = std::equal_range(games,games+header->positions,IndexedGame{key,0},
+    [](const IndexedGame& a, const IndexedGame& b){return a.key<b.key;});
+    IndexedMove probe = {};
+    probe.key = key;
+    auto moves_found = std::equal_range(moves,moves+header->moves,probe,
+    [](const IndexedMove& a, const IndexedMove& b){return a.key<b.key;});
+    std::vector<IndexedMove> played(moves_found.first,moves_found.second);
+    double lookup_ms = std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now()-start_time).count();
+
+    std::sort(played.begin(),played.end(),[](const IndexedMove& a, const IndexedMove& b){return a.games>b.games;});
+    uint64_t reached = games_found.second-games_found.first;
+    std::cout<<reached<<" of "<<header->games<<" games reached the position\n";
+    if (reached>0){
+        printf("%-8s %10s %7s %7s %7s\n","Move","Games","White","Draw","Black");
+    }
+    for (const IndexedMove& entry : played){
+        //Results are shares of the games with a known result
+        uint32_t decided = entry.results[0]+entry.results[1]+entry.results[2];
+        std::string name = entry.move ? position.move_to_san(entry.move) : "(end)";
+        printf("%-8s %10u",name.c_str(),entry.games);
+        for (int i=0;i<3;i++){
+            printf(" %6.1f%%",decided ? 100.0*entry.results[i]/decided : 0.0);
+        }
+        printf("\n");
+    }
+    //The games are shown with their tags if the PGN files are still there
+    std::vector<std::string> names;
+    std::string_view name_block(index.data+header->names_offset,header->positions_offset-header->names_offset);
+    size_t name_offset = 0;
+    while (names.size()<header->files && name_offset<name_block.size()){
+        names.emplace_back(read_line(name_block,name_offset));
+    }
+    std::deque<MappedFile> pgn_files(names.size());
+    for (size_t i=0;i<names.size();i++){
+        pgn_files[i].open(names[i],MADV_RANDOM);
+    }
+    for (const IndexedGame* entry=games_found.first;entry<games_found.second && entry-games_found.first<listed;entry++){
+        size_t file = entry->game>>48;
+        size_t offset = entry->game&((uint64_t(1)<<48)-1);
+        printf("%s@%zu",file<names.size() ? names[file].c_str() : "?",offset);
+        if (file<pgn_files.size() && offset<pgn_files[file].size){
+            PgnRecord record;
+            read_pgn_record(pgn_files[file].view(),offset,&record);
+            printf("  %.*s - %.*s  %.*s",int(record.white.size()),record.white.data(),int(record.black.size()),
+            record.black.data(),int(record.result.size()),record.result.data());
+        }
+        printf("\n");
+    }
+    printf("Lookup took %.3f ms\n",lookup_ms);
+    return 0;
+}
+
+//======= Datagen mode =======//
+/*Self-play games for training data. Every worker thread drives its own
+engine: a few random moves from the start position, then the engine
+plays both sides at a fixed depth or node count. Quiet positions (not in
+check, best move no capture or promotion) are kept with the engine's
+score and, once the game is over, its result. Records are 32 bytes in the
+marlinformat layout, little endian:
+    occupancy    8 bytes, occupied squares (a1 = bit 0)
+    pieces       16 bytes, a nibble per occupied square in bit order:
+                 type (P N B R Q K = 0..5, 6 = rook that can still castle) | 8 for black
+    side_ep      1 byte, 0x80 if black is to move | en passant square (64: none)
+    half_move    1 byte, half move counter
+    full_move    2 bytes, full move counter
+    score        2 bytes, signed, centipawns from white's view
+    result       1 byte, 0 black won, 1 draw, 2 white won
+    extra        1 byte, unused (0)*/
+
+struct PackedPosition{
+    uint64_t occupancy;
+    uint8_t pieces[16];
+    uint8_t side_ep;
+    uint8_t half_move;
+    uint16_t full_move;
+    int16_t score;
+    uint8_t result;
+    uint8_t extra;
+};
+static_assert(sizeof(PackedPosition)==32,"packed positions are 32 bytes");
+
+PackedPosition pack_position(const Position& position, int white_score){
+    PackedPosition packed = {};
+    packed.occupancy = position.occupied;
+    int index = 0;
+    for (Bitboard b=position.occupied;b;b&=b-1){
+        int square = lsb(b);
+        int piece = position.squares[square];
+        int type = piece%6;
+        //Rooks on their corner that still have the right to castle
+        if (type==ROOK && ((square==0 && (position.castling&WHITE_OOO)) || (square==7 && (position.castling&WHITE_OO)) ||
+        (square==56 && (position.castling&BLACK_OOO)) || (square==63 && (position.castling&BLACK_OO)))){
+            type = 6;
+        }
+        packed.pieces[index/2] |= uint8_t((type | (piece>=6 ? 8 : 0)) << (4*(index%2)));
+        index++;
+    }
+    packed.side_ep = uint8_t((position.side==BLACK ? 0x80 : 0) | (position.en_passant==NO_SQUARE ? 64 : position.en_passant));
+    packed.half_move = uint8_t(std::min(position.half_move_counter,255));
+    packed.full_move = uint16_t(position.move_counter);
+    packed.score = int16_t(std::max(-32000,std::min(32000,white_score)));
+    return packed;
+}
+
+struct Datagen{
+    Board settings; //Engine path and adjudication
+    std::string limits; //"depth N" or "nodes N"
+    int random_plies=8; //Random moves before the engine takes over
+    int move_timeout=60000; //Longest wait for a bestmove in milliseconds, a hung engine is replaced
+    int games=100; //Games to play
+    uint64_t positions=0; //Stop after this many positions (0: after the games)
+    uint64_t seed=0;
+    int fd=-1; //Output file, opened for appending
+    std::mutex write_mutex; //Guards fd, workers write whole buffers
+    std::atomic<int> next_game{0};
+    std::atomic<uint64_t> generated{0}; //Positions from finished games, some may still be in worker buffers
+    std::atomic<int> finished_games{0};
+    std::atomic<int> running{0}; //Workers still playing
+    std::atomic<bool> failed{false}; //A write failed (disk full, I/O error), every worker stops
+
+    //Writes a worker's buffer out, whole records only. Nothing more is written after a failed write.
+    bool flush(std::vector<PackedPosition>& buffer){
+        std::lock_guard<std::mutex> lock(write_mutex);
+        if (failed){
+            return false;
+        }
+        const char* bytes = (const char*)buffer.data();
+        size_t length = buffer.size()*sizeof(PackedPosition);
+        while (length>0){
+            ssize_t count = ::write(fd,bytes,length);
+            if (count<0 && errno==EINTR){
+                continue;
+            }
+            if (count<=0){
+                failed = true;
+                return false;
+            }
+            bytes += count;
+            length -= size_t(count);
+        }
+        buffer.clear();
+        return true;
+    }
+};
+
+//Plays one self-play game and adds its quiet positions to buffer. False if the engine died.
+bool datagen_game(Datagen* datagen, Engine* engine, uint64_t& rng, std::vector<PackedPosition>& buffer){
+    Board board = datagen->settings;
+    board.set_position("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",nullptr);
+    std::string reason;
+    for (int ply=0;ply<datagen->random_plies;ply++){
+        MoveList moves;
+        board.position.generate_legal(moves);
+        if (moves.size==0){
+            //Mated or stalemated by chance, start over
+            board.set_position("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",nullptr);
+            ply = -1;
+            continue;
+        }
+        board.do_move(Position::move_to_uci(moves.moves[ZobristKeys::next(rng)%moves.size]));
+    }
+    if (!board.game_result(&reason).empty()){
+        return true;
+    }
+    if (!new_game(engine)){
+        return false;
+    }
+    std::vector<PackedPosition> game;
+    InfoTrace trace;
+    std::string result;
+    std::string go = "go "+datagen->limits;
+    while ((result = board.game_result(&reason)).empty() && (result = board.adjudicate(&reason)).empty()){
+        trace.clear();
+        send_message(board.position_command,engine);
+        send_message(go,engine);
+        std::string reply = read_response(engine,datagen->move_timeout,&trace);
+        if (!starts_with(reply,"bestmove")){
+            return false;
+        }
+        std::string text = bestmove_token(reply);
+        Move move = board.position.parse_uci_move(text);
+        const SearchInfo* info = trace.last();
+        if (!move || !info){
+            return false;
+        }
+        int score = board.position.side==WHITE ? info->score_cp() : -info->score_cp();
+        if (!info->mate && !board.position.in_check() && !(move_flag(move)&(CAPTURE|PROMOTION))){
+            game.push_back(pack_position(board.position,score));
+        }
+        MoveRecord record = {};
+        record.ply = int(board.move_history.size())+1;
+        record.side = board.position.side;
+        record.move = pack_uci_move(text);
+        record.root_pieces = popcount(board.position.occupied);
+        record.has_info = true;
+        record.info = *info;
+        board.move_records.push_back(record);
+        board.do_move(text);
+    }
+    uint8_t wdl = result=="1-0" ? 2 : result=="0-1" ? 0 : 1;
+    for (PackedPosition& packed : game){
+        packed.result = wdl;
+        buffer.push_back(packed);
+    }
+    datagen->generated += game.size();
+    return true;
+}
+
+//Starts the engine of a datagen worker with the options of the settings (tablebases)
+Engine* start_datagen_engine(Datagen* datagen){
+    Engine* engine = start_engine(datagen->settings.engine1_path);
+    if (engine){
+        setup_engine(&datagen->settings,engine,0);
+    }
+    return engine;
+}
+
+void datagen_worker(Datagen* datagen, int id){
+    uint64_t rng = datagen->seed ^ (uint64_t(id+1)*0x9E3779B97F4A7C15ULL);
+    std::vector<PackedPosition> buffer;
+    buffer.reserve(1<<15);
+    Engine* engine = start_datagen_engine(datagen);
+    while (engine && !datagen->failed && datagen->next_game.fetch_add(1)<datagen->games &&
+    (datagen->positions==0 || datagen->generated<datagen->positions)){
+        if (!datagen_game(datagen,engine,rng,buffer)){
+            //Crashed, hung or confused engine: the game is dropped and the engine replaced
+            stop_engine(engine);
+            engine = start_datagen_engine(datagen);
+            continue;
+        }
+        datagen->finished_games++;
+        if (buffer.size()>=(1<<15)-1024 && !datagen->flush(buffer)){
+            break;
+        }
+    }
+    if (!buffer.empty()){
+        datagen->flush(buffer);
+    }
+    if (engine){
+        stop_engine(engine);
+    }
+    else{
+        std::cout<<"ERROR: cant start chess engine\n";
+    }
+    datagen->running--;
+}
+
+//datagen --engine path --output file [--games N] [--positions N] [--depth N | --nodes N] [--random-plies N] [--threads N] [--seed N]
+//[--move-timeout seconds]
+int RunDatagen(int argc, char* argv[]){
+    Datagen datagen;
+    datagen.settings.engine1_path = get_arg(argc,argv,"--engine","-e",datagen.settings.engine1_path);
+    datagen.settings.resign_moves = 4;
+    datagen.settings.resign_score = 2500;
+    if (!parse_adjudication(argc,argv,&datagen.settings)){
+        return 1;
+    }
+    std::string nodes = get_arg(argc,argv,"--nodes","-n","");
+    datagen.limits = nodes.empty() ? "depth "+get_arg(argc,argv,"--depth","-d","8") : "nodes "+nodes;
+    datagen.random_plies = std::stoi(get_arg(argc,argv,"--random-plies","-r","8"));
+    datagen.move_timeout = std::max(1,std::stoi(get_arg(argc,argv,"--move-timeout","-mt","60")))*1000;
+    datagen.games = std::stoi(get_arg(argc,argv,"--games","-g","100"));
+    datagen.positions = std::stoull(get_arg(argc,argv,"--positions","-P","0"));
+    datagen.seed = std::stoull(get_arg(argc,argv,"--seed","-s",std::to_string(std::random_device()())));
+    int threads = std::stoi(get_arg(argc,argv,"--threads","-t",std::to_string(std::max(1u,std::thread::hardware_concurrency()))));
+    std::string output = get_arg(argc,argv,"--output","-o","");
+    datagen.fd = output.empty() ? -1 : ::open(output.c_str(),O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,0644);
+    if (datagen.fd<0){
+        std::cout<<"ERROR: cant write "<<output<<"\n";
+        return 1;
+    }
+    std::cout<<"Datagen: "<<datagen.games<<" games, "<<datagen.limits<<", "<<threads<<" threads, seed "<<datagen.seed<<"\n";
+    auto start_time = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    datagen.running = threads;
+    for (int i=0;i<threads;i++){
+        workers.emplace_back(datagen_worker,&datagen,i);
+    }
+    //Progress every ten seconds
+    auto report = [&](){
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start_time).count();
+        std::cout<<datagen.finished_games<<" games, "<<datagen.generated<<" positions in "<<seconds<<" s ("<<
+        uint64_t(datagen.generated/std::max(seconds,1e-9))<<" positions/s)\n";
+    };
+    int ticks = 0;
+    while (datagen.running>0){
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (++ticks%100==0 && datagen.running>0){
+            report();
+        }
+    }
+    for (auto& worker : workers){
+        worker.join();
+    }
+    report();
+    if (::close(datagen.fd)!=0){
+        datagen.failed = true;
+    }
+    if (datagen.failed){
+        std::cout<<"ERROR: cant write "<<output<<", it may end with a cut off buffer\n";
+        return 1;
+    }
+    return 0;
+}
+
+//======= Analysis mode =======//
+/*Batch analysis of a position list: every position is searched by one
+engine from a pool, and the result goes out as an EPD line with bm, ce
+(or dm), acd, acn and pv. One thread does all of it. It waits on every
+engine at once, and an engine gets its next position as soon as its
+bestmove arrives, before anything is written. Results are either kept
+back until they are in input order, or written as they come with the
+input line number in front.*/
+
+struct AnalysisJob{
+    Engine* engine=nullptr;
+    InfoTrace trace; //Search info of the current position
+    uint64_t sequence=0; //Input line number of the current position (from 1)
+    uint64_t key=0; //Zobrist key of the current position, for the eval cache
+    std::string fen; //Current position, empty when the engine is idle
+};
+
+//Turns a finished search into an EPD line. Moves are written in SAN.
+std::string analysis_line(const AnalysisJob& job, std::string_view bestmove){
+    Position position;
+    position.set_fen(job.fen);
+    std::string line = position.get_fen();
+    line.erase(line.rfind(' ',line.rfind(' ')-1)); //EPD has no move counters
+    Move best = position.parse_uci_move(bestmove);
+    if (!best){
+        return line+" c0 \"no move\";";
+    }
+    line += " bm "+position.move_to_san(best)+";";
+    const SearchInfo* info = job.trace.last();
+    if (info){
+        if (info->mate){
+            line += " dm "+std::to_string(info->score)+";";
+        }
+        else{
+            line += " ce "+std::to_string(info->score)+";";
+        }
+        line += " acd "+std::to_string(info->depth)+"; acn "+std::to_string(info->nodes)+";";
+        std::string pv;
+        for (int i=0;i<info->pv_length;i++){
+            char text[6] = {0};
+            unpack_uci_move(info->pv[i],text);
+            Move move = position.parse_uci_move(text);
+            if (!move){
+                break;
+            }
+            pv += (pv.empty() ? "" : " ")+position.move_to_san(move);
+            position.do_move(move);
+        }
+        if (!pv.empty()){
+            line += " pv \""+pv+"\";";
+        }
+    }
+    return line;
+}
+
+//analyse --engine path [--input file|-] [--output file] [--engines N] [--depth N | --nodes N] [--unordered]
+int Analyse(int argc, char* argv[]){
+    std::string path = get_arg(argc,argv,"--engine","-e","Stockfish/src/stockfish");
+    std::string input_path = get_arg(argc,argv,"--input","-i","-");
+    std::string output_path = get_arg(argc,argv,"--output","-o","");
+    std::string nodes = get_arg(argc,argv,"--nodes","-n","");
+    std::string limits = nodes.empty() ? "depth "+get_arg(argc,argv,"--depth","-d","12") : "nodes "+nodes;
+    std::string go = "go "+limits;
+    int count = std::stoi(get_arg(argc,argv,"--engines","-E",std::to_string(std::max(1u,std::thread::hardware_concurrency()))));
+    bool unordered = has_flag(argc,argv,"--unordered");
+    FILE* input = input_path=="-" ? stdin : fopen(input_path.c_str(),"r");
+    FILE* output = output_path.empty() ? stdout : fopen(output_path.c_str(),"w");
+    if (!input || !output){
+        std::cout<<"ERROR: cant open "<<(input ? output_path : input_path)<<"\n";
+        return 1;
+    }
+    static char output_buffer[1<<16];
+    setvbuf(output,output_buffer,_IOFBF,sizeof(output_buffer));
+    EvalCache cache;
+    std::string cache_path = get_arg(argc,argv,"--eval-cache","-ec","");
+    if (!cache_path.empty() && !cache.open(cache_path,std::stoi(get_arg(argc,argv,"--eval-cache-size","-ecs","64")))){
+        std::cout<<"ERROR: cant open eval cache "<<cache_path<<"\n";
+        return 1;
+    }
+    uint32_t limits_hash = EvalCache::limits_hash(path,limits);
+
+    std::vector<AnalysisJob> jobs(std::max(1,count));
+    EnginePoller poller;
+    for (AnalysisJob& job : jobs){
+        job.engine = start_engine(path);
+        if (!job.engine){
+            std::cout<<"ERROR: cant start chess engine\n";
+            return 1;
+        }
+        poller.add(job.engine);
+    }
+
+    std::map<uint64_t,std::string> waiting; //Results that are ahead of the output in ordered mode
+    std::deque<uint64_t> order; //Sequence numbers in input order that still need a result
+    uint64_t positions = 0;
+    //Writes a result, or keeps it until the results before it are written
+    auto emit = [&](uint64_t sequence, std::string result){
+        if (unordered){
+            fprintf(output,"%llu %s\n",(unsigned long long)sequence,result.c_str());
+            auto found = std::find(order.begin(),order.end(),sequence);
+            if (found!=order.end()){
+                order.erase(found);
+            }
+            return;
+        }
+        waiting[sequence] = std::move(result);
+        while (!order.empty() && waiting.count(order.front())){
+            fprintf(output,"%s\n",waiting[order.front()].c_str());
+            waiting.erase(order.front());
+            order.pop_front();
+        }
+    };
+
+    char* line = nullptr;
+    size_t capacity = 0;
+    uint64_t read_lines = 0;
+    bool input_done = false;
+    //Gives the engine of job the next readable position of the input
+    auto dispatch = [&](AnalysisJob& job){
+        job.fen.clear();
+        ssize_t length;
+        while (!input_done){
+            length = getline(&line,&capacity,input);
+            if (length<0){
+                input_done = true;
+                break;
+            }
+            read_lines++;
+            std::string_view text(line,size_t(length));
+            while (!text.empty() && isspace((unsigned char)text.back())){
+                text.remove_suffix(1);
+            }
+            if (text.empty() || text[0]=='#'){
+                continue;
+            }
+            job.sequence = read_lines;
+            order.push_back(read_lines);
+            if (!epd_to_fen(text,&job.fen)){
+                job.fen.clear();
+                emit(read_lines,"ERROR: cant read position "+std::string(text));
+                continue;
+            }
+            job.trace.clear();
+            if (cache.entries){
+                Position position;
+                position.set_fen(job.fen);
+                job.key = position.key;
+                uint16_t bestmove;
+                SearchInfo info;
+                if (cache.probe(job.key,limits_hash,&bestmove,&info)){
+                    char text[6] = {0};
+                    unpack_uci_move(bestmove,text);
+                    job.trace.push(info);
+                    positions++;
+                    emit(read_lines,analysis_line(job,text));
+                    job.fen.clear();
+                    continue;
+                }
+            }
+            send_message("position fen "+job.fen,job.engine);
+            send_message(go,job.engine);
+            return;
+        }
+    };
+
+    auto start_time = std::chrono::steady_clock::now();
+    for (AnalysisJob& job : jobs){
+        dispatch(job);
+    }
+    std::vector<Engine*> ready;
+    while (!order.empty()){
+        poller.wait(ready);
+        for (Engine* engine : ready){
+            AnalysisJob& job = *std::find_if(jobs.begin(),jobs.end(),[&](const AnalysisJob& j){ return j.engine==engine; });
+            std::string_view text;
+            std::string result;
+            bool finished = false;
+            while (!finished && engine->buffer.next_line(text)){
+                if (starts_with(text,"info ")){
+                    job.trace.add(text);
+                }
+                else if (starts_with(text,"bestmove")){
+                    std::string_view rest = text.substr(8);
+                    std::string_view bestmove = next_token(rest);
+                    result = analysis_line(job,bestmove);
+                    if (cache.entries && job.trace.last() && pack_uci_move(bestmove)){
+                        cache.store(job.key,limits_hash,pack_uci_move(bestmove),*job.trace.last());
+                    }
+                    finished = true;
+                }
+            }
+            if (!finished && engine->eof && job.fen.empty()){
+                //An idle engine only goes idle once the input is done, nothing is lost with it
+                poller.remove(engine);
+                stop_engine(engine);
+                job.engine = nullptr;
+                continue;
+            }
+            if (!finished && engine->eof){
+                //The engine died on this position, a new one takes its place
+                result = "ERROR: engine stopped on "+job.fen;
+                poller.remove(engine);
+                stop_engine(engine);
+                job.engine = start_engine(path);
+                if (!job.engine){
+                    std::cout<<"ERROR: cant start chess engine\n";
+                    return 1;
+                }
+                poller.add(job.engine);
+                finished = true;
+            }
+            if (!finished){
+                continue;
+            }
+            //Next position first, writing can wait
+            uint64_t sequence = job.sequence;
+            dispatch(job);
+            positions++;
+            emit(sequence,std::move(result));
+        }
+        fflush(output);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start_time).count();
+    std::cerr<<positions<<" positions in "<<seconds<<" s ("<<positions/std::max(seconds,1e-9)<<" positions/s)\n";
+    if (cache.entries){
+        std::cerr<<"Eval cache: "<<cache.hits<<" hits, "<<cache.misses<<" misses\n";
+    }
+    for (AnalysisJob& job : jobs){
+        if (job.engine){
+            stop_engine(job.engine);
+        }
+    }
+    free(line);
+    if (input!=stdin){
+        fclose(input);
+    }
+    if (output!=stdout){
+        fclose(output);
+    }
+    return 0;
+}
+
+//======= Distributed matches =======//
+/*A coordinator plays a match whose games are run by worker processes,
+usually on other machines. It keeps the openings, the score, the SPRT
+and the archive, and hands out single games. The workers play them with
+their own engines and send the games back. The protocol is lines of text
+over TCP or a Unix socket:
+worker       hello <slots> [token]          first line, games it plays at once and the coordinator's --token
+coordinator  arg <argument> ... start       the coordinator's arguments, so games follow the same rules
+coordinator  game <n> <w/b> <fen> [moves]   game n, color of engine 1, start position and book moves
+worker       result <n> <result>, stats <engine> <numbers>, moves [moves],
+             record <ply> <numbers> (one per engine move), end <termination>   a finished game
+worker       ping                           every few seconds
+coordinator  stop                           the match is over
+Workers get twice their slots of games in advance and send the results in
+batches, so with hundreds of workers the coordinator still wakes up only
+every few games per worker. A worker that disconnects or stays silent for
+WORKER_TIMEOUT seconds is dropped, its games go to the next workers first.
+A coordinator on a bare port listens on the loopback interface only. Given
+a host it is open to the network, then --token keeps out anyone who doesn't
+know the secret: a worker with another token, or one that sends anything
+before its hello, is dropped at once.*/
+
+const int WORKER_TIMEOUT = 30; //Seconds without a line before a worker counts as lost
+const int WORKER_PING = 5; //Seconds between two pings of a worker
+
+//Opens a socket for "unix:/path", "host:port" or "port": listening on it
+//(loopback only when there is no host) or connected to it. -1 on failure.
+int open_socket(const std::string& address, bool listening){
+    int fd = -1;
+    if (starts_with(address,"unix:")){
+        sockaddr_un local = {};
+        local.sun_family = AF_UNIX;
+        std::string path = address.substr(5);
+        if (path.empty() || path.size()>=sizeof(local.sun_path)){
+            return -1;
+        }
+        memcpy(local.sun_path,path.c_str(),path.size()+1);
+        fd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+        if (fd<0){
+            return -1;
+        }
+        if (listening){
+            unlink(path.c_str());
+        }
+        if (listening ? bind(fd,(sockaddr*)&local,sizeof(local))!=0 || listen(fd,128)!=0 :
+        connect(fd,(sockaddr*)&local,sizeof(local))!=0){
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    size_t colon = address.rfind(':');
+    std::string host = colon==std::string::npos ? "" : address.substr(0,colon);
+    std::string port = colon==std::string::npos ? address : address.substr(colon+1);
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found = nullptr;
+    if (getaddrinfo(host.empty() ? "127.0.0.1" : host.c_str(),port.c_str(),&hints,&found)!=0){
+        return -1;
+    }
+    for (addrinfo* entry=found;entry;entry=entry->ai_next){
+        fd = socket(entry->ai_family,entry->ai_socktype|SOCK_CLOEXEC,entry->ai_protocol);
+        if (fd<0){
+            continue;
+        }
+        int yes = 1;
+        setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(yes));
+        if (listening ? bind(fd,entry->ai_addr,entry->ai_addrlen)==0 && listen(fd,128)==0 :
+        connect(fd,entry->ai_addr,entry->ai_addrlen)==0){
+            if (!listening){
+                setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&yes,sizeof(yes));
+            }
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(found);
+    return fd;
+}
+
+//Sends all of data on a blocking socket
+bool send_all(int fd, const std::string& data){
+    size_t sent = 0;
+    while (sent<data.size()){
+        ssize_t count = send(fd,data.data()+sent,data.size()-sent,MSG_NOSIGNAL);
+        if (count<0 && errno==EINTR){
+            continue;
+        }
+        if (count<=0){
+            return false;
+        }
+        sent += count;
+    }
+    return true;
+}
+
+//Reads what a socket has into buffer, false when it is closed
+bool receive_lines(int fd, LineBuffer& buffer){
+    while (true){
+        char* target = buffer.write_ptr();
+        ssize_t count = recv(fd,target,buffer.write_space(),MSG_DONTWAIT);
+        if (count>0){
+            buffer.end += count;
+            continue;
+        }
+        return count<0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR);
+    }
+}
+
+//Adds a finished game to a result batch
+void put_result(std::string& out, Board* board, const std::string& result){
+    char line[256];
+    snprintf(line,sizeof(line),"result %d %s\n",board->game_number,result.c_str());
+    out += line;
+    for (int which=0;which<2;which++){
+        const EngineStats& stats = board->engine_stats[which];
+        snprintf(line,sizeof(line),"stats %d %d %lld %d %d %d %lld %lld %llu %lld\n",which,stats.moves,
+        (long long)stats.think_time,stats.ponder_hits,stats.ponder_misses,stats.searches,(long long)stats.depth,
+        (long long)stats.seldepth,(unsigned long long)stats.nodes,(long long)stats.search_time);
+        out += line;
+    }
+    out += "moves";
+    for (const std::string& move : board->move_history){
+        out += ' ';
+        out += move;
     }
+    out += '\n';
+    for (const MoveRecord& record : board->move_records){
+        snprintf(line,sizeof(line),"record %d %d %d %lld %d %d %d %d %d %d %llu\n",record.ply,record.side,record.move,
+        (long long)record.time,record.has_info ? 1 : 0,record.info.depth,record.info.seldepth,record.info.has_score ? 1 : 0,
+        record.info.mate ? 1 : 0,record.info.score,(unsigned long long)record.info.nodes);
+        out += line;
+    }
+    out += "end "+board->termination+"\n";
+}
+
+//A game sent to a worker
+struct Assignment{
+    int game;
+    char engine1_side;
+    Opening opening;
 };
 
-//======= Game mode functions =======//
-void HumanVSHuman(Board* board){
-    std::cout<<"Human vs Human mode selected.\n";
-    board->set_position(board->fen,stdout);
+//Game threads of a worker: play the assigned games and queue the results
+class WorkerQueue{
+    public:
+    std::mutex mutex; //Guards everything below
+    std::condition_variable changed;
+    std::deque<Assignment> games; //Assigned games not started yet
+    std::string results; //Finished games not sent yet
+    int result_count=0; //Games in results
+    int playing=0; //Games being played
+    bool stopping=false; //The coordinator ended the match or went away
+};
+
+void remote_game_worker(Board* settings, EnginePool* pool, WorkerQueue* queue, CoreScheduler* scheduler, int worker){
     while (true){
-        if (board->time_control1<=0 || board->time_control2<=0){
-            return;
+        Assignment assignment;
+        {
+            std::unique_lock<std::mutex> lock(queue->mutex);
+            queue->changed.wait(lock,[queue](){return queue->stopping || !queue->games.empty();});
+            if (queue->stopping){
+                return;
+            }
+            assignment = std::move(queue->games.front());
+            queue->games.pop_front();
+            queue->playing++;
         }
-        board->print_board();
-        std::cout << "Enter your move in algebraic notation (or 'quit' to exit): ";
-        std::string input;
-        auto start_time = std::chrono::high_resolution_clock::now();
-        std::cin>>input;
-        auto end_time = std::chrono::high_resolution_clock::now();
-        if (board->side=='w'){
-            board->time_control1 -= std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
+        Engine* engine1 = pool->acquire(0);
+        Engine* engine2 = pool->acquire(1);
+        std::string result;
+        Board board = *settings;
+        board.game_number = assignment.game;
+        board.engine1_side = assignment.engine1_side;
+        board.engine2_side = assignment.engine1_side=='w' ? 'b' : 'w';
+        if (!engine1 || !engine2){
+            logger.log(LOG_ERROR,-1,"ERROR: cant start chess engine");
+        }
+        else if (!board.set_opening(assignment.opening)){
+            logger.log(LOG_ERROR,assignment.game,"ERROR: cant play the opening of game %d",assignment.game+1);
         }
         else{
-            board->time_control2 -= std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
+            if (scheduler){
+                scheduler->pin(engine1,worker);
+                scheduler->pin(engine2,worker);
+            }
+            result = play_engine_game(&board,engine1,engine2,false);
         }
-        if (input=="quit"){
-            return;
+        pool->release(0,engine1);
+        pool->release(1,engine2);
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        queue->playing--;
+        //Games that can't be played or were stopped go back to the coordinator without a result
+        if (!result.empty() && result!="*"){
+            put_result(queue->results,&board,result);
+            queue->result_count++;
+        }
+        else if (!queue->stopping){
+            queue->stopping = true;
+            queue->changed.notify_all();
         }
-        board->do_move(input);
     }
 }
 
-void HumanVSEngine(Board* board){
-    FILE* engine = popen(board->engine1_path.c_str(),"r+");
-        if (!engine){
-            std::cout<<"ERROR: cant start chess engine";
-            return;
-        }
-        send_message("uci",engine);
-        read_response(engine);
-        send_message("isready",engine);
-        read_response(engine);
-        board->set_position(board->fen,engine);
-        if (board->player_side==board->engine1_side){
-            board->player_side='w';
-            board->engine1_side='b';
+//worker subcommand: plays games for a coordinator until it stops the match
+int RemoteWorker(int argc, char* argv[]){
+    std::string address = get_arg(argc,argv,"--connect","-C","");
+    if (address.empty()){
+        std::cout<<"ERROR: worker needs --connect host:port or unix:path\n";
+        return 1;
+    }
+    std::string token = get_arg(argc,argv,"--token","-tk","");
+    Board local;
+    parse_concurrency(argc,argv,&local);
+    int batch = std::max(1,std::stoi(get_arg(argc,argv,"--batch","-b",std::to_string(local.concurrency))));
+    int fd = open_socket(address,false);
+    if (fd<0){
+        std::cout<<"ERROR: cant connect to "<<address<<"\n";
+        return 1;
+    }
+    if (!send_all(fd,"hello "+std::to_string(local.concurrency)+(token.empty() ? "" : " "+token)+"\n")){
+        std::cout<<"ERROR: cant connect to "<<address<<"\n";
+        close(fd);
+        return 1;
+    }
+    //The coordinator's arguments set the rules, the local ones the engines and files of this machine
+    std::vector<std::string> arguments = {argv[0]};
+    LineBuffer buffer;
+    std::string_view line;
+    bool started = false;
+    while (!started){
+        pollfd wait = {fd,POLLIN,0};
+        if (poll(&wait,1,WORKER_TIMEOUT*1000)<=0 || !receive_lines(fd,buffer)){
+            std::cout<<"ERROR: no match from "<<address<<"\n";
+            close(fd);
+            return 1;
         }
-        while (true){
-            if (board->half_move_counter>=50){
-            return;
+        while (buffer.next_line(line)){
+            if (starts_with(line,"arg ")){
+                arguments.emplace_back(line.substr(4));
             }
-            if (board->time_control1<=0){
-                return;
+            else if (line=="start"){
+                started = true;
+                break;
             }
-            board->print_board();
-            if (board->player_side == board->side){
-                std::cout << "Enter your move in algebraic notation (or 'quit' to exit): ";
-                std::string input;
-                auto start_time = std::chrono::high_resolution_clock::now();
-                std::cin>>input;
-                auto end_time = std::chrono::high_resolution_clock::now();
-                board->time_control1 -= std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
-                if (input=="quit"){
-                    return;
+        }
+    }
+    std::vector<char*> coordinator_argv;
+    for (std::string& argument : arguments){
+        coordinator_argv.push_back(argument.data());
+    }
+    Board settings;
+    if (!arg_to_board(coordinator_argv.size(),coordinator_argv.data(),&settings)){
+        close(fd);
+        return 1;
+    }
+    settings.concurrency = local.concurrency;
+    settings.cache_path.clear();
+    settings.archive.clear();
+    settings.info_log.clear();
+    settings.openings.clear();
+    settings.server_port = 0;
+    settings.log_dir.clear();
+    settings.pin = false;
+    settings.engine_options[0].clear();
+    settings.engine_options[1].clear();
+    parse_engine1_path(argc,argv,&settings);
+    parse_engine2_path(argc,argv,&settings);
+    parse_engine_options(argc,argv,&settings);
+    parse_pin(argc,argv,&settings);
+    parse_eval_cache(argc,argv,&settings);
+    settings.tb_path = get_arg(argc,argv,"--tb-path","-tb",settings.tb_path);
+    if (!parse_logging(argc,argv,&settings)){
+        close(fd);
+        return 1;
+    }
+    settings.headless = true;
+    if (!logger.start(settings.log_level,settings.log_dir)){
+        std::cout<<"ERROR: cant create log directory "<<settings.log_dir<<"\n";
+        close(fd);
+        return 1;
+    }
+    CoreScheduler scheduler;
+    if (!plan_cores(&settings,settings.concurrency,&scheduler) || !open_eval_cache(&settings)){
+        close(fd);
+        return 1;
+    }
+    std::cout<<"Worker playing "<<settings.concurrency<<" games at a time for "<<address<<"\n";
+    MatchControl control;
+    settings.control = &control;
+    EnginePool pool(&settings);
+    WorkerQueue queue;
+    std::vector<std::thread> threads;
+    for (int i=0;i<settings.concurrency;i++){
+        threads.emplace_back(remote_game_worker,&settings,&pool,&queue,settings.pin ? &scheduler : nullptr,i);
+    }
+    auto last_send = std::chrono::steady_clock::now();
+    int played = 0;
+    bool connected = true;
+    while (connected){
+        pollfd wait = {fd,POLLIN,0};
+        poll(&wait,1,200);
+        if (wait.revents){
+            connected = receive_lines(fd,buffer);
+        }
+        {
+            //Games may have come in with the arguments, so the buffer is read every time
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            while (buffer.next_line(line)){
+                std::string_view rest = line;
+                std::string_view command = next_token(rest);
+                if (command=="stop"){
+                    connected = false;
+                    break;
                 }
-                board->do_move(input);
+                Assignment assignment;
+                bool numbered = parse_number(next_token(rest),assignment.game);
+                std::string_view side = next_token(rest);
+                if (command!="game" || !numbered || side.empty()){
+                    continue;
+                }
+                assignment.engine1_side = side[0];
+                std::string_view fen_fields = rest;
+                for (int field=0;field<6;field++){
+                    next_token(rest);
+                }
+                assignment.opening.fen = std::string(fen_fields.substr(0,fen_fields.size()-rest.size()));
+                assignment.opening.fen.erase(0,assignment.opening.fen.find_first_not_of(' '));
+                for (std::string_view move=next_token(rest);!move.empty();move=next_token(rest)){
+                    assignment.opening.moves.emplace_back(move);
+                }
+                queue.games.push_back(std::move(assignment));
+                queue.changed.notify_one();
             }
-            else if (board->engine1_side == board->side){
-                send_message("position fen "+ board->get_uci_line(),engine);
-                send_message("go depth "+ std::to_string(board->engine1_depth),engine);
-                std::string move = read_response(engine);
-                if (move == "bestmove (none)\n"){
-                    std::cout<<"Engine 1 has no legal moves. Game over.\n";
-                    return;
-                }                
-                std::cout<<"Engine 1 plays: "+move+"\n";
-                board->do_move(move.substr(9,4));
-                std::cout << board->get_uci_line() << "\n";
+        }
+        std::string batch_text;
+        bool ping = false;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.stopping){
+                connected = false;
+            }
+            auto now = std::chrono::steady_clock::now();
+            bool idle = queue.games.empty() && queue.playing==0;
+            if (queue.result_count>=batch || (queue.result_count>0 && (idle || !connected ||
+            now-last_send>=std::chrono::seconds(1)))){
+                batch_text.swap(queue.results);
+                played += queue.result_count;
+                queue.result_count = 0;
+            }
+            ping = batch_text.empty() && now-last_send>=std::chrono::seconds(WORKER_PING);
+        }
+        if (ping){
+            batch_text = "ping\n";
+        }
+        if (!batch_text.empty()){
+            if (!send_all(fd,batch_text)){
+                connected = false;
             }
+            last_send = std::chrono::steady_clock::now();
         }
+    }
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.stopping = true;
+        queue.changed.notify_all();
+    }
+    control.abort();
+    for (std::thread& thread : threads){
+        thread.join();
+    }
+    close(fd);
+    pool.shutdown();
+    close_eval_cache(&settings);
+    std::cout<<"Worker done: "<<played<<" games sent\n";
+    return 0;
 }
 
-void EngineVSEngine(Board* board){
-    FILE* engine1 = popen(board->engine1_path.c_str(),"r+");
-        if (!engine1){
-            std::cout<<"ERROR: cant start chess engine";
+//Coordinator side of a worker connection
+struct WorkerLink{
+    int fd;
+    std::string name; //Address, for messages
+    LineBuffer input{1<<14};
+    std::string output; //Not sent yet
+    int slots=0; //0 until hello
+    std::vector<int> games; //Games sent and not finished
+    std::chrono::steady_clock::time_point last_seen;
+    //The result being read
+    int game=-1;
+    std::string result;
+    EngineStats stats[2];
+    std::vector<std::string> moves;
+    std::vector<MoveRecord> records;
+};
+
+//Plays a match with remote workers, the board has the match settings
+void Coordinator(Board* board, int argc, char* argv[]){
+    std::cout<<"Match of "<<board->games<<" games on remote workers, coordinator at "<<board->coordinator<<"\n";
+    if (!board->set_position(board->fen,nullptr)){
+        return;
+    }
+    OpeningBook book;
+    if (!board->openings.empty()){
+        if (!book.open(board->openings,board->random_openings,board->seed,board->opening_plies)){
+            std::cout<<"ERROR: cant open "<<board->openings<<"\n";
             return;
         }
-    FILE* engine2 = popen(board->engine2_path.c_str(),"r+");
-        if (!engine2){
-            std::cout<<"ERROR: cant start chess engine";
+        std::cout<<"Openings from "<<board->openings<<(board->random_openings ?
+        ", random order, seed "+std::to_string(board->seed) : ", file order")<<"\n";
+    }
+    GameArchive archive;
+    if (!board->archive.empty() && !archive.open(board->archive)){
+        std::cout<<"ERROR: cant open "<<board->archive<<"\n";
+        return;
+    }
+    bool network = !starts_with(board->coordinator,"unix:") && board->coordinator.find(':')!=std::string::npos;
+    if (network && board->token.empty()){
+        std::cout<<"ERROR: --coordinator with a host needs --token\n";
+        return;
+    }
+    int listen_fd = open_socket(board->coordinator,true);
+    if (listen_fd<0){
+        std::cout<<"ERROR: cant listen on "<<board->coordinator<<"\n";
+        return;
+    }
+    fcntl(listen_fd,F_SETFL,fcntl(listen_fd,F_GETFL)|O_NONBLOCK);
+    std::string hello_reply;
+    for (int i=1;i<argc;i++){
+        std::string argument = argv[i];
+        //The workers don't need the secret
+        if ((argument=="--token" || argument=="-tk") && i+1<argc){
+            i++;
+            continue;
+        }
+        hello_reply += "arg "+argument+"\n";
+    }
+    hello_reply += "start\n";
+    ScoreTable table;
+    table.sprt = board->sprt;
+    MatchControl control;
+    control.games = board->games;
+    std::vector<LiveGame> live;
+    MatchServer server;
+    if (board->server_port){
+        if (!server.start(board->server_port,&table,&control,&live)){
+            std::cout<<"ERROR: cant listen on port "<<board->server_port<<"\n";
+            close(listen_fd);
             return;
         }
-        send_message("uci",engine1);
-        read_response(engine1);
-        send_message("isready",engine1);
-        read_response(engine1);
-        send_message("uci",engine2);
-        read_response(engine2);
-        send_message("isready",engine2);
-        read_response(engine2);
+        std::cout<<"Match server on http://127.0.0.1:"<<board->server_port<<"/\n";
+    }
+    std::vector<WorkerLink*> workers;
+    std::deque<int> retry; //Games of lost workers, handed out before new ones
+    std::map<int,Assignment> assigned; //Games out at workers, with their opening
+    std::vector<bool> finished;
+    int reassigned = 0;
+    auto start_time = std::chrono::steady_clock::now();
+    std::vector<pollfd> fds;
+    auto drop = [&](size_t index, const char* why){
+        WorkerLink* link = workers[index];
+        logger.log(LOG_WARN,-1,"Worker %s %s, %zu games go to other workers",link->name.c_str(),why,link->games.size());
+        for (int game : link->games){
+            retry.push_back(game);
+            reassigned++;
+        }
+        close(link->fd);
+        delete link;
+        workers.erase(workers.begin()+index);
+    };
     while (true){
-        
-        if (board->half_move_counter>=50){
-            return;
+        bool over = table.stopped || control.aborted;
+        if (!over && retry.empty() && assigned.empty() && control.next_game>=control.games){
+            over = true;
         }
-            board->print_board();
-            if (board->side==board->engine1_side){
-                send_message("position fen "+ board->get_uci_line(),engine1);
-                send_message("go depth "+ std::to_string(board->engine1_depth),engine1);
-                std::string move = read_response(engine1);
-                if (move == "bestmove (none)\n"){
-                    std::cout<<"Engine 1 has no legal moves. Game over.\n";
-                    return;
+        if (over){
+            break;
+        }
+        //Hand out games up to twice the slots of every worker
+        for (WorkerLink* link : workers){
+            while (link->slots>0 && int(link->games.size())<2*link->slots && !control.paused){
+                int game;
+                if (!retry.empty()){
+                    game = retry.front();
+                    retry.pop_front();
                 }
-                std::cout<<"Engine 1 plays: "+move+"\n";
-                board->do_move(move.substr(9,4));
-                std::cout << board->get_uci_line() << "\n";
-                continue;
+                else if (!control.take_game(&game)){
+                    break;
+                }
+                auto entry = assigned.find(game);
+                if (entry==assigned.end()){
+                    Assignment assignment;
+                    assignment.game = game;
+                    //Engines swap colors every game
+                    assignment.engine1_side = game%2==1 ? board->engine2_side : board->engine1_side;
+                    if (book.file.size>0){
+                        if (!book.get(game,&assignment.opening)){
+                            logger.log(LOG_ERROR,-1,"ERROR: cant read an opening from %s",board->openings.c_str());
+                            control.abort();
+                            break;
+                        }
+                    }
+                    else{
+                        assignment.opening.fen = board->position.get_fen();
+                    }
+                    entry = assigned.emplace(game,std::move(assignment)).first;
+                }
+                const Assignment& assignment = entry->second;
+                link->output += "game "+std::to_string(game)+" "+assignment.engine1_side+" "+assignment.opening.fen;
+                for (const std::string& move : assignment.opening.moves){
+                    link->output += " "+move;
+                }
+                link->output += "\n";
+                link->games.push_back(game);
             }
-            else{
-                send_message("position fen "+ board->get_uci_line(),engine2);
-                send_message("go depth "+ std::to_string(board->engine2_depth),engine2);
-                std::string move = read_response(engine2);
-                if (move == "bestmove (none)\n"){
-                    std::cout<<"Engine 2 has no legal moves. Game over.\n";
-                    return;
-                }
-                std::cout<<"Engine 2 plays: "+move+"\n";
-                board->do_move(move.substr(9,4));
-                std::cout << board->get_uci_line() << "\n";
-                continue;
+        }
+        fds.assign(1,{listen_fd,POLLIN,0});
+        for (WorkerLink* link : workers){
+            fds.push_back({link->fd,short(POLLIN|(link->output.empty() ? 0 : POLLOUT)),0});
+        }
+        poll(fds.data(),fds.size(),200);
+        auto now = std::chrono::steady_clock::now();
+        for (size_t i=workers.size();i-->0;){
+            WorkerLink* link = workers[i];
+            short events = fds[i+1].revents;
+            bool alive = true;
+            const char* why = "disconnected";
+            if (events&(POLLIN|POLLHUP|POLLERR)){
+                alive = receive_lines(link->fd,link->input);
+                std::string_view line;
+                while (link->input.next_line(line)){
+                    link->last_seen = now;
+                    std::string_view rest = line;
+                    std::string_view command = next_token(rest);
+                    if (command=="hello" && link->slots==0){
+                        parse_number(next_token(rest),link->slots);
+                        if (next_token(rest)!=board->token){
+                            link->slots = 0;
+                            alive = false;
+                            why = "sent a wrong token";
+                            break;
+                        }
+                        link->slots = std::max(link->slots,1);
+                        link->output += hello_reply;
+                        logger.log(LOG_INFO,-1,"Worker %s joined with %d slots",link->name.c_str(),link->slots);
+                    }
+                    else if (link->slots==0){
+                        alive = false;
+                        why = "didnt say hello";
+                        break;
+                    }
+                    else if (command=="result"){
+                        link->game = -1;
+                        parse_number(next_token(rest),link->game);
+                        link->result = std::string(next_token(rest));
+                        link->stats[0] = link->stats[1] = EngineStats();
+                        link->moves.clear();
+                        link->records.clear();
+                    }
+                    else if (command=="stats"){
+                        int which = 0;
+                        parse_number(next_token(rest),which);
+                        EngineStats& stats = link->stats[which&1];
+                        parse_number(next_token(rest),stats.moves);
+                        parse_number(next_token(rest),stats.think_time);
+                        parse_number(next_token(rest),stats.ponder_hits);
+                        parse_number(next_token(rest),stats.ponder_misses);
+                        parse_number(next_token(rest),stats.searches);
+                        parse_number(next_token(rest),stats.depth);
+                        parse_number(next_token(rest),stats.seldepth);
+                        parse_number(next_token(rest),stats.nodes);
+                        parse_number(next_token(rest),stats.search_time);
+                    }
+                    else if (command=="moves"){
+                        for (std::string_view move=next_token(rest);!move.empty();move=next_token(rest)){
+                            link->moves.emplace_back(move);
+                        }
+                    }
+                    else if (command=="record"){
+                        MoveRecord record = {};
+                        int has_info = 0;
+                        int has_score = 0;
+                        int mate = 0;
+                        parse_number(next_token(rest),record.ply);
+                        parse_number(next_token(rest),record.side);
+                        parse_number(next_token(rest),record.move);
+                        parse_number(next_token(rest),record.time);
+                        parse_number(next_token(rest),has_info);
+                        parse_number(next_token(rest),record.info.depth);
+                        parse_number(next_token(rest),record.info.seldepth);
+                        parse_number(next_token(rest),has_score);
+                        parse_number(next_token(rest),mate);
+                        parse_number(next_token(rest),record.info.score);
+                        parse_number(next_token(rest),record.info.nodes);
+                        record.has_info = has_info;
+                        record.info.has_score = has_score;
+                        record.info.mate = mate;
+                        link->records.push_back(record);
+                    }
+                    else if (command=="end"){
+                        int game = link->game;
+                        auto mine = std::find(link->games.begin(),link->games.end(),game);
+                        auto entry = assigned.find(game);
+                        if (mine==link->games.end() || entry==assigned.end() || (game<int(finished.size()) && finished[game])){
+                            continue;
+                        }
+                        link->games.erase(mine);
+                        if (finished.size()<=size_t(game)){
+                            finished.resize(game+1,false);
+                        }
+                        finished[game] = true;
+                        char engine1_side = entry->second.engine1_side;
+                        if (!board->archive.empty()){
+                            //The moves are played again from the start, they include the book moves
+                            Board played = *board;
+                            played.game_number = game;
+                            played.engine1_side = engine1_side;
+                            Opening replay;
+                            replay.fen = entry->second.opening.fen;
+                            replay.moves = link->moves;
+                            bool legal = played.set_opening(replay);
+                            played.move_records = link->records;
+                            played.engine_stats[0] = link->stats[0];
+                            played.engine_stats[1] = link->stats[1];
+                            played.termination = std::string(rest.substr(std::min(rest.find_first_not_of(' '),rest.size())));
+                            if (legal){
+                                archive_game(&archive,&played,link->result);
+                            }
+                        }
+                        table.add_result(game,link->result,engine1_side,link->stats);
+                        assigned.erase(entry);
+                    }
+                }
+            }
+            if (alive && (events&POLLOUT) && !link->output.empty()){
+                ssize_t count = send(link->fd,link->output.data(),link->output.size(),MSG_NOSIGNAL|MSG_DONTWAIT);
+                if (count>0){
+                    link->output.erase(0,count);
+                }
+                else if (count<0 && errno!=EAGAIN && errno!=EWOULDBLOCK){
+                    alive = false;
+                }
+            }
+            if (!alive){
+                drop(i,why);
+            }
+            else if (now-link->last_seen>std::chrono::seconds(WORKER_TIMEOUT)){
+                drop(i,"timed out");
             }
         }
+        if (fds[0].revents&POLLIN){
+            sockaddr_storage peer;
+            socklen_t length = sizeof(peer);
+            int fd;
+            while ((fd = accept4(listen_fd,(sockaddr*)&peer,&length,SOCK_CLOEXEC))>=0){
+                WorkerLink* link = new WorkerLink();
+                link->fd = fd;
+                char host[NI_MAXHOST] = "local";
+                char port[NI_MAXSERV] = "";
+                if (peer.ss_family!=AF_UNIX){
+                    getnameinfo((sockaddr*)&peer,length,host,sizeof(host),port,sizeof(port),NI_NUMERICHOST|NI_NUMERICSERV);
+                }
+                link->name = std::string(host)+(port[0] ? ":"+std::string(port) : "#"+std::to_string(fd));
+                link->last_seen = std::chrono::steady_clock::now();
+                workers.push_back(link);
+                length = sizeof(peer);
+            }
+        }
+    }
+    auto end_time = std::chrono::steady_clock::now();
+    //Workers that are still there are told to stop, the games they play don't count
+    for (WorkerLink* link : workers){
+        link->output += "stop\n";
+        fcntl(link->fd,F_SETFL,fcntl(link->fd,F_GETFL)&~O_NONBLOCK);
+        send_all(link->fd,link->output);
+        close(link->fd);
+        delete link;
+    }
+    close(listen_fd);
+    if (starts_with(board->coordinator,"unix:")){
+        unlink(board->coordinator.substr(5).c_str());
+    }
+    server.stop();
+    logger.flush();
+    if (control.aborted){
+        std::cout<<"Match aborted, running games are not counted.\n";
+    }
+    table.print(std::chrono::duration<double>(end_time - start_time).count());
+    std::cout<<"Games given to another worker after a worker was lost: "<<reassigned<<"\n";
 }
 
-//======= Argument parsing functions =======//
-bool parse_game_mode(int argc, char* argv[],Board* board){
-    for (int i=0;i<argc;i++){
-        std::string arg=argv[i];
-        if ((arg=="--game-mode" || arg == "-gm") && i+1<argc){
-            board->game_mode=argv[i+1];
+//======= Bench mode =======//
+/*Measures what the harness itself costs. Games are played against the
+stub engine (the chess-stub target, this file built with
+CHESS_STUB_ENGINE), which answers every go at once, so nearly all of
+the time per ply is harness work and pipe latency. The games are played
+once quietly and once printing every board, which shows what the board
+output of eve mode costs. Allocations are only counted in the
+chess-bench build (CHESS_BENCH), and syscalls come from /proc/self/io.*/
+
+//Read and write syscalls of this process so far, 0 where /proc isn't there
+uint64_t io_syscalls(){
+    std::ifstream file("/proc/self/io");
+    std::string name;
+    uint64_t value, total = 0;
+    while (file>>name>>value){
+        if (name=="syscr:" || name=="syscw:"){
+            total += value;
         }
     }
-    return 0;
+    return total;
 }
 
-bool parse_engine1_path(int argc, char* argv[],Board* board){
-    for (int i=0;i<argc;i++){
-        std::string arg=argv[i];
-        if ((arg=="--engine1-path" || arg == "-ep1") && i+1<argc){
-            board->engine1_path=argv[i+1];
+//Positions for the FEN bench: random games from the perft suite positions
+std::vector<std::string> bench_positions(size_t count){
+    std::vector<std::string> fens;
+    fens.reserve(count);
+    uint64_t state = 2024;
+    Position position;
+    while (fens.size()<count){
+        position.set_fen(perft_suite[ZobristKeys::next(state)%(sizeof(perft_suite)/sizeof(perft_suite[0]))].fen);
+        for (int ply=0;ply<200 && fens.size()<count;ply++){
+            MoveList moves;
+            position.generate_legal(moves);
+            if (!moves.size){
+                break;
+            }
+            Position::Undo undo;
+            position.make_move(moves.moves[ZobristKeys::next(state)%moves.size],undo);
+            fens.push_back(position.get_fen());
         }
     }
-    return 0;
+    return fens;
 }
 
-bool parse_engine2_path(int argc, char* argv[],Board* board){
-    for (int i=0;i<argc;i++){
-        std::string arg=argv[i];
-        if ((arg=="--engine2-path" || arg == "-ep2") && i+1<argc){
-            board->engine2_path=argv[i+1];
-        }
+//bench --fen: how fast FENs are read and written, and how fast a suite
+//is read compared to only cutting it into lines
+int FenBench(int argc, char* argv[]){
+    std::string input = get_arg(argc,argv,"--input","-i","");
+    size_t count = std::stoull(get_arg(argc,argv,"--positions","-P","100000"));
+    std::vector<std::string> fens = bench_positions(count);
+    std::vector<Position> positions(fens.size());
+    char text[Position::FEN_SIZE];
+    size_t checksum = 0;
+#ifdef CHESS_BENCH
+    uint64_t allocations = allocation_count;
+#endif
+    auto start_time = std::chrono::steady_clock::now();
+    for (size_t i=0;i<fens.size();i++){
+        checksum += positions[i].set_fen(fens[i]);
     }
+    double parse_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start_time).count();
+    start_time = std::chrono::steady_clock::now();
+    for (const Position& position : positions){
+        checksum += position.write_fen(text);
+    }
+    double write_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start_time).count();
+#ifdef CHESS_BENCH
+    allocations = allocation_count-allocations;
+#endif
+    std::cout<<"FEN bench: "<<fens.size()<<" positions (checksum "<<checksum<<")\n";
+    std::cout<<"Read: "<<fens.size()/parse_seconds<<" positions/s ("<<parse_seconds*1e9/fens.size()<<" ns each)\n";
+    std::cout<<"Write: "<<fens.size()/write_seconds<<" positions/s ("<<write_seconds*1e9/fens.size()<<" ns each)\n";
+#ifdef CHESS_BENCH
+    std::cout<<"Allocations: "<<allocations<<"\n";
+#else
+    std::cout<<"Allocations: not counted (build the chess-bench target)\n";
+#endif
+    if (input.empty()){
+        return 0;
+    }
+    MappedFile file;
+    if (!file.open(input,MADV_SEQUENTIAL)){
+        std::cout<<"ERROR: cant open "<<input<<"\n";
+        return 1;
+    }
+    //Cutting the lines alone is what the suite costs without reading positions
+    size_t lines = 0;
+    start_time = std::chrono::steady_clock::now();
+    for (size_t begin=0;begin<file.size;){
+        const char* newline = (const char*)memchr(file.data+begin,'\n',file.size-begin);
+        size_t end = newline ? newline-file.data : file.size;
+        lines += end>begin;
+        begin = end+1;
+    }
+    double scan_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start_time).count();
+    size_t valid = 0;
+    Position position;
+    start_time = std::chrono::steady_clock::now();
+    for (size_t begin=0;begin<file.size;){
+        const char* newline = (const char*)memchr(file.data+begin,'\n',file.size-begin);
+        size_t end = newline ? newline-file.data : file.size;
+        valid += end>begin && position.set_epd(std::string_view(file.data+begin,end-begin));
+        begin = end+1;
+    }
+    double suite_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start_time).count();
+    std::cout<<input<<": "<<valid<<" of "<<lines<<" lines are positions, read in "<<suite_seconds<<" s ("<<
+    file.size/1e6/suite_seconds<<" MB/s, cutting lines alone "<<file.size/1e6/scan_seconds<<" MB/s)\n";
     return 0;
 }
 
-bool parse_engine1_depth(int argc, char* argv[],Board* board){
-    for (int i=0;i<argc;i++){
-        std::string arg=argv[i];
-        if ((arg=="--engine1-depth" || arg == "-ed1") && i+1<argc){
-            board->engine1_depth=std::stoi(argv[i+1]);
-            return 1;
+//What one pass of bench games cost
+struct BenchRun{
+    double seconds=0;
+    std::vector<int64_t> ply_times; //Microseconds per ply
+    uint64_t syscalls=0;
+    uint64_t allocations=0;
+};
+
+//Plays the games of one pass, verbose ones print the board every ply like eve mode.
+//Their output goes to /dev/null, so the cost of formatting and writing it is measured but not the terminal.
+bool bench_games(Board* board, EnginePool* pool, bool verbose, BenchRun* run){
+    run->ply_times.reserve(size_t(board->games)*200);
+    board->ply_times = &run->ply_times;
+    int saved_stdout = -1;
+    if (verbose){
+        std::cout.flush();
+        fflush(stdout);
+        int null = open("/dev/null",O_WRONLY|O_CLOEXEC);
+        saved_stdout = dup(1);
+        if (null>=0){
+            dup2(null,1);
+            close(null);
         }
-        else{
-            board->engine1_depth=1;
+    }
+    uint64_t syscalls = io_syscalls();
+#ifdef CHESS_BENCH
+    uint64_t allocations = allocation_count;
+#endif
+    auto start_time = std::chrono::steady_clock::now();
+    bool started = true;
+    for (int game=0;game<board->games && started;game++){
+        Engine* engine1 = pool->acquire(0);
+        Engine* engine2 = pool->acquire(1);
+        started = engine1 && engine2;
+        if (started){
+            board->game_number = game;
+            board->set_position(board->fen,nullptr);
+            play_engine_game(board,engine1,engine2,verbose);
         }
+        pool->release(0,engine1);
+        pool->release(1,engine2);
+    }
+    if (verbose){
+        std::cout.flush();
+        fflush(stdout);
+    }
+    run->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start_time).count();
+    run->syscalls = io_syscalls()-syscalls;
+#ifdef CHESS_BENCH
+    run->allocations = allocation_count-allocations;
+#endif
+    if (saved_stdout>=0){
+        dup2(saved_stdout,1);
+        close(saved_stdout);
+    }
+    board->ply_times = nullptr;
+    return started;
+}
 
+void print_bench_run(const char* name, int games, BenchRun& run){
+    size_t moves = std::max<size_t>(run.ply_times.size(),1);
+    std::sort(run.ply_times.begin(),run.ply_times.end());
+    auto percentile = [&](double p){
+        return run.ply_times.empty() ? 0.0 : run.ply_times[std::min(run.ply_times.size()-1,size_t(p*run.ply_times.size()))]/1000.0;
+    };
+    std::cout<<name<<": "<<games<<" games, "<<run.ply_times.size()<<" moves in "<<run.seconds<<" s ("<<
+    games/run.seconds<<" games/s, "<<run.ply_times.size()/run.seconds<<" moves/s)\n";
+    std::cout<<"  Ply latency (us): p50 "<<percentile(0.5)<<", p90 "<<percentile(0.9)<<", p99 "<<percentile(0.99)<<
+    ", max "<<percentile(1.0)<<"\n";
+    std::cout<<"  Read/write syscalls per move: "<<double(run.syscalls)/moves<<"\n";
+#ifdef CHESS_BENCH
+    std::cout<<"  Allocations per move: "<<double(run.allocations)/moves<<"\n";
+#else
+    std::cout<<"  Allocations per move: not counted (build the chess-bench target)\n";
+#endif
+}
+
+//Checks that waiting for a bestmove gives up on time while the engine keeps
+//sending info lines, with and without a trace. Returns 1 if it doesn't.
+int TimeoutCheck(const std::string& stub){
+    Engine* engine = start_engine(stub);
+    if (!engine){
+        std::cout<<"ERROR: cant start "<<stub<<"\n";
+        return 1;
     }
-    return 0;
+    bool failed = false;
+    InfoTrace trace;
+    for (InfoTrace* used : {(InfoTrace*)nullptr,&trace}){
+        send_message("go infinite",engine);
+        auto start_time = std::chrono::steady_clock::now();
+        std::string reply = read_response(engine,200,used);
+        double ms = std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now()-start_time).count();
+        bool ok = reply.empty() && ms<1000;
+        std::cout<<"Timeout of 200 ms "<<(used ? "with" : "without")<<" a trace: "<<(ok ? "OK" : "FAILED")<<
+        " after "<<ms<<" ms\n";
+        failed = failed || !ok;
+        send_message("stop",engine);
+        read_response(engine,1000);
+    }
+    stop_engine(engine);
+    return failed ? 1 : 0;
 }
 
-bool parse_engine2_depth(int argc, char* argv[],Board* board){
-    for (int i=0;i<argc;i++){
-        std::string arg=argv[i];
-        if ((arg=="--engine2-depth" || arg == "-ed2") && i+1<argc){
-            board->engine2_depth=std::stoi(argv[i+1]);
-            return 1;
-        }
-        else{
-            board->engine2_depth=1;
-        }
+//bench [--stub path] [--games N] [--fen] [--timeouts]
+int Bench(int argc, char* argv[]){
+    if (has_flag(argc,argv,"--fen")){
+        return FenBench(argc,argv);
+    }
+    std::string self = argv[0];
+    std::string stub = get_arg(argc,argv,"--stub","-s",
+    self.substr(0,self.rfind('/')==std::string::npos ? 0 : self.rfind('/')+1)+"chess-stub");
+    if (has_flag(argc,argv,"--timeouts")){
+        return TimeoutCheck(stub);
+    }
+    //Only the harness is measured, the end of every game isn't logged
+    logger.level = LOG_WARN;
+    Board board;
+    board.engine1_path = stub;
+    board.engine2_path = stub;
+    board.games = std::stoi(get_arg(argc,argv,"--games","-g","100"));
+    EnginePool pool(&board);
+    //The same games are played twice: as in a headless match and printing every board
+    BenchRun quiet, printed;
+    if (!bench_games(&board,&pool,false,&quiet) || !bench_games(&board,&pool,true,&printed)){
+        std::cout<<"ERROR: cant start "<<stub<<"\n";
+        return 1;
     }
+    pool.shutdown();
+    print_bench_run("Bench (headless)",board.games,quiet);
+    print_bench_run("Bench (printing boards)",board.games,printed);
     return 0;
 }
 
-bool parse_sides(int argc, char* argv[],Board* board){
-    for (int i=0;i<argc;i++){
-        std::string arg=argv[i];
-        if ((arg=="--player-side" || arg=="-ps") && i+1<argc){
-            if (argv[i+1][0]=='w'){
-                board->player_side='w';
-                board->engine1_side='b';
+//======= Stub engine =======//
+/*A UCI engine that answers at once, for the bench. It plays a legal
+move picked by the position key, so every run plays the same games. A
+position command that extends the previous one only costs the new
+moves. go infinite sends info lines until stop, for the timeout check.*/
+
+int StubEngine(){
+    Position position;
+    std::string last_command;
+    char line[1<<16];
+    while (fgets(line,sizeof(line),stdin)){
+        std::string_view command(line);
+        while (!command.empty() && isspace((unsigned char)command.back())){
+            command.remove_suffix(1);
+        }
+        std::string_view rest = command;
+        std::string_view word = next_token(rest);
+        if (word=="uci"){
+            fputs("id name chess-stub\nuciok\n",stdout);
+        }
+        else if (word=="isready"){
+            fputs("readyok\n",stdout);
+        }
+        else if (word=="position"){
+            std::string_view moves;
+            if (!last_command.empty() && starts_with(command,last_command) &&
+            (command.size()==last_command.size() || command[last_command.size()]==' ')){
+                moves = command.substr(last_command.size());
             }
             else{
-                board->player_side='b';
-                board->engine1_side='w';
+                size_t at = rest.find(" moves");
+                std::string_view setup = rest.substr(0,at);
+                std::string_view kind = next_token(setup);
+                while (!setup.empty() && setup[0]==' '){
+                    setup.remove_prefix(1);
+                }
+                position.set_fen(kind=="fen" ? setup : "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+                moves = at==std::string_view::npos ? std::string_view() : rest.substr(at+6);
             }
-            return 1;
+            for (std::string_view move=next_token(moves);!move.empty();move=next_token(moves)){
+                if (move!="moves"){
+                    position.do_move(position.parse_uci_move(move));
+                }
+            }
+            last_command = std::string(command);
         }
-        else if((arg=="--engine1-side" || arg=="-es1") && i+1<argc){
-            if (argv[i+1][0]=='w'){
-                board->engine1_side='w';
-                board->engine2_side='b';
+        else if (word=="go" && rest.find("infinite")!=std::string_view::npos){
+            //Keeps sending info until stop, like a real engine in an endless search
+            pollfd input = {0,POLLIN,0};
+            while (true){
+                fputs("info depth 1 score cp 0 nodes 1\n",stdout);
+                fflush(stdout);
+                if (poll(&input,1,10)>0){
+                    if (!fgets(line,sizeof(line),stdin) || starts_with(line,"stop") || starts_with(line,"quit")){
+                        break;
+                    }
+                }
+            }
+            fputs("bestmove 0000\n",stdout);
+        }
+        else if (word=="go"){
+            MoveList moves;
+            position.generate_legal(moves);
+            if (moves.size==0){
+                fputs("info depth 1 score cp 0\nbestmove (none)\n",stdout);
             }
             else{
-                board->engine1_side='b';
-                board->engine2_side='w';
+                std::string move = Position::move_to_uci(moves.moves[position.key%moves.size]);
+                fprintf(stdout,"info depth 1 seldepth 1 score cp 0 nodes 1 pv %s\nbestmove %s\n",move.c_str(),move.c_str());
             }
-            return 1;
         }
+        else if (word=="quit"){
+            break;
+        }
+        fflush(stdout);
     }
     return 0;
 }
 
-bool parse_position(int argc, char* argv[],Board* board){
-    for (int i=0;i<argc;i++){
-        std::string arg = argv[i];
-        if ((arg=="--position" || arg=="-p") && i+1<argc){
-            board->fen = argv[i+1];
-            return 1;
+#ifdef CHESS_FUZZ
+//======= FEN fuzz target =======//
+/*Built by the chess-fuzz target (cmake -DCHESS_FUZZ=ON). With Clang it
+is a libFuzzer target. Other compilers get a driver that replays the
+files given on the command line, or without any mutates the perft suite
+positions, under the address and undefined behavior sanitizers.*/
+
+//Reads the input as a FEN and as an EPD line. A position that is read
+//must be written back and read again to the same position and text.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size){
+    std::string_view text((const char*)data,size);
+    for (bool epd : {false,true}){
+        Position position;
+        if (!(epd ? position.set_epd(text) : position.set_fen(text))){
+            continue;
         }
+        char fen[Position::FEN_SIZE];
+        size_t length = position.write_fen(fen);
+        Position again;
+        char second[Position::FEN_SIZE];
+        if (length>=Position::FEN_SIZE || !again.set_fen(std::string_view(fen,length)) || again.key!=position.key ||
+        again.write_fen(second)!=length || memcmp(fen,second,length)!=0){
+            fprintf(stderr,"FEN round trip failed: %.*s -> %s\n",int(size),(const char*)data,fen);
+            abort();
+        }
+        MoveList moves;
+        position.generate_legal(moves);
     }
     return 0;
 }
 
-bool parse_time_control(int argc, char* argv[],Board* board){
-    for (int i;i<argc;i++){
-        std::string arg=argv[i];
-        if ((arg=="--time-control" || arg=="-tc") && i+1<argc){
-            board->time_control1=std::stoi(argv[i+1])*1000;
-            board->time_control2=std::stoi(argv[i+1])*1000;
+#ifndef CHESS_LIBFUZZER
+int FuzzReplay(int argc, char* argv[]){
+    size_t inputs = 0;
+    for (int i=1;i<argc;i++){
+        std::ifstream file(argv[i],std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(file)),std::istreambuf_iterator<char>());
+        if (!file){
+            std::cout<<"ERROR: cant read "<<argv[i]<<"\n";
             return 1;
         }
-        else{
-            board->time_control1=pow(2,64);
-            board->time_control2=pow(2,64);
+        LLVMFuzzerTestOneInput((const uint8_t*)data.data(),data.size());
+        inputs++;
+    }
+    if (argc<=1){
+        //No corpus: flip, cut and repeat bytes of known good positions
+        uint64_t state = 1;
+        for (int round=0;round<200000;round++){
+            std::string data = perft_suite[ZobristKeys::next(state)%(sizeof(perft_suite)/sizeof(perft_suite[0]))].fen;
+            int edits = 1+ZobristKeys::next(state)%4;
+            for (int edit=0;edit<edits && !data.empty();edit++){
+                uint64_t random = ZobristKeys::next(state);
+                size_t at = random%data.size();
+                switch (random>>32&3){
+                    case 0: data[at] = char(random>>40); break;
+                    case 1: data[at] = " /-12345678wbKQkqPNBRQpnbrqacdefgh"[(random>>40)%34]; break;
+                    case 2: data.erase(at,1+(random>>40)%4); break;
+                    case 3: data.insert(at,data.substr(at,1+(random>>40)%8)); break;
+                }
+            }
+            LLVMFuzzerTestOneInput((const uint8_t*)data.data(),data.size());
+            inputs++;
         }
     }
+    std::cout<<"Fuzz: "<<inputs<<" inputs passed\n";
     return 0;
 }
-
-bool arg_to_board(int argc, char* argv[],Board* board){
-    parse_game_mode(argc,argv,board);
-    parse_engine1_path(argc,argv,board);
-    parse_engine2_path(argc,argv,board);
-    parse_engine1_depth(argc,argv,board);
-    parse_engine2_depth(argc,argv,board);
-    parse_sides(argc,argv,board);
-    parse_position(argc,argv,board);
-    parse_time_control(argc,argv,board);
-    return 1;
-}
+#endif
+#endif
 
 //======= Main function =======//
 
+#ifndef CHESS_LIBFUZZER
 int main(int argc, char* argv[]){
+#ifdef CHESS_STUB_ENGINE
+    return StubEngine();
+#endif
+#ifdef CHESS_FUZZ
+    return FuzzReplay(argc,argv);
+#endif
+    //A crashed engine must not take us down when we write to it
+    signal(SIGPIPE,SIG_IGN);
+    if (argc>1 && std::string(argv[1])=="perft"){
+        return Perft(argc,argv);
+    }
+    if (argc>1 && std::string(argv[1])=="pgn"){
+        return ExportPgn(argc,argv);
+    }
+    if (argc>1 && std::string(argv[1])=="datagen"){
+        return RunDatagen(argc,argv);
+    }
+    if (argc>1 && std::string(argv[1])=="analyse"){
+        return Analyse(argc,argv);
+    }
+    if (argc>1 && std::string(argv[1])=="bench"){
+        return Bench(argc,argv);
+    }
+    if (argc>1 && std::string(argv[1])=="index"){
+        return BuildIndex(argc,argv);
+    }
+    if (argc>1 && std::string(argv[1])=="query"){
+        return QueryIndex(argc,argv);
+    }
+    if (argc>1 && std::string(argv[1])=="worker"){
+        return RemoteWorker(argc,argv);
+    }
     Board board;
 
    if(arg_to_board(argc,argv,&board)){
-       std::cout<<"Arguments parsed successfully.\n";
+       if (!board.headless){
+           std::cout<<"Arguments parsed successfully.\n";
+       }
    }
    else{
        std::cout<<"Error parsing arguments. Exiting.\n";
        return 1;
    }
-   std::cout<<board.game_mode<<"\n";
+   if (!board.headless){
+       std::cout<<board.game_mode<<"\n";
+   }
+   if (!logger.start(board.log_level,board.log_dir)){
+       std::cout<<"ERROR: cant create log directory "<<board.log_dir<<"\n";
+       return 1;
+   }
 
    if (board.game_mode=="human-vs-human" || board.game_mode=="hvh"){
        HumanVSHuman(&board);
@@ -618,13 +8110,22 @@ int main(int argc, char* argv[]){
        HumanVSEngine(&board);
    }
    else if (board.game_mode=="engine-vs-engine" || board.game_mode=="eve"){
-       EngineVSEngine(&board);
+       if (!board.coordinator.empty()){
+           Coordinator(&board,argc,argv);
+       }
+       else if (board.games>1){
+           Match(&board);
+       }
+       else{
+           EngineVSEngine(&board);
+       }
    }
    else{
        std::cout<<"Invalid game mode. Exiting.\n";
        return 1;
    }
 }
+#endif
 
 //ДОПИСАТЬ ФУНКЦИЮ main, ДОБАВИТЬ ТАЙМ-КОНТРОЛЬ, ДОБАВИТЬ ОБРАБОТКУ ХОДОВ ЧЕЛОВЕКА
 //СДЕЛАТЬ БАЗОВУЮ ПРОЫЕРКУ НА ХОД ЦВЕТОМ ФИГУРЫ, КОТОРАЯ ХОДИТ